@@ -0,0 +1,227 @@
+#ifndef ANGLEBINSH
+#define ANGLEBINSH
+#include <cstdlib>
+#include <cstdio>
+#include <iostream>
+#include <iomanip>
+#include <cmath>
+#include <vector>
+
+#include "Values.h"
+#include "Utils.h"
+#include "Vec3.h"
+
+// [comment]
+// Maps a unit direction to its (v, h) bin on a polar grid: theta = acos(dir.y) in [0,180] is cut
+// into bins of thetaRange/vRes degrees, phi = atan2(dir.z, dir.x) in [0,360) into bins of
+// 360/hRes degrees. lookup() gives the bins of lookupExact() without acos or atan2: cheap
+// polynomials guess the angles, then the guessed bins are moved to the right ones by comparing
+// dir with the cosines and sines of the bin boundaries, computed once.
+// Both may only differ for directions within float rounding of a boundary.
+// With ANGLE_MAPPING_CONCENTRIC the bins are an n*n grid of the square which the concentric
+// map of Shirley and Chiu takes to the disk, and the equal area projection of Lambert takes
+// the disk to the hemisphere around y: every bin has the same solid angle. A direction below
+// the horizon goes to the bin of the horizon.
+// With ANGLE_MAPPING_OCTAHEDRAL the bins are an n*n grid of the square which the equal area
+// octahedral map of Clarberg folds onto the whole sphere, with the same area for every bin.
+// [/comment]
+class AngleBins
+{
+public:
+    AngleBins() {}
+    AngleBins(const float range, const uint32_t verticalRes, const uint32_t horizonRes,
+              const AngleMapping angleMapping = ANGLE_MAPPING_POLAR) :
+        mapping(angleMapping), thetaRange(range), vRes(verticalRes), hRes(horizonRes)
+    {
+        if (vRes == 0 || hRes == 0 || mapping != ANGLE_MAPPING_POLAR) return;
+        // bins [0, vMax] cover theta up to 180, cosTheta[vMax+1] is below any dir.y
+        vMax = floor(180. / thetaRange * vRes);
+        cosTheta.resize(vMax + 2);
+        for (uint32_t k = 0; k <= vMax; k++)
+            cosTheta[k] = cos(k * (double)thetaRange / vRes * M_PI / 180.);
+        cosTheta[vMax + 1] = -2;
+        // boundary hRes is boundary 0 again
+        cosPhi.resize(hRes + 1);
+        sinPhi.resize(hRes + 1);
+        for (uint32_t k = 0; k <= hRes; k++) {
+            cosPhi[k] = (k % hRes == 0) ? 1 : cos(k * 2. * M_PI / hRes);
+            sinPhi[k] = (k % hRes == 0) ? 0 : sin(k * 2. * M_PI / hRes);
+        }
+        vScale = vRes / thetaRange * 180. / M_PI;
+        hScale = hRes / (2. * M_PI);
+    }
+
+    // bins of dir, and if asked the guessed theta and phi of dir in degrees (polar bins only)
+    void lookup(const Vec3f &dir, uint32_t &v, uint32_t &h, float *thetaDeg = nullptr, float *phiDeg = nullptr) const
+    {
+        if (mapping == ANGLE_MAPPING_CONCENTRIC) {
+            lookupConcentric(dir, v, h);
+            return;
+        }
+        if (mapping == ANGLE_MAPPING_OCTAHEDRAL) {
+            lookupOctahedral(dir, v, h);
+            return;
+        }
+        float theta = fastAcos(dir.y);
+        uint32_t bin = std::min((uint32_t)(theta * vScale), vMax);
+        while (bin > 0 && dir.y > cosTheta[bin]) bin--;
+        while (bin < vMax && dir.y <= cosTheta[bin + 1]) bin++;
+        v = bin;
+
+        float phi = 0;
+        if (dir.x == 0 && dir.z == 0) {
+            // atan2 of a vertical dir is 180 for x = -0, 0 otherwise
+            h = std::signbit(dir.x) ? hRes / 2 : 0;
+            phi = std::signbit(dir.x) ? M_PI : 0;
+        }
+        else {
+            phi = fastAtan2(dir.z, dir.x);
+            bin = std::min((uint32_t)(phi * hScale), hRes - 1);
+            // dir is past boundary k when it turns counterclockwise from it by less than 180
+            for (uint32_t n = 0; n < hRes && cosPhi[bin] * dir.z - sinPhi[bin] * dir.x < 0; n++)
+                bin = (bin == 0) ? hRes - 1 : bin - 1;
+            for (uint32_t n = 0; n < hRes && cosPhi[bin + 1] * dir.z - sinPhi[bin + 1] * dir.x >= 0; n++)
+                bin = (bin + 1 == hRes) ? 0 : bin + 1;
+            h = bin;
+        }
+        if (thetaDeg != nullptr) *thetaDeg = theta * (float)(180. / M_PI);
+        if (phiDeg != nullptr) *phiDeg = phi * (float)(180. / M_PI);
+    }
+
+    // direction of bin (v, h): its first corner for the polar bins, its center for the concentric ones
+    Vec3f direction(const uint32_t v, const uint32_t h) const
+    {
+        if (mapping == ANGLE_MAPPING_CONCENTRIC) {
+            float a = 2 * (v + 0.5f) / vRes - 1, b = 2 * (h + 0.5f) / hRes - 1;
+            float r = 0, phi = 0;
+            if (std::fabs(a) > std::fabs(b)) {
+                r = a;
+                phi = (float)(M_PI / 4) * b / a;
+            }
+            else if (b != 0) {
+                r = b;
+                phi = (float)(M_PI / 2) - (float)(M_PI / 4) * a / b;
+            }
+            float k = sqrtf(2 - r * r);
+            return Vec3f(r * cosf(phi) * k, 1 - r * r, r * sinf(phi) * k);
+        }
+        if (mapping == ANGLE_MAPPING_OCTAHEDRAL) {
+            // the square is 4 triangles folded over the upper half and 4 over the lower half
+            float a = 2 * (v + 0.5f) / vRes - 1, b = 2 * (h + 0.5f) / hRes - 1;
+            float signedDistance = 1 - (std::fabs(a) + std::fabs(b));
+            float r = 1 - std::fabs(signedDistance);
+            float phi = (r == 0 ? 1 : (std::fabs(b) - std::fabs(a)) / r + 1) * (float)(M_PI / 4);
+            float k = r * sqrtf(std::max(2 - r * r, 0.f));
+            return Vec3f(std::copysign(cosf(phi), a) * k, std::copysign(1 - r * r, signedDistance),
+                         std::copysign(sinf(phi), b) * k);
+        }
+        float theta = deg2rad(v*(double)thetaRange/vRes);
+        float phi = deg2rad(h*360.0/hRes);
+        return Vec3f(cos(phi)*sin(theta), cos(theta), sin(phi)*sin(theta));
+    }
+
+    // [comment]
+    // Solid angle of bin (v, h), to integrate over the bins with the colors of their direction.
+    // The direction of a polar bin is its first corner, so its band of theta is the one
+    // centered on the corner, the last band going on to thetaRange.
+    // [/comment]
+    float solidAngle(const uint32_t v, const uint32_t) const
+    {
+        if (mapping == ANGLE_MAPPING_CONCENTRIC) return 2 * M_PI / (vRes * hRes);
+        if (mapping == ANGLE_MAPPING_OCTAHEDRAL) return 4 * M_PI / (vRes * hRes);
+        double step = (double)thetaRange / vRes;
+        double theta0 = std::max(v - 0.5, 0.) * step;
+        double theta1 = std::min((v + 1 < vRes ? v + 0.5 : v + 1.) * step, 180.);
+        if (theta1 <= theta0) return 0;
+        return (cos(theta0 * M_PI / 180.) - cos(theta1 * M_PI / 180.)) * 2 * M_PI / hRes;
+    }
+
+    // atan of t in [-1, 1] with an error below 1e-5 rad
+    static float fastAtan(const float t)
+    {
+        float s = t * t;
+        return ((-0.0464964749f * s + 0.15931422f) * s - 0.327622764f) * s * t + t;
+    }
+
+    // the bins computed with acos and atan2
+    void lookupExact(const Vec3f &dir, uint32_t &v, uint32_t &h) const
+    {
+        float theta = rad2deg(acos(dir.y));
+        float phi = rad2deg(atan2(dir.z, dir.x));
+        v = floor(theta/thetaRange*vRes);
+        h = floor(phi/360.0*hRes);
+    }
+
+    AngleMapping mapping = ANGLE_MAPPING_POLAR;
+    float thetaRange = 0;
+    uint32_t vRes = 0, hRes = 0;
+
+private:
+    void lookupConcentric(const Vec3f &dir, uint32_t &v, uint32_t &h) const
+    {
+        // back to the disk, of radius sqrt(1 - y) for the equal area projection
+        float y = std::max(dir.y, 0.f);
+        float s = 1 / sqrtf(1 + y);
+        float dx = dir.x * s, dz = dir.z * s;
+        float r = sqrtf(dx * dx + dz * dz);
+        // back to the square
+        float a = 0, b = 0;
+        if (std::fabs(dx) > std::fabs(dz)) {
+            a = std::copysign(r, dx);
+            b = a * (float)(4 / M_PI) * fastAtan(dz / dx);
+        }
+        else if (r > 0) {
+            b = std::copysign(r, dz);
+            a = b * (float)(4 / M_PI) * fastAtan(dx / dz);
+        }
+        v = std::min((uint32_t)std::max((a + 1) * 0.5f * vRes, 0.f), vRes - 1);
+        h = std::min((uint32_t)std::max((b + 1) * 0.5f * hRes, 0.f), hRes - 1);
+    }
+    void lookupOctahedral(const Vec3f &dir, uint32_t &v, uint32_t &h) const
+    {
+        float x = std::fabs(dir.x), z = std::fabs(dir.z);
+        float r = sqrtf(std::max(1 - std::fabs(dir.y), 0.f));
+        float far = std::max(x, z), near = std::min(x, z);
+        float phi = (far == 0) ? 0 : fastAtan(near / far) * (float)(2 / M_PI);
+        if (x < z) phi = 1 - phi;
+        float b = phi * r, a = r - b;
+        if (dir.y < 0) {
+            std::swap(a, b);
+            a = 1 - a;
+            b = 1 - b;
+        }
+        a = std::copysign(a, dir.x);
+        b = std::copysign(b, dir.z);
+        v = std::min((uint32_t)std::max((a + 1) * 0.5f * vRes, 0.f), vRes - 1);
+        h = std::min((uint32_t)std::max((b + 1) * 0.5f * hRes, 0.f), hRes - 1);
+    }
+    // c - r if cond, r otherwise, without a branch on the signs of dir which are random
+    static float mirror(const float r, const bool cond, const float c)
+    {
+        float f = cond;
+        return f * c + (1 - 2 * f) * r;
+    }
+    // acos with an error below 7e-5 rad, Abramowitz and Stegun 4.4.45
+    static float fastAcos(const float y)
+    {
+        float a = std::min(std::fabs(y), 1.f);
+        float r = sqrtf(1 - a) * (1.5707288f + a * (-0.2121144f + a * (0.0742610f - 0.0187293f * a)));
+        return mirror(r, y < 0, (float)M_PI);
+    }
+    // atan2 in [0, 2pi) with an error below 1e-5 rad, (z, x) is not (0, 0)
+    static float fastAtan2(const float z, const float x)
+    {
+        float ax = std::fabs(x), az = std::fabs(z);
+        float r = fastAtan(std::min(ax, az) / std::max(ax, az));
+        r = mirror(r, az > ax, (float)(M_PI / 2));
+        r = mirror(r, x < 0, (float)M_PI);
+        return mirror(r, z < 0, (float)(2 * M_PI));
+    }
+
+    uint32_t vMax = 0;
+    float vScale = 0, hScale = 0;
+    std::vector<float> cosTheta;
+    std::vector<float> cosPhi, sinPhi;
+};
+
+#endif
@@ -0,0 +1,78 @@
+#ifndef BBOXH
+#define BBOXH
+#include <cstdlib>
+#include <cstdio>
+#include <iostream>
+#include <iomanip>
+#include <cmath>
+#include <limits>
+#include <algorithm>
+
+#include "Values.h"
+#include "Vec3.h"
+
+// axis aligned bounding box of an object or a primitive
+class BBox
+{
+public:
+    BBox() : pMin(kInfinity), pMax(-kInfinity) {}
+    BBox(const Vec3f &min, const Vec3f &max) : pMin(min), pMax(max) {}
+
+    void extend(const Vec3f &p)
+    {
+        pMin = Vec3f(std::min(pMin.x, p.x), std::min(pMin.y, p.y), std::min(pMin.z, p.z));
+        pMax = Vec3f(std::max(pMax.x, p.x), std::max(pMax.y, p.y), std::max(pMax.z, p.z));
+    }
+    void extend(const BBox &b)
+    {
+        extend(b.pMin);
+        extend(b.pMax);
+    }
+    // grow the box on every side, flat boxes (planar meshes) otherwise lose hits on their border
+    void pad(const float &delta)
+    {
+        pMin = pMin - delta;
+        pMax = pMax + delta;
+    }
+    bool overlaps(const BBox &b) const
+    {
+        return pMin.x <= b.pMax.x && b.pMin.x <= pMax.x &&
+               pMin.y <= b.pMax.y && b.pMin.y <= pMax.y &&
+               pMin.z <= b.pMax.z && b.pMin.z <= pMax.z;
+    }
+    bool empty(void) const { return pMin.x > pMax.x || pMin.y > pMax.y || pMin.z > pMax.z; }
+    Vec3f centroid(void) const { return (pMin + pMax) * 0.5; }
+    // the axis (0:x, 1:y, 2:z) with the largest extent
+    uint32_t maxExtent(void) const
+    {
+        Vec3f d = pMax - pMin;
+        if (d.x > d.y && d.x > d.z) return 0;
+        return d.y > d.z ? 1 : 2;
+    }
+    float area(void) const
+    {
+        if (empty()) return 0;
+        Vec3f d = pMax - pMin;
+        return 2 * (d.x * d.y + d.y * d.z + d.z * d.x);
+    }
+    // slab test, the ray is valid in [0, tMax]. tEnter returns where the ray enters the box.
+    bool intersect(const Vec3f &orig, const Vec3f &invDir, const float &tMax, float &tEnter) const
+    {
+        float t0 = 0, t1 = tMax;
+        for (uint8_t i = 0; i < 3; i++) {
+            float tNear = (pMin[i] - orig[i]) * invDir[i];
+            float tFar  = (pMax[i] - orig[i]) * invDir[i];
+            if (tNear > tFar) std::swap(tNear, tFar);
+            // written this way so that NaN (orig on the slab of a flat box) doesn't reject the box
+            t0 = tNear > t0 ? tNear : t0;
+            t1 = tFar < t1 ? tFar : t1;
+            if (t0 > t1) return false;
+        }
+        tEnter = t0;
+        return true;
+    }
+
+    Vec3f pMin, pMax;
+};
+
+#endif
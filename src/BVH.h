@@ -0,0 +1,289 @@
+#ifndef BVHH
+#define BVHH
+#include <cstdlib>
+#include <cstdio>
+#include <iostream>
+#include <iomanip>
+#include <cmath>
+#include <vector>
+#include <algorithm>
+
+#include "Values.h"
+#include "Vec3.h"
+#include "BBox.h"
+#include "RayPacket.h"
+
+// primitives in one leaf at most
+#define BVH_LEAF_SIZE   2
+// primitives in one leaf at most when the SAH decides it is cheaper than splitting
+#define BVH_MAX_LEAF_SIZE 8
+// buckets to evaluate the surface area heuristic on each axis
+#define BVH_SAH_BINS    12
+// depth of the traversal stack, the tree is never deeper than this
+#define BVH_STACK_DEPTH 64
+
+enum BVHSplitMethod { BVH_SPLIT_MEDIAN, BVH_SPLIT_SAH };
+
+// node of the bounding volume hierarchy, stored depth first in a flat array.
+// The left child of an interior node is always the next node in the array.
+struct BVHNode {
+    BBox bounds;
+    // leaf: index of the first primitive in primIndex; interior: index of the right child
+    uint32_t offset;
+    // number of primitives of a leaf, 0 for an interior node
+    uint32_t count;
+};
+
+// Bounding volume hierarchy over a list of primitives which are only known by their bounds.
+// The caller tests the primitives itself through the callback passed to intersect().
+class BVH
+{
+public:
+    BVH() {}
+
+    void build(const std::vector<BBox> &primBounds, const BVHSplitMethod method = BVH_SPLIT_MEDIAN)
+    {
+        splitMethod = method;
+        nodes.clear();
+        primIndex.resize(primBounds.size());
+        for (uint32_t i = 0; i < primIndex.size(); i++)
+            primIndex[i] = i;
+        if (primBounds.empty()) return;
+        nodes.reserve(primBounds.size() * 2);
+        buildRecursive(primBounds, 0, primBounds.size(), 0);
+    }
+    void clear(void)
+    {
+        nodes.clear();
+        primIndex.clear();
+    }
+    bool empty(void) const { return nodes.empty(); }
+    // number of primitives the tree is built for
+    uint32_t size(void) const { return primIndex.size(); }
+
+    // [comment]
+    // Walk the tree front to back. hitPrim(primIdx, tNear) tests one primitive and returns true
+    // (with tNear updated) if it is hit closer than tNear. Nodes entered behind the current
+    // closest hit are skipped. With anyHit the walk stops at the first primitive hit, for the
+    // occlusion queries which do not need the closest one.
+    // [/comment]
+    template<typename HitFunc>
+    bool intersect(const Vec3f &orig, const Vec3f &dir, float &tNear, HitFunc hitPrim, const bool anyHit = false) const
+    {
+        return intersectLeaves(orig, dir, tNear,
+            [&](uint32_t nodeIdx, float &tNearest) {
+                bool hitted = false;
+                const BVHNode &node = nodes[nodeIdx];
+                for (uint32_t i = node.offset; i < node.offset + node.count && !(hitted && anyHit); i++)
+                    if (hitPrim(primIndex[i], tNearest)) hitted = true;
+                return hitted;
+            }, anyHit);
+    }
+
+    // same walk as intersect(), but hitLeaf(nodeIdx, tNear) tests all the primitives of a leaf at once
+    template<typename HitFunc>
+    bool intersectLeaves(const Vec3f &orig, const Vec3f &dir, float &tNear, HitFunc hitLeaf, const bool anyHit = false) const
+    {
+        if (nodes.empty()) return false;
+        Vec3f invDir = 1.f / dir;
+        float tEnter;
+        if (!nodes[0].bounds.intersect(orig, invDir, tNear, tEnter)) return false;
+
+        struct { uint32_t node; float tEnter; } stack[BVH_STACK_DEPTH];
+        int32_t top = 0;
+        bool hitted = false;
+        stack[top].node = 0;
+        stack[top++].tEnter = tEnter;
+        while (top > 0) {
+            top--;
+            if (stack[top].tEnter > tNear) continue;
+            const BVHNode &node = nodes[stack[top].node];
+            if (node.count > 0) {
+                if (hitLeaf(stack[top].node, tNear)) {
+                    if (anyHit) return true;
+                    hitted = true;
+                }
+                continue;
+            }
+            uint32_t left = stack[top].node + 1, right = node.offset;
+            float tLeft = kInfinity, tRight = kInfinity;
+            bool hitLeft = nodes[left].bounds.intersect(orig, invDir, tNear, tLeft);
+            bool hitRight = nodes[right].bounds.intersect(orig, invDir, tNear, tRight);
+            if (hitLeft && hitRight) {
+                // push the far child first so that the near one is visited first
+                if (tLeft < tRight) {
+                    std::swap(left, right);
+                    std::swap(tLeft, tRight);
+                }
+                stack[top].node = left;
+                stack[top++].tEnter = tLeft;
+                stack[top].node = right;
+                stack[top++].tEnter = tRight;
+            }
+            else if (hitLeft) {
+                stack[top].node = left;
+                stack[top++].tEnter = tLeft;
+            }
+            else if (hitRight) {
+                stack[top].node = right;
+                stack[top++].tEnter = tRight;
+            }
+        }
+        return hitted;
+    }
+
+    // [comment]
+    // Walk the tree with a whole packet: a node is entered while packet.mayHit() its bounds,
+    // against the farthest closest hit of the rays, and hitPrim(primIdx) tests one primitive
+    // with every ray of the packet. The child nearer along the first ray is visited first.
+    // [/comment]
+    template<typename HitFunc>
+    void intersectPacket(RayPacket &packet, HitFunc hitPrim) const
+    {
+        intersectPacketLeaves(packet,
+            [&](uint32_t nodeIdx) {
+                const BVHNode &node = nodes[nodeIdx];
+                for (uint32_t i = node.offset; i < node.offset + node.count; i++)
+                    hitPrim(primIndex[i]);
+            });
+    }
+
+    // same walk as intersectPacket(), but hitLeaf(nodeIdx) tests all the primitives of a leaf at once
+    template<typename HitFunc>
+    void intersectPacketLeaves(RayPacket &packet, HitFunc hitLeaf) const
+    {
+        if (nodes.empty() || packet.size == 0) return;
+        Vec3f dir = packet.direction(0);
+        uint32_t stack[BVH_STACK_DEPTH];
+        int32_t top = 0;
+        stack[top++] = 0;
+        while (top > 0) {
+            uint32_t nodeIdx = stack[--top];
+            const BVHNode &node = nodes[nodeIdx];
+            if (!packet.mayHit(node.bounds)) continue;
+            if (node.count > 0) {
+                hitLeaf(nodeIdx);
+                continue;
+            }
+            uint32_t left = nodeIdx + 1, right = node.offset;
+            // push the far child first so that the near one is visited first
+            if ((nodes[left].bounds.centroid() - packet.orig).dotProduct(dir) <
+                (nodes[right].bounds.centroid() - packet.orig).dotProduct(dir))
+                std::swap(left, right);
+            stack[top++] = left;
+            stack[top++] = right;
+        }
+    }
+
+    std::vector<BVHNode> nodes;
+    // primitives referenced by the leaves
+    std::vector<uint32_t> primIndex;
+    BVHSplitMethod splitMethod = BVH_SPLIT_MEDIAN;
+
+private:
+    // [comment]
+    // Binned surface area heuristic: centroids are dropped into BVH_SAH_BINS buckets along
+    // each axis and the cheapest bucket boundary is returned (traversal cost 1, intersection cost 1).
+    // Returns false if making a leaf is cheaper than any split.
+    // [/comment]
+    bool findSAHSplit(const std::vector<BBox> &primBounds, uint32_t start, uint32_t end,
+                      const BBox &bounds, const BBox &centroidBounds, uint32_t &axis, uint32_t &mid)
+    {
+        uint32_t num = end - start;
+        float bestCost = kInfinity;
+        uint32_t bestAxis = 0, bestBin = 0;
+        for (uint32_t a = 0; a < 3; a++) {
+            float lo = centroidBounds.pMin[a], extent = centroidBounds.pMax[a] - lo;
+            if (extent <= 0) continue;
+            BBox binBounds[BVH_SAH_BINS];
+            uint32_t binCount[BVH_SAH_BINS] = {0};
+            for (uint32_t i = start; i < end; i++) {
+                uint32_t b = BVH_SAH_BINS * ((primBounds[primIndex[i]].centroid()[a] - lo) / extent);
+                if (b >= BVH_SAH_BINS) b = BVH_SAH_BINS - 1;
+                binCount[b]++;
+                binBounds[b].extend(primBounds[primIndex[i]]);
+            }
+            // sweep from the right to get the cost of the right side of every boundary
+            float rightArea[BVH_SAH_BINS];
+            uint32_t rightCount[BVH_SAH_BINS];
+            BBox right;
+            uint32_t count = 0;
+            for (int32_t b = BVH_SAH_BINS - 1; b > 0; b--) {
+                right.extend(binBounds[b]);
+                count += binCount[b];
+                rightArea[b] = right.area();
+                rightCount[b] = count;
+            }
+            BBox left;
+            count = 0;
+            for (uint32_t b = 1; b < BVH_SAH_BINS; b++) {
+                left.extend(binBounds[b - 1]);
+                count += binCount[b - 1];
+                if (count == 0 || rightCount[b] == 0) continue;
+                float cost = left.area() * count + rightArea[b] * rightCount[b];
+                if (cost < bestCost) {
+                    bestCost = cost;
+                    bestAxis = a;
+                    bestBin = b;
+                }
+            }
+        }
+        // all centroids on one point, nothing to split
+        if (bestCost == kInfinity) return false;
+        float area = bounds.area();
+        bestCost = 1 + (area > 0 ? bestCost / area : num);
+        if (num <= BVH_MAX_LEAF_SIZE && bestCost >= num) return false;
+
+        axis = bestAxis;
+        float lo = centroidBounds.pMin[axis], extent = centroidBounds.pMax[axis] - lo;
+        uint32_t *pMid = std::partition(&primIndex[start], &primIndex[0] + end,
+            [&](uint32_t p) {
+                uint32_t b = BVH_SAH_BINS * ((primBounds[p].centroid()[axis] - lo) / extent);
+                if (b >= BVH_SAH_BINS) b = BVH_SAH_BINS - 1;
+                return b < bestBin;
+            });
+        mid = pMid - &primIndex[0];
+        return true;
+    }
+
+    void buildRecursive(const std::vector<BBox> &primBounds, uint32_t start, uint32_t end, uint32_t depth)
+    {
+        uint32_t nodeIdx = nodes.size();
+        nodes.push_back(BVHNode());
+        BBox bounds, centroidBounds;
+        for (uint32_t i = start; i < end; i++) {
+            bounds.extend(primBounds[primIndex[i]]);
+            centroidBounds.extend(primBounds[primIndex[i]].centroid());
+        }
+        nodes[nodeIdx].bounds = bounds;
+
+        uint32_t num = end - start;
+        uint32_t axis = centroidBounds.maxExtent();
+        uint32_t mid = start + num / 2;
+        bool makeLeaf = (num <= BVH_LEAF_SIZE || depth >= BVH_STACK_DEPTH - 2);
+        bool splitted = false;
+        if (!makeLeaf && splitMethod == BVH_SPLIT_SAH) {
+            splitted = findSAHSplit(primBounds, start, end, bounds, centroidBounds, axis, mid);
+            // big nodes which can't be binned fall back to the median split below
+            makeLeaf = (!splitted && num <= BVH_MAX_LEAF_SIZE);
+        }
+        if (makeLeaf) {
+            nodes[nodeIdx].offset = start;
+            nodes[nodeIdx].count = num;
+            return;
+        }
+        if (!splitted) {
+            // split at the median of centroids along the largest axis
+            std::nth_element(&primIndex[start], &primIndex[mid], &primIndex[0] + end,
+                [&](uint32_t a, uint32_t b) {
+                    return primBounds[a].centroid()[axis] < primBounds[b].centroid()[axis];
+                });
+        }
+        buildRecursive(primBounds, start, mid, depth + 1);
+        nodes[nodeIdx].offset = nodes.size();
+        nodes[nodeIdx].count = 0;
+        buildRecursive(primBounds, mid, end, depth + 1);
+    }
+};
+
+#endif
@@ -0,0 +1,254 @@
+#ifndef BAKECACHEH
+#define BAKECACHEH
+#include <cstdlib>
+#include <cstdio>
+#include <iostream>
+#include <iomanip>
+#include <cmath>
+#include <cstring>
+#include <vector>
+#include <memory>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "Values.h"
+#include "Utils.h"
+#include "Light.h"
+#include "Option.h"
+#include "Object.h"
+
+#define BAKE_CACHE_MAGIC   0x454b414259415243ULL    // "CRAYBAKE"
+#define BAKE_CACHE_VERSION 3
+
+// [comment]
+// Layout of a bake cache file: the header, one BakeCacheObject per object, then for each
+// object its diffuseAmt grid (numSurfaces Vec3f) followed by its angle slab
+// (numSurfaces*angleStride SurfaceAngle) and its SH slab (numSurfaces*shStride Vec3f).
+// Every block starts at a multiple of 16 bytes.
+// [/comment]
+struct BakeCacheHeader {
+    uint64_t magic;
+    uint32_t version;
+    uint32_t objectNum;
+    // sceneHash() of the scene the data was baked for
+    uint64_t sceneHash;
+    uint32_t angleSize;
+    uint32_t pad;
+};
+
+struct BakeCacheObject {
+    uint32_t numSurfaces;
+    uint32_t angleStride;
+    uint32_t shStride;
+    uint32_t pad;
+    // offsets in the file of the diffuseAmt grid, of the angle slab and of the SH slab
+    uint64_t diffuseOffset;
+    uint64_t angleOffset;
+    uint64_t shOffset;
+};
+
+// [comment]
+// Results of lightRender() and objectRender() saved to disk. The cache is keyed by a hash of
+// everything the bake depends on: the geometry, resolution and material of the objects, the
+// lights and the options of the light transport. A run with a matching cache maps the file,
+// copies the diffuseAmt grids and the SH slabs, and renders straight from the mapped angle slabs.
+// [/comment]
+class BakeCache
+{
+public:
+    BakeCache() {}
+    ~BakeCache() { unmap(); }
+
+    static uint64_t sceneHash(
+        const Options &options,
+        const std::vector<std::unique_ptr<Object>> &objects,
+        const std::vector<std::unique_ptr<Light>> &lights)
+    {
+        uint64_t hash = HASH_SEED;
+        uint32_t version = BAKE_CACHE_VERSION;
+        hash = hashBytes(hash, &version, sizeof(version));
+        float density = RAY_CAST_DESITY;
+        hash = hashBytes(hash, &density, sizeof(density));
+        hash = hashBytes(hash, &options.diffuseSpliter, sizeof(options.diffuseSpliter));
+        hash = hashBytes(hash, &options.maxDepth, sizeof(options.maxDepth));
+        hash = hashBytes(hash, &options.bias, sizeof(options.bias));
+        hash = hashBytes(hash, &options.backgroundColor, sizeof(options.backgroundColor));
+        for (uint32_t i = 0; i < objects.size(); i++) {
+            const Object &obj = *objects[i];
+            hash = hashBytes(hash, obj.name.c_str(), obj.name.size());
+            hash = hashBytes(hash, &obj.type, sizeof(obj.type));
+            hash = hashBytes(hash, &obj.materialType, sizeof(obj.materialType));
+            hash = hashBytes(hash, &obj.ior, sizeof(obj.ior));
+            hash = hashBytes(hash, &obj.Kd, sizeof(obj.Kd));
+            hash = hashBytes(hash, &obj.Ks, sizeof(obj.Ks));
+            hash = hashBytes(hash, &obj.diffuseColor, sizeof(obj.diffuseColor));
+            hash = hashBytes(hash, &obj.localDiffuseColor, sizeof(obj.localDiffuseColor));
+            hash = hashBytes(hash, &obj.specularExponent, sizeof(obj.specularExponent));
+            hash = hashBytes(hash, &obj.vRes, sizeof(obj.vRes));
+            hash = hashBytes(hash, &obj.hRes, sizeof(obj.hRes));
+            hash = hashBytes(hash, &obj.angleStride, sizeof(obj.angleStride));
+            hash = hashBytes(hash, &obj.shStride, sizeof(obj.shStride));
+            hash = hashBytes(hash, &obj.angleMapping, sizeof(obj.angleMapping));
+            hash = obj.hashGeometry(hash);
+        }
+        for (uint32_t i = 0; i < lights.size(); i++) {
+            hash = hashBytes(hash, &lights[i]->position, sizeof(lights[i]->position));
+            hash = hashBytes(hash, &lights[i]->intensity, sizeof(lights[i]->intensity));
+        }
+        return hash;
+    }
+
+    // [comment]
+    // Write the baked data of the objects to path. The file is written aside and renamed,
+    // so that a reader never sees half of it.
+    // [/comment]
+    static bool save(const char *path, const uint64_t hash, const std::vector<std::unique_ptr<Object>> &objects)
+    {
+        std::vector<BakeCacheObject> entries(objects.size());
+        uint64_t offset = align(sizeof(BakeCacheHeader) + sizeof(BakeCacheObject) * objects.size());
+        for (uint32_t i = 0; i < objects.size(); i++) {
+            entries[i].numSurfaces = objects[i]->numSurfaces;
+            entries[i].angleStride = objects[i]->angleStride;
+            entries[i].shStride = objects[i]->shStride;
+            entries[i].pad = 0;
+            entries[i].diffuseOffset = offset;
+            offset = align(offset + sizeof(Vec3f) * objects[i]->numSurfaces);
+            entries[i].angleOffset = offset;
+            offset = align(offset + sizeof(SurfaceAngle) * (MY_UINT64_T)objects[i]->numSurfaces * objects[i]->angleStride);
+            entries[i].shOffset = offset;
+            offset = align(offset + sizeof(Vec3f) * (MY_UINT64_T)objects[i]->numSurfaces * objects[i]->shStride);
+        }
+
+        std::string tmpPath = std::string(path) + ".tmp";
+        FILE *fp = fopen(tmpPath.c_str(), "wb");
+        if (fp == nullptr) {
+            std::printf("bake cache: failed to create %s\n", tmpPath.c_str());
+            return false;
+        }
+        BakeCacheHeader header;
+        std::memset(&header, 0, sizeof(header));
+        header.magic = BAKE_CACHE_MAGIC;
+        header.version = BAKE_CACHE_VERSION;
+        header.objectNum = objects.size();
+        header.sceneHash = hash;
+        header.angleSize = sizeof(SurfaceAngle);
+        bool ok = fwrite(&header, sizeof(header), 1, fp) == 1 &&
+                  fwrite(entries.data(), sizeof(BakeCacheObject), entries.size(), fp) == entries.size();
+        std::vector<Vec3f> diffuseAmt;
+        for (uint32_t i = 0; ok && i < objects.size(); i++) {
+            const Object &obj = *objects[i];
+            diffuseAmt.resize(obj.numSurfaces);
+            for (uint32_t s = 0; s < obj.numSurfaces; s++)
+                diffuseAmt[s] = obj.surfaces[s].diffuseAmt;
+            ok = fseek(fp, entries[i].diffuseOffset, SEEK_SET) == 0 &&
+                 fwrite(diffuseAmt.data(), sizeof(Vec3f), diffuseAmt.size(), fp) == diffuseAmt.size();
+            // the angles of all the shade points are one slab starting at the angles of the first one
+            MY_UINT64_T angleNum = (MY_UINT64_T)obj.numSurfaces * obj.angleStride;
+            if (ok && angleNum > 0)
+                ok = fseek(fp, entries[i].angleOffset, SEEK_SET) == 0 &&
+                     fwrite(obj.surfaces[0].angles, sizeof(SurfaceAngle), angleNum, fp) == angleNum;
+            MY_UINT64_T shNum = (MY_UINT64_T)obj.numSurfaces * obj.shStride;
+            if (ok && shNum > 0)
+                ok = fseek(fp, entries[i].shOffset, SEEK_SET) == 0 &&
+                     fwrite(obj.surfaceSH.get(), sizeof(Vec3f), shNum, fp) == shNum;
+        }
+        ok = (fclose(fp) == 0) && ok;
+        if (ok) ok = (rename(tmpPath.c_str(), path) == 0);
+        if (!ok) {
+            std::printf("bake cache: failed to write %s\n", path);
+            remove(tmpPath.c_str());
+        }
+        return ok;
+    }
+
+    // [comment]
+    // Map path and, if it was baked for hash and for these objects, load it into them:
+    // diffuseAmt and the SH slabs are copied and the shade points are pointed to the mapped
+    // angles, which stay valid until detach() or the destruction of the cache.
+    // [/comment]
+    bool load(const char *path, const uint64_t hash, const std::vector<std::unique_ptr<Object>> &objects)
+    {
+        unmap();
+        int fd = open(path, O_RDONLY);
+        if (fd < 0) return false;
+        struct stat st;
+        if (fstat(fd, &st) != 0 || (uint64_t)st.st_size < sizeof(BakeCacheHeader)) {
+            close(fd);
+            return false;
+        }
+        // private and writable: a render may still write the angles, which never reaches the file
+        void *addr = mmap(nullptr, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (addr == MAP_FAILED) return false;
+        base = (char *)addr;
+        size = st.st_size;
+        this->objects = &objects;
+
+        if (!validate(hash, objects)) {
+            unmap();
+            return false;
+        }
+        const BakeCacheObject *entries = (const BakeCacheObject *)(base + sizeof(BakeCacheHeader));
+        for (uint32_t i = 0; i < objects.size(); i++) {
+            Object &obj = *objects[i];
+            const Vec3f *diffuseAmt = (const Vec3f *)(base + entries[i].diffuseOffset);
+            for (uint32_t s = 0; s < obj.numSurfaces; s++)
+                obj.surfaces[s].diffuseAmt = diffuseAmt[s];
+            if (obj.angleStride > 0)
+                obj.attachAngleSlab((SurfaceAngle *)(base + entries[i].angleOffset));
+            if (obj.shStride > 0)
+                std::memcpy(obj.surfaceSH.get(), base + entries[i].shOffset,
+                            sizeof(Vec3f) * (MY_UINT64_T)obj.numSurfaces * obj.shStride);
+        }
+        return true;
+    }
+
+    // give the objects their own angles back and unmap the file
+    void detach(void) { unmap(); }
+
+private:
+    static uint64_t align(const uint64_t offset) { return (offset + 15) & ~(uint64_t)15; }
+
+    bool validate(const uint64_t hash, const std::vector<std::unique_ptr<Object>> &objects) const
+    {
+        const BakeCacheHeader *header = (const BakeCacheHeader *)base;
+        if (header->magic != BAKE_CACHE_MAGIC || header->version != BAKE_CACHE_VERSION ||
+            header->sceneHash != hash || header->objectNum != objects.size() ||
+            header->angleSize != sizeof(SurfaceAngle))
+            return false;
+        if (size < sizeof(BakeCacheHeader) + sizeof(BakeCacheObject) * objects.size())
+            return false;
+        const BakeCacheObject *entries = (const BakeCacheObject *)(base + sizeof(BakeCacheHeader));
+        for (uint32_t i = 0; i < objects.size(); i++) {
+            const BakeCacheObject &entry = entries[i];
+            if (entry.numSurfaces != objects[i]->numSurfaces || entry.angleStride != objects[i]->angleStride ||
+                entry.shStride != objects[i]->shStride)
+                return false;
+            if (entry.diffuseOffset + sizeof(Vec3f) * entry.numSurfaces > size ||
+                entry.angleOffset + sizeof(SurfaceAngle) * (MY_UINT64_T)entry.numSurfaces * entry.angleStride > size ||
+                entry.shOffset + sizeof(Vec3f) * (MY_UINT64_T)entry.numSurfaces * entry.shStride > size)
+                return false;
+        }
+        return true;
+    }
+
+    void unmap(void)
+    {
+        if (base == nullptr) return;
+        for (uint32_t i = 0; objects != nullptr && i < objects->size(); i++)
+            (*objects)[i]->attachAngleSlab(nullptr);
+        munmap(base, size);
+        base = nullptr;
+        size = 0;
+        objects = nullptr;
+    }
+
+    char *base = nullptr;
+    uint64_t size = 0;
+    // objects pointing to the mapped angles
+    const std::vector<std::unique_ptr<Object>> *objects = nullptr;
+};
+
+#endif
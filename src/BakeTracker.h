@@ -0,0 +1,172 @@
+#ifndef BAKETRACKERH
+#define BAKETRACKERH
+#include <cstdlib>
+#include <cstdio>
+#include <iostream>
+#include <iomanip>
+#include <cmath>
+#include <vector>
+#include <memory>
+
+#include "Values.h"
+#include "Vec3.h"
+#include "BBox.h"
+#include "Light.h"
+#include "Option.h"
+#include "Object.h"
+#include "BakeCache.h"
+
+// diffuseAmt added to a shade point by a forward ray
+struct BakeDeposit {
+    Object *object;
+    uint32_t surface;
+    Vec3f amt;
+};
+
+// [comment]
+// Where the rays cast for one shade point went during a bake: the bounds of every segment
+// they traced, and for lightRender what they added to the diffuseAmt of the shade points.
+// [/comment]
+struct BakePath {
+    void clear(void)
+    {
+        bounds = BBox();
+        deposits.clear();
+    }
+    BBox bounds;
+    std::vector<BakeDeposit> deposits;
+};
+
+// [comment]
+// Follows the objects from one bake to the next, so that only the shade points which may have
+// changed are baked again. An object changed when its geometryVersion moved since the last
+// bake. The rays of a shade point must be cast again if it belongs to a changed object, or if
+// its path went through the bounds a changed object had at the last bake or has now.
+// The deposits of the lightRender paths to cast again are taken back from diffuseAmt first.
+// A change of the lights or of the options bakes everything again.
+// [/comment]
+class BakeTracker
+{
+public:
+    // [comment]
+    // Flag the light targets and the angle surfaces to bake again, and take their previous
+    // contribution back. Call it once the changed objects are reset(), before the bake passes.
+    // [/comment]
+    void update(
+        const Options &options,
+        const std::vector<std::unique_ptr<Object>> &objects,
+        const std::vector<std::unique_ptr<Light>> &lights)
+    {
+        uint64_t key = BakeCache::sceneHash(options, std::vector<std::unique_ptr<Object>>(), lights);
+        bool full = (key != lightsKey || bakedObjects.size() != objects.size());
+        for (uint32_t i = 0; !full && i < objects.size(); i++)
+            full = (bakedObjects[i] != objects[i].get() || lightPaths[i].size() != objects[i]->numSurfaces);
+        lightsKey = key;
+
+        // bounds of the changed objects, at the last bake and now
+        std::vector<BBox> regions;
+        std::vector<bool> changed(objects.size(), true);
+        BBox scene;
+        for (uint32_t i = 0; i < objects.size(); i++) {
+            BBox bounds = objects[i]->getBounds();
+            bounds.pad(BVH_BOUNDS_PAD);
+            scene.extend(bounds);
+            if (full) continue;
+            changed[i] = (objects[i]->geometryVersion != bakedVersion[i]);
+            if (!changed[i]) continue;
+            regions.push_back(bakedBounds[i]);
+            regions.push_back(bounds);
+        }
+        for (uint32_t l = 0; l < lights.size(); l++)
+            scene.extend(lights[l]->position);
+        // rays hitting nothing are followed until they are out of the scene
+        pathFar = scene.empty() ? 0 : 2 * (scene.pMax - scene.pMin).length();
+
+        if (full) {
+            bakedObjects.resize(objects.size());
+            lightPaths.assign(objects.size(), std::vector<BakePath>());
+            anglePaths.assign(objects.size(), std::vector<BakePath>());
+            for (uint32_t i = 0; i < objects.size(); i++) {
+                bakedObjects[i] = objects[i].get();
+                lightPaths[i].resize(objects[i]->numSurfaces);
+                anglePaths[i].resize(objects[i]->surfaceAngleRatio > 0. ? objects[i]->numSurfaces : 0);
+            }
+        }
+
+        lightDirtyNum = angleDirtyNum = 0;
+        lightDirty.resize(objects.size());
+        angleDirty.resize(objects.size());
+        for (uint32_t i = 0; i < objects.size(); i++) {
+            lightDirty[i].assign(lightPaths[i].size(), changed[i]);
+            angleDirty[i].assign(anglePaths[i].size(), changed[i]);
+            for (uint32_t s = 0; s < lightPaths[i].size(); s++) {
+                if (!changed[i] && throughRegions(lightPaths[i][s].bounds, regions))
+                    lightDirty[i][s] = true;
+                if (!lightDirty[i][s]) continue;
+                lightDirtyNum++;
+                const std::vector<BakeDeposit> &deposits = lightPaths[i][s].deposits;
+                for (uint32_t d = 0; d < deposits.size(); d++) {
+                    Vec3f &diffuseAmt = deposits[d].object->surfaces[deposits[d].surface].diffuseAmt;
+                    diffuseAmt = diffuseAmt - deposits[d].amt;
+                }
+                lightPaths[i][s].clear();
+            }
+            for (uint32_t s = 0; s < anglePaths[i].size(); s++) {
+                if (!changed[i] && throughRegions(anglePaths[i][s].bounds, regions))
+                    angleDirty[i][s] = true;
+                if (!angleDirty[i][s]) continue;
+                angleDirtyNum++;
+                anglePaths[i][s].clear();
+            }
+        }
+        // every ray which added to a changed object was taken back, clear the rounding left
+        for (uint32_t i = 0; i < objects.size(); i++)
+            for (uint32_t s = 0; changed[i] && s < objects[i]->numSurfaces; s++)
+                objects[i]->surfaces[s].diffuseAmt = 0;
+    }
+
+    // object i needs no reset(): it is baked and did not change since
+    bool isBaked(const uint32_t i, const Object *object) const
+    {
+        return i < bakedVersion.size() && bakedObjects[i] == object && bakedVersion[i] == object->geometryVersion;
+    }
+
+    // the objects as they are baked now
+    void commit(const std::vector<std::unique_ptr<Object>> &objects)
+    {
+        bakedVersion.resize(objects.size());
+        bakedBounds.resize(objects.size());
+        for (uint32_t i = 0; i < objects.size(); i++) {
+            bakedVersion[i] = objects[i]->geometryVersion;
+            bakedBounds[i] = objects[i]->getBounds();
+            bakedBounds[i].pad(BVH_BOUNDS_PAD);
+        }
+    }
+
+    // [object][surface idx], lightPaths for the targets of lightRender and anglePaths for the
+    // surfaces of objectRender
+    std::vector<std::vector<BakePath>> lightPaths;
+    std::vector<std::vector<BakePath>> anglePaths;
+    std::vector<std::vector<bool>> lightDirty;
+    std::vector<std::vector<bool>> angleDirty;
+    uint32_t lightDirtyNum = 0;
+    uint32_t angleDirtyNum = 0;
+    // length of the segment recorded for a ray which hits nothing
+    float pathFar = 0;
+
+private:
+    static bool throughRegions(const BBox &bounds, const std::vector<BBox> &regions)
+    {
+        for (uint32_t r = 0; r < regions.size(); r++)
+            if (bounds.overlaps(regions[r])) return true;
+        return false;
+    }
+
+    // hash of the lights and of the options, see BakeCache::sceneHash()
+    uint64_t lightsKey = 0;
+    std::vector<Object *> bakedObjects;
+    std::vector<uint32_t> bakedVersion;
+    std::vector<BBox> bakedBounds;
+};
+
+#endif
@@ -0,0 +1,117 @@
+#ifndef LIGHTBAKEH
+#define LIGHTBAKEH
+#include <cstdlib>
+#include <cstdio>
+#include <iostream>
+#include <iomanip>
+#include <cmath>
+#include <vector>
+#include <memory>
+
+#include "Values.h"
+#include "Vec3.h"
+#include "Light.h"
+#include "Object.h"
+
+// [comment]
+// Contributions of each light to Surface::diffuseAmt, kept between two lightRender so that a
+// change of the lights only re-bakes the forward pass of the lights which changed.
+// A contribution only depends on the scene and on the position and intensity of its light,
+// so it is looked up by these values: a moved or re-intensified light is a new light, and
+// the contribution of a removed light is dropped. diffuseAmt is the sum of the contributions
+// of the current lights.
+// [/comment]
+class LightBake
+{
+public:
+    struct Contribution {
+        Contribution(const Light &l) : light(l) {}
+        Light light;
+        // [object][surface idx]
+        std::vector<std::vector<Vec3f>> diffuseAmt;
+    };
+
+    // forget every contribution if the scene (anything but the lights) changed
+    void setScene(const uint64_t hash)
+    {
+        if (hash != sceneHash)
+            contributions.clear();
+        sceneHash = hash;
+    }
+
+    // drop the contributions of the lights which are gone
+    void prune(const std::vector<std::unique_ptr<Light>> &lights)
+    {
+        std::vector<Contribution> kept;
+        for (uint32_t i = 0; i < contributions.size(); i++) {
+            for (uint32_t l = 0; l < lights.size(); l++) {
+                if (same(contributions[i].light, *lights[l])) {
+                    kept.push_back(contributions[i]);
+                    break;
+                }
+            }
+        }
+        contributions.swap(kept);
+    }
+
+    // lights of the scene without contribution yet
+    std::vector<uint32_t> staleLights(const std::vector<std::unique_ptr<Light>> &lights) const
+    {
+        std::vector<uint32_t> stale;
+        for (uint32_t l = 0; l < lights.size(); l++)
+            if (lookup(*lights[l]) == nullptr)
+                stale.push_back(l);
+        return stale;
+    }
+
+    // diffuseAmt of the surfaces is the contribution of light, after a pass of light alone
+    void add(const Light &light, const std::vector<std::unique_ptr<Object>> &objects)
+    {
+        contributions.push_back(Contribution(light));
+        Contribution &contribution = contributions.back();
+        contribution.diffuseAmt.resize(objects.size());
+        for (uint32_t i = 0; i < objects.size(); i++) {
+            contribution.diffuseAmt[i].resize(objects[i]->numSurfaces);
+            for (uint32_t s = 0; s < objects[i]->numSurfaces; s++)
+                contribution.diffuseAmt[i][s] = objects[i]->surfaces[s].diffuseAmt;
+        }
+    }
+
+    static void clearDiffuseAmt(const std::vector<std::unique_ptr<Object>> &objects)
+    {
+        for (uint32_t i = 0; i < objects.size(); i++)
+            for (uint32_t s = 0; s < objects[i]->numSurfaces; s++)
+                objects[i]->surfaces[s].diffuseAmt = 0;
+    }
+
+    // set diffuseAmt of the surfaces to the sum of the contributions of lights, in their order
+    void apply(const std::vector<std::unique_ptr<Light>> &lights, const std::vector<std::unique_ptr<Object>> &objects) const
+    {
+        clearDiffuseAmt(objects);
+        for (uint32_t l = 0; l < lights.size(); l++) {
+            const Contribution *contribution = lookup(*lights[l]);
+            if (contribution == nullptr) continue;
+            for (uint32_t i = 0; i < objects.size(); i++)
+                for (uint32_t s = 0; s < objects[i]->numSurfaces; s++)
+                    objects[i]->surfaces[s].diffuseAmt += contribution->diffuseAmt[i][s];
+        }
+    }
+
+    std::vector<Contribution> contributions;
+    uint64_t sceneHash = 0;
+
+private:
+    static bool same(const Light &a, const Light &b)
+    {
+        return !(a.position != b.position) && !(a.intensity != b.intensity);
+    }
+    const Contribution *lookup(const Light &light) const
+    {
+        for (uint32_t i = 0; i < contributions.size(); i++)
+            if (same(contributions[i].light, light))
+                return &contributions[i];
+        return nullptr;
+    }
+};
+
+#endif
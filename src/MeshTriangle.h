@@ -6,6 +6,9 @@
 #include <iomanip>
 #include <cmath>
 
+#include "BVH.h"
+#include "TriangleBlock.h"
+
 class MeshTriangle : public Object
 {
 public:
@@ -32,6 +35,7 @@ public:
         for (uint32_t i = 0; i < numTris * 3; ++i)
             if (vertsIndex[i] > maxIndex) maxIndex = vertsIndex[i];
         maxIndex += 1;
+        numVertices = maxIndex;
         vertices = std::unique_ptr<Vec3f[]>(new Vec3f[maxIndex]);
         memcpy(vertices.get(), verts, sizeof(Vec3f) * maxIndex);
         vertexIndex = std::unique_ptr<uint32_t[]>(new uint32_t[numTris * 3]);
@@ -39,7 +43,9 @@ public:
         numTriangles = numTris;
         stCoordinates = std::unique_ptr<Vec2f[]>(new Vec2f[maxIndex]);
         memcpy(stCoordinates.get(), st, sizeof(Vec2f) * maxIndex);
-        
+        buildTrianglesBVH();
+
+
         const Vec3f &v0 = vertices[vertexIndex[0]];
         const Vec3f &v1 = vertices[vertexIndex[1]];
         const Vec3f &v2 = vertices[vertexIndex[2]];
@@ -51,16 +57,9 @@ public:
         setType(OBJECT_TYPE_MESH);
         setName(name);
         setResolution(vRes, hRes);
-        //MY_UINT64_T size = (MY_UINT64_T)sizeof(Surface) * vRes * hRes;
-        //pSurfaces = (Surface *)malloc(size);
-        uint32_t vAngleRes = 0;
-        uint32_t hAngleRes = 0;
-        for (uint32_t i=0; i<vRes*hRes; i++) {
-            Surface *surface = new Surface(surfaceAngleRatio);
-            pSurfaces.push_back(std::unique_ptr<Surface>(surface));
-            if (vAngleRes < surface->vAngleRes) vAngleRes = surface->vAngleRes;
-            if (hAngleRes < surface->hAngleRes) hAngleRes = surface->hAngleRes;
-        }
+        initSurfaces(vRes*hRes, surfaceAngleRatio);
+        uint32_t vAngleRes = numSurfaces > 0 ? surfaces[0].vAngleRes : 0;
+        uint32_t hAngleRes = numSurfaces > 0 ? surfaces[0].hAngleRes : 0;
         reset();
 
         uint64_t raysNum = vRes*hRes + vRes*hRes*vAngleRes*hAngleRes;
@@ -68,11 +67,33 @@ public:
                     name.c_str(), vRes*hRes, vRes, hRes, vAngleRes*hAngleRes, vAngleRes, hAngleRes, raysNum);
     }
 
+    // [comment]
+    // Move the vertices (same number and order), reset() places the shade points again.
+    // The grid of shade points keeps the resolution it was built with.
+    // [/comment]
+    void setVertices(const Vec3f *verts)
+    {
+        memcpy(vertices.get(), verts, sizeof(Vec3f) * numVertices);
+        buildTrianglesBVH();
+        geometryChanged();
+    }
+
+    uint64_t hashGeometry(uint64_t hash) const
+    {
+        hash = hashBytes(hash, &numTriangles, sizeof(numTriangles));
+        hash = hashBytes(hash, &mapRatio, sizeof(mapRatio));
+        for (uint32_t i = 0; i < numTriangles * 3; i++) {
+            hash = hashBytes(hash, &vertices[vertexIndex[i]], sizeof(Vec3f));
+            hash = hashBytes(hash, &stCoordinates[vertexIndex[i]], sizeof(Vec2f));
+        }
+        return hash;
+    }
+
     Surface* getSurfaceByVH(const uint32_t &v, const uint32_t &h, Vec3f *worldPoint = nullptr) const
     {
         //assert( v < vRes && h < hRes);
         Surface *surface;
-        surface = pSurfaces.at(v%vRes*hRes + h%hRes).get();
+        surface = &surfaces[v%vRes*hRes + h%hRes];
         if (surface != nullptr && worldPoint != nullptr) {
             const Vec3f &v0 = vertices[vertexIndex[0]];
             const Vec3f &v1 = vertices[vertexIndex[1]];
@@ -98,58 +119,154 @@ public:
         Vec3f e1 = normalize(v2 - v0);
         Vec3f N = normalize(crossProduct(e0, e1));
 
+        // all the shade points share N, and so their tangent frame
         uint32_t idx = 0;
-        Vec3f center;
         for (uint32_t v = 0; v < vRes; ++v) {
             for (uint32_t h = 0; h < hRes; ++h) {
-                curr = getSurfaceByVH(v, h, &center);
-                //TBD, LEO, center of a mesh is not v1 need to be justified, v1-(v2+v1)/2 ?
-                curr->reset(idx++, N, center);
+                curr = getSurfaceByVH(v, h);
+                curr->reset(idx++, N);
             }
         }
     }
 
-    bool intersect(const Vec3f &orig, const Vec3f &dir, float &tnear, Vec3f &point, Vec2f &mapIdx, Surface **surface, SurfaceAngle **angle) const
+    // SAH BVH over the triangles, built once from the vertices
+    void buildTrianglesBVH(void)
     {
-        bool intersect = false;
-        uint32_t index = 0;
-        float u = 0, v = 0;
+        std::vector<BBox> triBounds(numTriangles);
         for (uint32_t k = 0; k < numTriangles; ++k) {
-            const Vec3f & v0 = vertices[vertexIndex[k * 3]];
-            const Vec3f & v1 = vertices[vertexIndex[k * 3 + 1]];
-            const Vec3f & v2 = vertices[vertexIndex[k * 3 + 2]];
-            float tK, uK, vK;
-            if (rayTriangleIntersect(v0, v1, v2, orig, dir, tK, uK, vK) && tK < tnear) {
-                tnear = tK;
-                index = k;
-                u = uK;
-                v = vK;
-                intersect |= true;
+            triBounds[k].extend(vertices[vertexIndex[k * 3]]);
+            triBounds[k].extend(vertices[vertexIndex[k * 3 + 1]]);
+            triBounds[k].extend(vertices[vertexIndex[k * 3 + 2]]);
+            triBounds[k].pad(BVH_BOUNDS_PAD);
+        }
+        trianglesBVH.build(triBounds, BVH_SPLIT_SAH);
+        buildTriangleBlocks();
+    }
+
+    // [comment]
+    // Pack the triangles of each BVH leaf into SoA blocks with their edges precomputed.
+    // leafBlocks[node] is the first block of a leaf, the leaf uses ceil(count/TRI_BLOCK_WIDTH) blocks.
+    // [/comment]
+    void buildTriangleBlocks(void)
+    {
+        triangleBlocks.clear();
+        leafBlocks.assign(trianglesBVH.nodes.size(), 0);
+        for (uint32_t n = 0; n < trianglesBVH.nodes.size(); n++) {
+            const BVHNode &node = trianglesBVH.nodes[n];
+            if (node.count == 0) continue;
+            leafBlocks[n] = triangleBlocks.size();
+            for (uint32_t i = 0; i < node.count; i++) {
+                if (i % TRI_BLOCK_WIDTH == 0) {
+                    triangleBlocks.push_back(TriangleBlock());
+                    triangleBlocks.back().clear();
+                }
+                uint32_t k = trianglesBVH.primIndex[node.offset + i];
+                triangleBlocks.back().set(i % TRI_BLOCK_WIDTH, k, vertices[vertexIndex[k * 3]],
+                                          vertices[vertexIndex[k * 3 + 1]], vertices[vertexIndex[k * 3 + 2]]);
             }
         }
+    }
 
-        if ( intersect ) {
-            const Vec2f &st0 = stCoordinates[vertexIndex[index * 3]];
-            const Vec2f &st1 = stCoordinates[vertexIndex[index * 3 + 1]];
-            const Vec2f &st2 = stCoordinates[vertexIndex[index * 3 + 2]];
-            Vec2f st = st0 * (1 - u - v) + st1 * u + st2 * v;
-            point = orig + dir * tnear;
-            assert ( 0 <= st.x <= 1.0 && 0 <= st.y <= 1.0);
-            Surface *pSurface = getSurfaceByVH(floor(st.y*vRes), floor(st.x*hRes));
-            assert(surface != nullptr);
-            *surface = pSurface;
-            /* set the bitmap index */
-            mapIdx = st;
-            /* caculate the hit angle refer to sphere center on the surface */
-            assert(angle != nullptr);
-            if (pSurface != nullptr)
-                *angle = pSurface->getSurfaceAngleByDir(-dir);
-            else
-                *angle = nullptr;
+    bool intersectLeaf(const uint32_t nodeIdx, const Vec3f &orig, const Vec3f &dir, float &tnear, uint32_t &index, float &u, float &v) const
+    {
+        bool hitted = false;
+        uint32_t blocks = (trianglesBVH.nodes[nodeIdx].count + TRI_BLOCK_WIDTH - 1) / TRI_BLOCK_WIDTH;
+        for (uint32_t b = leafBlocks[nodeIdx]; b < leafBlocks[nodeIdx] + blocks; b++)
+            hitted |= intersectTriangleBlock(triangleBlocks[b], orig, dir, tnear, index, u, v);
+        return hitted;
+    }
+
+    bool intersectTriangle(const uint32_t k, const Vec3f &orig, const Vec3f &dir, float &tnear, uint32_t &index, float &u, float &v) const
+    {
+        const Vec3f & v0 = vertices[vertexIndex[k * 3]];
+        const Vec3f & v1 = vertices[vertexIndex[k * 3 + 1]];
+        const Vec3f & v2 = vertices[vertexIndex[k * 3 + 2]];
+        float tK, uK, vK;
+        if (rayTriangleIntersect(orig, dir, v0, v1, v2, tK, uK, vK) && tK < tnear) {
+            tnear = tK;
+            index = k;
+            u = uK;
+            v = vK;
+            return true;
         }
+        return false;
+    }
+
+    // closest triangle hit closer than tnear
+    bool closestTriangle(const Vec3f &orig, const Vec3f &dir, float &tnear, uint32_t &index, float &u, float &v) const
+    {
+        // a single leaf skips the box test
+        if (trianglesBVH.nodes.size() == 1)
+            return intersectLeaf(0, orig, dir, tnear, index, u, v);
+        return trianglesBVH.intersectLeaves(orig, dir, tnear,
+            [&](uint32_t nodeIdx, float &tNearest) { return intersectLeaf(nodeIdx, orig, dir, tNearest, index, u, v); });
+    }
+
+    // same as closestTriangle() by testing every triangle, kept for comparison
+    bool closestTriangleBruteForce(const Vec3f &orig, const Vec3f &dir, float &tnear, uint32_t &index, float &u, float &v) const
+    {
+        bool intersect = false;
+        for (uint32_t k = 0; k < numTriangles; ++k)
+            intersect |= intersectTriangle(k, orig, dir, tnear, index, u, v);
         return intersect;
     }
 
+    // closest triangle closer than tnear, index is the triangle and uv its barycentric coordinates
+    bool intersect(const Vec3f &orig, const Vec3f &dir, float &tnear, uint32_t &index, Vec2f &uv) const
+    {
+        return closestTriangle(orig, dir, tnear, index, uv.x, uv.y);
+    }
+    // [comment]
+    // The packet walks the triangle BVH together, and in each leaf it reaches only the rays
+    // entering the leaf box closer than their hit run the triangle blocks.
+    // [/comment]
+    void intersectPacket(RayPacket &packet, const uint32_t id) const
+    {
+        bool singleLeaf = (trianglesBVH.nodes.size() == 1);
+        trianglesBVH.intersectPacketLeaves(packet, [&](uint32_t nodeIdx) {
+            const BBox &bounds = trianglesBVH.nodes[nodeIdx].bounds;
+            for (uint32_t r = 0; r < packet.size; r++) {
+                float tEnter;
+                if (!singleLeaf && !bounds.intersect(packet.orig, packet.inverseDirection(r), packet.tNear[r], tEnter))
+                    continue;
+                if (intersectLeaf(nodeIdx, packet.orig, packet.direction(r), packet.tNear[r], packet.index[r],
+                                  packet.uv[r].x, packet.uv[r].y))
+                    packet.object[r] = id;
+            }
+        });
+    }
+    // any triangle closer than tMax, the walk stops at the first leaf with one
+    bool occluded(const Vec3f &orig, const Vec3f &dir, float &tMax) const
+    {
+        uint32_t index = 0;
+        float u = 0, v = 0;
+        if (trianglesBVH.nodes.size() == 1)
+            return intersectLeaf(0, orig, dir, tMax, index, u, v);
+        return trianglesBVH.intersectLeaves(orig, dir, tMax,
+            [&](uint32_t nodeIdx, float &tNearest) { return intersectLeaf(nodeIdx, orig, dir, tNearest, index, u, v); }, true);
+    }
+    void resolveHit(const Vec3f &orig, const Vec3f &dir, const float tnear, const uint32_t index, const Vec2f &uv,
+                    Vec3f &point, Vec2f &mapIdx, Surface **surface, SurfaceAngle **angle) const
+    {
+        const Vec2f &st0 = stCoordinates[vertexIndex[index * 3]];
+        const Vec2f &st1 = stCoordinates[vertexIndex[index * 3 + 1]];
+        const Vec2f &st2 = stCoordinates[vertexIndex[index * 3 + 2]];
+        Vec2f st = st0 * (1 - uv.x - uv.y) + st1 * uv.x + st2 * uv.y;
+        point = orig + dir * tnear;
+        assert ( 0 <= st.x <= 1.0 && 0 <= st.y <= 1.0);
+        Surface *pSurface = getSurfaceByVH(floor(st.y*vRes), floor(st.x*hRes));
+        assert(surface != nullptr);
+        *surface = pSurface;
+        /* set the bitmap index */
+        mapIdx = st;
+        /* caculate the hit angle refer to sphere center on the surface */
+        assert(angle != nullptr);
+        if (pSurface != nullptr)
+            *angle = pSurface->getSurfaceAngleByDir(-dir);
+        else
+            *angle = nullptr;
+    }
+
     Vec3f pointRel2Abs(const Vec3f &rel) const
     {
         return rel;
@@ -160,6 +277,14 @@ public:
         return abs;
     }
 
+    BBox getBounds(void) const
+    {
+        BBox bounds;
+        for (uint32_t i = 0; i < numTriangles * 3; ++i)
+            bounds.extend(vertices[vertexIndex[i]]);
+        return bounds;
+    }
+
     Vec3f evalDiffuseColor(const Vec2f &mapIdx) const
     {
         if (localDiffuseColor == -1.) {
@@ -171,9 +296,14 @@ public:
     }
 
     std::unique_ptr<Vec3f[]> vertices;
+    uint32_t numVertices;
     uint32_t numTriangles;
     std::unique_ptr<uint32_t[]> vertexIndex;
     std::unique_ptr<Vec2f[]> stCoordinates;
+    BVH trianglesBVH;
+    // triangles of the BVH leaves as SoA blocks
+    std::vector<TriangleBlock> triangleBlocks;
+    std::vector<uint32_t> leafBlocks;
     /* there will be mapRatio*mapRatio*4 blocks of different color */
     uint32_t mapRatio = 5;
 };
@@ -9,7 +9,9 @@
 #include "Values.h"
 #include "Surface.h"
 #include "Option.h"
-#include "Ray.h"
+#include "RayTree.h"
+#include "BBox.h"
+#include "RayPacket.h"
 
 
 class Object
@@ -23,20 +25,57 @@ class Object
         ior(1.3), Kd(0.1), Ks(0.2), diffuseColor(0.2), specularExponent(25),
         //ior(1.3), Kd(0.4), Ks(0.2), diffuseColor(0.2), specularExponent(25),
         vRes(0), hRes(0) {}
-    virtual ~Object() {}
-    virtual bool intersect(const Vec3f &, const Vec3f &, float &, Vec3f &, Vec2f &, Surface **, SurfaceAngle **) const = 0;
+    virtual ~Object() { delete traceLinks; }
+    // [comment]
+    // Ray queries are two phases: intersect() only finds the geometric hit closer than tnear,
+    // with the primitive index and uv needed to go on, and resolveHit() finds the hit point,
+    // the shade point and the angle of that hit. trace() resolves only the closest hit.
+    // [/comment]
+    virtual bool intersect(const Vec3f &, const Vec3f &, float &, uint32_t &, Vec2f &) const = 0;
+    virtual void resolveHit(const Vec3f &, const Vec3f &, const float, const uint32_t, const Vec2f &,
+                            Vec3f &, Vec2f &, Surface **, SurfaceAngle **) const = 0;
+    // [comment]
+    // Any hit closer than tMax, for the shadow and visibility queries: tMax is set to the first
+    // hit found, which may not be the closest one.
+    // [/comment]
+    virtual bool occluded(const Vec3f &orig, const Vec3f &dir, float &tMax) const
+    {
+        uint32_t index = 0;
+        Vec2f uv = 0;
+        return intersect(orig, dir, tMax, index, uv);
+    }
+    // [comment]
+    // intersect() for every ray of a packet sharing its origin: a ray hitting this object
+    // closer than its tNear gets it, with id as its object. The objects with a cheaper way than
+    // one ray at a time override it.
+    // [/comment]
+    virtual void intersectPacket(RayPacket &packet, const uint32_t id) const
+    {
+        for (uint32_t r = 0; r < packet.size; r++)
+            if (intersect(packet.orig, packet.direction(r), packet.tNear[r], packet.index[r], packet.uv[r]))
+                packet.object[r] = id;
+    }
+    // the same for a batch of rays of their own origins
+    virtual void intersectBatch(RayBatch &batch, const uint32_t id) const
+    {
+        for (uint32_t r = 0; r < batch.size; r++)
+            if (intersect(batch.origin(r), batch.direction(r), batch.tNear[r], batch.index[r], batch.uv[r]))
+                batch.object[r] = id;
+    }
     virtual Surface* getSurfaceByVH(const uint32_t &, const uint32_t &, Vec3f * =nullptr) const = 0;
     virtual Vec3f evalDiffuseColor(const Vec2f &) const { return diffuseColor; }
     virtual Vec3f pointRel2Abs(const Vec3f &) const =0;
     virtual Vec3f pointAbs2Rel(const Vec3f &) const =0;
+    // world space bounds of the object, used by the scene BVH
+    virtual BBox getBounds(void) const =0;
     virtual void reset(void) {};
+    // hash of the shape of the object, chained from hash
+    virtual uint64_t hashGeometry(uint64_t hash) const =0;
     void enableRecorder(void)
     {
         if (traceLinks == nullptr) {
             // creating the ray links to record the rays
-            traceLinks = (std::vector<std::unique_ptr<Ray>> *)malloc((MY_UINT64_T)sizeof(std::vector<std::unique_ptr<Ray>>)*vRes*hRes);
-            assert(traceLinks != nullptr);
-            std::memset(traceLinks, 0, sizeof(std::vector<std::unique_ptr<Ray>>)*vRes*hRes);
+            traceLinks = new RayTree(vRes*hRes);
         }
         if (traceLinks != nullptr)
             recorderEnabled = true;
@@ -46,6 +85,101 @@ class Object
         }
     }
     void disableRecorder(void) { recorderEnabled = false; }
+    // to call whenever the object moves or changes its shape, the BakeTracker follows the version
+    void geometryChanged(void) { geometryVersion++; }
+
+    // [comment]
+    // Add to the diffuseAmt of a surface. Render workers (worker >= 0) add into their own
+    // buffer so that parallel passes never write the same surface, reduceDiffuseAmt() adds
+    // the buffers into the surfaces once the pass is over.
+    // [/comment]
+    void addDiffuseAmt(Surface *surface, const Vec3f &amt, const int32_t worker = -1)
+    {
+        if (worker < 0) {
+            surface->diffuseAmt += amt;
+            return;
+        }
+        workerDiffuseAmt[worker][surface->idx] += amt;
+    }
+    void prepareWorkerDiffuseAmt(const uint32_t workers)
+    {
+        workerDiffuseAmt.assign(workers, std::vector<Vec3f>(numSurfaces, Vec3f(0)));
+    }
+    void reduceDiffuseAmt(void)
+    {
+        for (uint32_t w = 0; w < workerDiffuseAmt.size(); w++)
+            for (uint32_t i = 0; i < numSurfaces; i++)
+                surfaces[i].diffuseAmt += workerDiffuseAmt[w][i];
+        workerDiffuseAmt.clear();
+    }
+
+    // [comment]
+    // All the shade points of the object are in one array, and all their angles in one slab:
+    // the angles of shade point i are at [i*angleStride, (i+1)*angleStride) of the slab.
+    // With an SH order there is no angle slab but an SH slab, of shStride coefficients each.
+    // [/comment]
+    void initSurfaces(const uint32_t num, const float angleRatio)
+    {
+        numSurfaces = num;
+        angleStride = (shOrder > 0) ? 0 : Surface::angleNum(angleRatio, angleMapping);
+        shStride = (shOrder > 0 && angleRatio > 0.) ? shCoeffsNum(shOrder) : 0;
+        surfaces = std::unique_ptr<Surface[]>(new Surface[num]);
+        surfaceAngles = std::unique_ptr<SurfaceAngle[]>(angleStride > 0 ?
+                            new SurfaceAngle[(MY_UINT64_T)num * angleStride] : nullptr);
+        surfaceSH = std::unique_ptr<Vec3f[]>(shStride > 0 ? new Vec3f[(MY_UINT64_T)num * shStride] : nullptr);
+        for (uint32_t i = 0; i < num; i++) {
+            surfaces[i].init(angleRatio, angleMapping, surfaceAngles.get() + (MY_UINT64_T)i * angleStride, &angleBins);
+            surfaces[i].sh = (shStride > 0) ? surfaceSH.get() + (MY_UINT64_T)i * shStride : nullptr;
+            surfaces[i].shOrder = shOrder;
+        }
+        if (num > 0 && angleRatio > 0.)
+            angleBins = AngleBins(90, surfaces[0].vAngleRes, surfaces[0].hAngleRes, angleMapping);
+    }
+    // [comment]
+    // Cut the hemisphere of the shade points with mapping. The shade points are built again,
+    // so this is to be called when setting up the scene, before any render.
+    // [/comment]
+    void setAngleMapping(const AngleMapping mapping)
+    {
+        // the octahedral mapping covers the whole sphere, not the hemisphere of a shade point
+        if (mapping == angleMapping || mapping == ANGLE_MAPPING_OCTAHEDRAL) return;
+        angleMapping = mapping;
+        initSurfaces(numSurfaces, surfaceAngleRatio);
+        reset();
+        uint32_t vAngleRes = numSurfaces > 0 ? surfaces[0].vAngleRes : 0;
+        uint32_t hAngleRes = numSurfaces > 0 ? surfaces[0].hAngleRes : 0;
+        std::printf("object:%s, angle mapping:%s, pointAngle:%d (vAngle:%d, hAngle:%d)\n", name.c_str(),
+                    mapping == ANGLE_MAPPING_POLAR ? "polar" : "concentric", vAngleRes*hAngleRes, vAngleRes, hAngleRes);
+    }
+    // [comment]
+    // Keep the angle colors of the shade points as their projection onto the spherical harmonics
+    // of the bands 0 to order, at most SH_ORDER_MAX: (order+1)^2 colors per shade point instead
+    // of the angle grid, which is only walked by objectRender() to project it. 0 keeps the grid.
+    // The shade points are built again, see setAngleMapping().
+    // [/comment]
+    void setSHOrder(const uint32_t order)
+    {
+        uint32_t newOrder = std::min(order, (uint32_t)SH_ORDER_MAX);
+        if (newOrder == shOrder) return;
+        uint32_t grid = Surface::angleNum(surfaceAngleRatio, angleMapping);
+        shOrder = newOrder;
+        initSurfaces(numSurfaces, surfaceAngleRatio);
+        reset();
+        std::printf("object:%s, sh order:%d, colors per shade point:%d (angle grid:%d)\n", name.c_str(),
+                    shOrder, shOrder > 0 ? shStride : angleStride, grid);
+    }
+    // point the shade points to the angles of slab (a mapped bake cache), nullptr gives back surfaceAngles
+    void attachAngleSlab(SurfaceAngle *slab)
+    {
+        SurfaceAngle *base = (slab != nullptr) ? slab : surfaceAngles.get();
+        for (uint32_t i = 0; i < numSurfaces && angleStride > 0; i++)
+            surfaces[i].angles = base + (MY_UINT64_T)i * angleStride;
+    }
+    SurfaceAngle *getSurfaceAngle(const uint32_t surfaceIdx, const uint32_t vAngle, const uint32_t hAngle) const
+    {
+        if (angleStride == 0) return nullptr;
+        return surfaces[surfaceIdx].angles + vAngle * surfaces[surfaceIdx].hAngleRes + hAngle;
+    }
 
     void setType(ObjectType objType) { type = objType; }
     void setName(std::string objName)
@@ -102,10 +236,12 @@ class Object
                 curr = getSurfaceByVH(0, 0);
                 for (uint32_t vAngle=0; vAngle<curr->vAngleRes; vAngle++) {
                     for (uint32_t hAngle=0; hAngle<curr->hAngleRes; hAngle++) {
-                        SurfaceAngle *angle = curr->getSurfaceAngleByVH(vAngle, hAngle);
-                        int r = (int)(255 * clamp(0, 1, angle->angleColor.x));
-                        int g = (int)(255 * clamp(0, 1, angle->angleColor.y));
-                        int b = (int)(255 * clamp(0, 1, angle->angleColor.z));
+                        // the colors rebuilt from the SH coefficients if the angles are kept as SH
+                        Vec3f color = (angleStride > 0) ? getSurfaceAngle(0, vAngle, hAngle)->getColor() :
+                                          surfaces[0].getColorBySHLocal(angleBins.direction(vAngle, hAngle));
+                        int r = (int)(255 * clamp(0, 1, color.x));
+                        int g = (int)(255 * clamp(0, 1, color.y));
+                        int b = (int)(255 * clamp(0, 1, color.z));
                         ofs << r << " " << g << " " << b << "\n ";
                     }
                 }
@@ -134,16 +270,30 @@ class Object
     // ratio determine the object and light field datas
     float ratio = RAY_CAST_DESITY;
 
-    // link stack to record the rays
-    std::vector<std::unique_ptr<Ray>> * traceLinks = nullptr;
+    // rays recorded for each shade point
+    RayTree * traceLinks = nullptr;
     bool recorderEnabled = false;
+    uint32_t geometryVersion = 0;
     // there will be vRes*ampRatio*hRes*ampRatio blocks of amp value
     float ampRatio = 1.0;
     // there will be vAngleRes*ampRatio*hAngleRes*ampRatio blocks of amp value
     float surfaceAngleRatio = 0.0;
     // the number point is vRes * hRes
-    //struct Surface * pSurfaces;
-    std::vector<std::unique_ptr<Surface>> pSurfaces; 
+    std::unique_ptr<Surface[]> surfaces;
+    uint32_t numSurfaces = 0;
+    // angles of all the shade points
+    std::unique_ptr<SurfaceAngle[]> surfaceAngles;
+    // angles of each shade point
+    uint32_t angleStride = 0;
+    // SH coefficients of all the shade points, shStride of each, if the angles are kept as SH
+    std::unique_ptr<Vec3f[]> surfaceSH;
+    uint32_t shStride = 0;
+    uint32_t shOrder = 0;
+    // direction to angle mapping of the shade points
+    AngleMapping angleMapping = ANGLE_MAPPING_POLAR;
+    AngleBins angleBins;
+    // diffuseAmt added by each worker of a parallel pass, [worker][surface idx]
+    std::vector<std::vector<Vec3f>> workerDiffuseAmt;
     // the diffuse color the object by itself
     Vec3f  localDiffuseColor = -1.;
 };
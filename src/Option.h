@@ -21,6 +21,19 @@ struct Options
     bool  doTraditionalRender;
     bool  doRenderAfterDiffusePreprocess;
     bool  doRenderAfterDiffuseAndReflectPreprocess;
+    // render threads, 0 uses every hardware thread
+    uint32_t threads;
+    // keep the contribution of each light, lightRender only casts the lights which changed
+    bool incrementalLightRender;
+    // file caching the results of lightRender and objectRender, nullptr bakes every run
+    const char *bakeCache;
+    // follow the objects between two bakes and only bake again the shade points their changes
+    // can reach, the cache and incrementalLightRender are not used then
+    bool trackDirtyRegions;
+    // how the passes cast their rays, see RayCaster
+    RayCaster caster;
+    // the wavefront caster traces the rays of each wave sorted by origin and direction
+    bool sortRays;
     // a list of viewpoint to cast the original rays
     Vec3f viewpoints[100];
 };
@@ -0,0 +1,110 @@
+#ifndef PACKINGH
+#define PACKINGH
+#include <cstdlib>
+#include <cstdio>
+#include <iostream>
+#include <iomanip>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+
+#include "Vec3.h"
+
+// [comment]
+// Compact encodings of unit directions and of colors, for the data which is kept in
+// large numbers (recorded rays, baked radiance).
+// [/comment]
+
+// [comment]
+// Octahedral encoding of a unit direction into 32 bits: the direction is projected onto the
+// octahedron |x|+|y|+|z|=1, the lower half is folded over the upper one, and the resulting
+// (x, y) in [-1,1]^2 are stored as two 16 bits signed normalized values.
+// The angular error is below 1e-4 radian.
+// [/comment]
+inline float octahedralSign(const float v) { return v >= 0 ? 1.f : -1.f; }
+
+inline uint32_t packOctahedral(const Vec3f &dir)
+{
+    float l1 = std::fabs(dir.x) + std::fabs(dir.y) + std::fabs(dir.z);
+    float x = 0, y = 0;
+    if (l1 > 0) {
+        x = dir.x / l1;
+        y = dir.y / l1;
+        if (dir.z < 0) {
+            float fx = (1 - std::fabs(y)) * octahedralSign(x);
+            float fy = (1 - std::fabs(x)) * octahedralSign(y);
+            x = fx;
+            y = fy;
+        }
+    }
+    int16_t sx = (int16_t)std::lround(std::min(1.f, std::max(-1.f, x)) * 32767.f);
+    int16_t sy = (int16_t)std::lround(std::min(1.f, std::max(-1.f, y)) * 32767.f);
+    return (uint32_t)(uint16_t)sx | ((uint32_t)(uint16_t)sy << 16);
+}
+
+inline Vec3f unpackOctahedral(const uint32_t packed)
+{
+    float x = (int16_t)(packed & 0xffff) / 32767.f;
+    float y = (int16_t)(packed >> 16) / 32767.f;
+    float z = 1 - std::fabs(x) - std::fabs(y);
+    if (z < 0) {
+        float fx = (1 - std::fabs(y)) * octahedralSign(x);
+        float fy = (1 - std::fabs(x)) * octahedralSign(y);
+        x = fx;
+        y = fy;
+    }
+    Vec3f dir(x, y, z);
+    return dir.normalize();
+}
+
+// [comment]
+// RGB9E5 shared exponent encoding of a color into 32 bits: three 9 bits mantissas and one
+// 5 bits exponent. Components are clamped to [0, 65408], the relative error of the largest
+// component is below 1/512.
+// [/comment]
+#define RGB9E5_MANTISSA_BITS 9
+#define RGB9E5_EXP_BIAS      15
+#define RGB9E5_MAX_EXP       31
+#define RGB9E5_MAX_VALUE     65408.f
+
+// 2^e as a float, for e in the range of the normal floats
+inline float exp2Bits(const int e)
+{
+    uint32_t bits = (uint32_t)(e + 127) << 23;
+    float f;
+    std::memcpy(&f, &bits, sizeof(f));
+    return f;
+}
+
+inline uint32_t packRGB9E5(const Vec3f &color)
+{
+    float r = std::min(RGB9E5_MAX_VALUE, std::max(0.f, color.x));
+    float g = std::min(RGB9E5_MAX_VALUE, std::max(0.f, color.y));
+    float b = std::min(RGB9E5_MAX_VALUE, std::max(0.f, color.z));
+    float maxc = std::max(r, std::max(g, b));
+    if (maxc == 0) return 0;
+    // maxc = m*2^e with m in [0.5, 1), read from the float bits (e is below the bias for
+    // denormals and 0, where it is clamped anyway)
+    uint32_t bits;
+    std::memcpy(&bits, &maxc, sizeof(bits));
+    int e = (int)(bits >> 23) - 126;
+    int exp = std::max(-RGB9E5_EXP_BIAS, e) + RGB9E5_EXP_BIAS;
+    // maxc/denom with denom a power of 2 is maxc*(1/denom), exactly
+    float scale = exp2Bits(RGB9E5_EXP_BIAS + RGB9E5_MANTISSA_BITS - exp);
+    if ((uint32_t)std::floor(maxc * scale + 0.5f) == (1u << RGB9E5_MANTISSA_BITS)) {
+        scale *= 0.5f;
+        exp++;
+    }
+    uint32_t rm = (uint32_t)std::floor(r * scale + 0.5f);
+    uint32_t gm = (uint32_t)std::floor(g * scale + 0.5f);
+    uint32_t bm = (uint32_t)std::floor(b * scale + 0.5f);
+    return rm | (gm << 9) | (bm << 18) | ((uint32_t)exp << 27);
+}
+
+inline Vec3f unpackRGB9E5(const uint32_t packed)
+{
+    float scale = exp2Bits((int)(packed >> 27) - RGB9E5_EXP_BIAS - RGB9E5_MANTISSA_BITS);
+    return Vec3f((packed & 0x1ff) * scale, ((packed >> 9) & 0x1ff) * scale, ((packed >> 18) & 0x1ff) * scale);
+}
+
+#endif
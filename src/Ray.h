@@ -5,48 +5,66 @@
 #include <iostream>
 #include <iomanip>
 #include <cmath>
+#include <cstdint>
 
-class Ray
+#include "Values.h"
+#include "Vec3.h"
+#include "Packing.h"
+
+// index of no ray: no parent, no child, no sibling
+#define RAY_NODE_NONE 0xffffffff
+// the weak and overflow counters saturate at this value
+#define RAY_NODE_COUNT_MAX 0x1fff
+
+// [comment]
+// A recorded ray, one node of the flat ray tree of a RayTree. The children of a ray are
+// chained through nextSibling from firstChild, the direction is octahedral encoded and the
+// intensity is RGB9E5 encoded, the hit point is orig + dir*tHit.
+// [/comment]
+struct RayNode
 {
-public:
-    Ray(const RayType rayType, const Vec3f &orig, const Vec3f &dir, const Vec3f &leftIntensity = -1) : orig(orig), dir(dir){
+    void set(const RayType rayType, const uint32_t parentIdx, const Vec3f &rayOrig, const Vec3f &rayDir,
+             const bool isInside, const Vec3f &leftIntensity)
+    {
+        orig = rayOrig;
+        dir = packOctahedral(rayDir);
+        tHit = 0;
+        // intensity -1 means unknown, which RGB9E5 can't store
+        hasIntensity = (leftIntensity.x >= 0);
+        intensity = hasIntensity ? packRGB9E5(leftIntensity) : 0;
         hitObject = nullptr;
+        parent = parentIdx;
+        firstChild = nextSibling = RAY_NODE_NONE;
         status = NOHIT_RAY;
-        type   = rayType;
-        intensity = leftIntensity;
-        inside    = false;
-        validCount = nohitCount = invisibleCount = overflowCount = weakCount = 0;
+        type = rayType;
+        inside = isInside;
+        weakCount = overflowCount = 0;
     }
+    Vec3f getDir(void) const { return unpackOctahedral(dir); }
+    Vec3f getIntensity(void) const { return hasIntensity ? unpackRGB9E5(intensity) : Vec3f(-1); }
+    Vec3f getHitPoint(void) const { return orig + getDir() * tHit; }
+
     Vec3f orig;
-    Vec3f dir;
+    uint32_t dir;
+    // distance from orig to the hit point
+    float tHit;
+    uint32_t intensity;
     // Hitted object of current ray
     void *hitObject;
-    Vec3f  hitPoint;
-    // The ray is inside or outside the object
-    bool   inside;
-    Vec3f  intensity;
-    // child reflection rays
-    std::vector<std::unique_ptr<Ray>> reflectionLink;
-    // child refraction rays
-    std::vector<std::unique_ptr<Ray>> refractionLink;
-    // child diffuse rays
-    std::vector<std::unique_ptr<Ray>> diffuseLink;
-
+    uint32_t parent;
+    uint32_t firstChild;
+    uint32_t nextSibling;
     // status of current ray
-    enum RayStatus status;
+    uint32_t status : 2;
     // type of current ray
-    enum RayType type;
-
-    // Counter of valid child rays
-    uint32_t validCount;
-    // Counter of invalid rays as per nohit
-    uint32_t nohitCount;
-    // Counter of invisible diffuse reflection rays
-    uint32_t invisibleCount;
-    // Counter of invalid rays as per overflow
-    uint32_t overflowCount;
-    // Counter of too weak ingnored rays
-    uint32_t weakCount;
+    uint32_t type : 2;
+    // The ray is inside or outside the object
+    uint32_t inside : 1;
+    uint32_t hasIntensity : 1;
+    // child rays ignored as too weak
+    uint32_t weakCount : 13;
+    // child rays dropped as per overflow
+    uint32_t overflowCount : 13;
 };
 
 #endif
@@ -0,0 +1,238 @@
+#ifndef RAYPACKETH
+#define RAYPACKETH
+#include <cstdlib>
+#include <cstdio>
+#include <iostream>
+#include <iomanip>
+#include <cmath>
+#include <algorithm>
+#include <vector>
+
+#include "Values.h"
+#include "Vec2.h"
+#include "Vec3.h"
+#include "BBox.h"
+
+// build with -DRAY_PACKET_SCALAR_KERNEL to force the plain C++ kernels of the packets
+#if !defined(RAY_PACKET_SCALAR_KERNEL) && defined(__SSE2__)
+#include <emmintrin.h>
+#define RAY_PACKET_SSE_KERNEL
+#endif
+
+// rays of one packet, a multiple of 4 for the SSE kernels
+#define RAY_PACKET_SIZE     (RAY_PACKET_WIDTH * RAY_PACKET_WIDTH)
+// object of a ray of the packet which hits nothing
+#define RAY_PACKET_NO_HIT   0xffffffff
+
+// [comment]
+// Up to RAY_PACKET_SIZE rays sharing their origin, the primary rays of a block of pixels.
+// The directions are stored as structure of arrays, and each ray keeps its closest hit like
+// Object::intersect() gives it: distance, index of the object, primitive index and uv.
+// bound() takes the interval of the inverse directions on each axis, so that mayHit() can
+// reject a box for the whole packet at once. An axis where the rays don't all go the same
+// way is left out of the test, which stays conservative.
+// [/comment]
+struct RayPacket {
+    void reset(const Vec3f &o)
+    {
+        orig = o;
+        size = 0;
+    }
+    void add(const Vec3f &d)
+    {
+        uint32_t r = size++;
+        Vec3f inv = 1.f / d;
+        for (uint8_t i = 0; i < 3; i++) {
+            dir[i][r] = d[i];
+            invDir[i][r] = inv[i];
+        }
+        tNear[r] = kInfinity;
+        object[r] = RAY_PACKET_NO_HIT;
+        index[r] = 0;
+        uv[r] = 0;
+    }
+    // once all the rays are added
+    void bound(void)
+    {
+        for (uint8_t i = 0; i < 3; i++) {
+            invDirMin[i] = kInfinity;
+            invDirMax[i] = -kInfinity;
+            for (uint32_t r = 0; r < size; r++) {
+                invDirMin[i] = std::min(invDirMin[i], invDir[i][r]);
+                invDirMax[i] = std::max(invDirMax[i], invDir[i][r]);
+            }
+            // the interval also rejects the infinite inverses of the rays parallel to the axis
+            sameSign[i] = size > 0 && ((invDirMin[i] > 0 && invDirMax[i] < kInfinity) ||
+                                       (invDirMax[i] < 0 && invDirMin[i] > -kInfinity));
+        }
+    }
+
+    Vec3f origin(const uint32_t) const { return orig; }
+    Vec3f direction(const uint32_t r) const { return Vec3f(dir[0][r], dir[1][r], dir[2][r]); }
+    Vec3f inverseDirection(const uint32_t r) const { return Vec3f(invDir[0][r], invDir[1][r], invDir[2][r]); }
+
+    // distance of the farthest closest hit, no box behind it can give a closer one
+    float farthest(void) const
+    {
+        float t = 0;
+        for (uint32_t r = 0; r < size; r++)
+            t = std::max(t, tNear[r]);
+        return t;
+    }
+
+    // [comment]
+    // False if no ray of the packet can enter box closer than its hit: the slab test of
+    // BBox::intersect() with intervals. Multiplying by the bounds of invDir bounds the
+    // distances of every ray, rounding included, so a box is never rejected when the test of
+    // one of the rays would accept it.
+    // [/comment]
+    bool mayHit(const BBox &box) const
+    {
+        float t0 = 0, t1 = farthest();
+        for (uint8_t i = 0; i < 3; i++) {
+            if (!sameSign[i]) continue;
+            float dMin = box.pMin[i] - orig[i], dMax = box.pMax[i] - orig[i];
+            // rays going up the axis enter the slab at pMin, the others at pMax
+            float dEnter = invDirMin[i] > 0 ? dMin : dMax;
+            float dExit = invDirMin[i] > 0 ? dMax : dMin;
+            t0 = std::max(t0, std::min(dEnter * invDirMin[i], dEnter * invDirMax[i]));
+            t1 = std::min(t1, std::max(dExit * invDirMin[i], dExit * invDirMax[i]));
+            if (t0 > t1) return false;
+        }
+        return true;
+    }
+
+    Vec3f orig;
+    uint32_t size = 0;
+    float dir[3][RAY_PACKET_SIZE];
+    float invDir[3][RAY_PACKET_SIZE];
+    float tNear[RAY_PACKET_SIZE];
+    uint32_t object[RAY_PACKET_SIZE];
+    uint32_t index[RAY_PACKET_SIZE];
+    Vec2f uv[RAY_PACKET_SIZE];
+    // interval of invDir on each axis, used by mayHit() only where sameSign is set
+    float invDirMin[3], invDirMax[3];
+    bool sameSign[3];
+};
+
+// [comment]
+// Rays traced together which don't share their origin, like the rays objectRender casts at
+// one shade point: they start around it and all go through it. Same layout and hits as
+// RayPacket, in vectors which keep their capacity from one batch to the next, since a shade
+// point casts thousands of rays.
+// [/comment]
+struct RayBatch {
+    void clear(void) { size = 0; }
+    void add(const Vec3f &o, const Vec3f &d)
+    {
+        if (size == tNear.size()) grow(2 * size + 64);
+        uint32_t r = size++;
+        for (uint8_t i = 0; i < 3; i++) {
+            orig[i][r] = o[i];
+            dir[i][r] = d[i];
+        }
+        tNear[r] = kInfinity;
+        object[r] = RAY_PACKET_NO_HIT;
+        index[r] = 0;
+        uv[r] = 0;
+    }
+
+    Vec3f origin(const uint32_t r) const { return Vec3f(orig[0][r], orig[1][r], orig[2][r]); }
+    Vec3f direction(const uint32_t r) const { return Vec3f(dir[0][r], dir[1][r], dir[2][r]); }
+
+    // [comment]
+    // Box of the segments from the origins to the closest hits so far, the box of their end
+    // points, grown by pad for the rounding of the end points. Everything while a ray has no hit.
+    // [/comment]
+    BBox segmentBounds(const float pad) const
+    {
+        BBox bounds;
+        for (uint32_t r = 0; r < size; r++) {
+            if (tNear[r] == kInfinity) return BBox(Vec3f(-kInfinity), Vec3f(kInfinity));
+            bounds.extend(origin(r));
+            bounds.extend(origin(r) + direction(r) * tNear[r]);
+        }
+        bounds.pad(pad);
+        return bounds;
+    }
+
+    uint32_t size = 0;
+    std::vector<float> orig[3];
+    std::vector<float> dir[3];
+    std::vector<float> tNear;
+    std::vector<uint32_t> object;
+    std::vector<uint32_t> index;
+    std::vector<Vec2f> uv;
+
+private:
+    void grow(const uint32_t capacity)
+    {
+        for (uint8_t i = 0; i < 3; i++) {
+            orig[i].resize(capacity);
+            dir[i].resize(capacity);
+        }
+        tNear.resize(capacity);
+        object.resize(capacity);
+        index.resize(capacity);
+        uv.resize(capacity);
+    }
+};
+
+// [comment]
+// Order in which to trace the rays of a wave, so that rays traced one after the other start
+// close to each other and go the same way, and find the same nodes and primitives in the
+// caches. The key of a ray is the octant of its direction in the 3 high bits, then the Morton
+// code of its origin quantized to RAY_SORT_BITS bits per axis within the box of the origins.
+// add() the rays, sort(), then at(n) is the ray to trace n-th.
+// [/comment]
+struct RaySorter {
+    void clear(void)
+    {
+        keys.clear();
+        bounds = BBox();
+    }
+    void add(const Vec3f &orig, const Vec3f &dir)
+    {
+        origs.resize(keys.size() + 1);
+        octants.resize(keys.size() + 1);
+        origs[keys.size()] = orig;
+        octants[keys.size()] = (dir.x < 0) << 2 | (dir.y < 0) << 1 | (dir.z < 0);
+        bounds.extend(orig);
+        keys.push_back(keys.size());
+    }
+    void sort(void)
+    {
+        const uint32_t cells = 1 << RAY_SORT_BITS;
+        Vec3f extent = bounds.pMax - bounds.pMin;
+        Vec3f scale;
+        for (uint8_t i = 0; i < 3; i++)
+            scale[i] = extent[i] > 0 ? (cells - 1) / extent[i] : 0;
+        for (uint32_t n = 0; n < keys.size(); n++) {
+            Vec3f cell = (origs[n] - bounds.pMin) * scale;
+            uint64_t key = octants[n] << (3 * RAY_SORT_BITS) |
+                morton((uint32_t)cell.x) << 2 | morton((uint32_t)cell.y) << 1 | morton((uint32_t)cell.z);
+            keys[n] = key << 32 | n;
+        }
+        std::sort(keys.begin(), keys.end());
+    }
+    uint32_t size(void) const { return keys.size(); }
+    uint32_t at(const uint32_t n) const { return (uint32_t)keys[n]; }
+
+    // the bits of x, RAY_SORT_BITS at most, spread 3 apart
+    static uint64_t morton(const uint32_t x)
+    {
+        uint64_t m = 0;
+        for (uint32_t b = 0; b < RAY_SORT_BITS; b++)
+            m |= (uint64_t)(x >> b & 1) << (3 * b);
+        return m;
+    }
+
+private:
+    // key in the high 32 bits, index of the ray in the low ones
+    std::vector<uint64_t> keys;
+    std::vector<Vec3f> origs;
+    std::vector<uint64_t> octants;
+    BBox bounds;
+};
+
+#endif
@@ -17,6 +17,8 @@
 #include "Utils.h"
 #include "Option.h"
 #include "SurfaceAngle.h"
+#include "RayTree.h"
+#include "BakeTracker.h"
 
 
 class RayStore
@@ -25,15 +27,38 @@ public:
     RayStore(const Options &currOption) : option(currOption) 
     {
         currPixel = 0;
-        currRay = nullptr;
+        currRay = RAY_NODE_NONE;
 
 //#define RAY_TRACE_LINK_RECORDER
 #ifdef RAY_TRACE_LINK_RECORDER
         // creating the rays from eye tracker
-        eyeTraceLinks = (std::vector<std::unique_ptr<Ray>> *)malloc((MY_UINT64_T)sizeof(std::vector<std::unique_ptr<Ray>>)*VIEW_HEIGHT*VIEW_WIDTH);
-        assert(eyeTraceLinks != nullptr);
-        std::memset(eyeTraceLinks, 0, sizeof(std::vector<std::unique_ptr<Ray>>)*VIEW_HEIGHT*VIEW_WIDTH);
+        eyeTraceLinks = new RayTree(VIEW_HEIGHT*VIEW_WIDTH);
+        ownEyeTraceLinks = true;
 #endif
+        resetCounters();
+        if (eyeTraceLinks != nullptr)
+            totalMem = eyeTraceLinks->footprint();
+    }
+    ~RayStore()
+    {
+        // all the recorded eye rays are freed with their tree
+        if (ownEyeTraceLinks)
+            delete eyeTraceLinks;
+    }
+    // [comment]
+    // Store of one render worker: its own counters and current ray, the rays are still
+    // recorded into the trace links of the parent store (each pixel is owned by one worker).
+    // [/comment]
+    RayStore(const RayStore &parent, const uint32_t worker) : option(parent.option)
+    {
+        workerIdx = worker;
+        currPixel = 0;
+        currRay = RAY_NODE_NONE;
+        eyeTraceLinks = parent.eyeTraceLinks;
+        resetCounters();
+    }
+    void resetCounters(void)
+    {
         totalMem = 0;
         totalRays = 0;
         originRays = 0;
@@ -48,55 +73,157 @@ public:
         invalidRays = 0;
         nohitRays = 0;
     }
-    Ray * record(const RayType type, std::vector<std::unique_ptr<Ray>> *links, const uint32_t index, 
+    // add the counters of a worker store
+    void merge(const RayStore &worker)
+    {
+        totalMem += worker.totalMem;
+        totalRays += worker.totalRays;
+        originRays += worker.originRays;
+        reflectionRays += worker.reflectionRays;
+        refractionRays += worker.refractionRays;
+        diffuseRays += worker.diffuseRays;
+        invisibleRays += worker.invisibleRays;
+        weakRays += worker.weakRays;
+        overflowRays += worker.overflowRays;
+        loopInternalRays += worker.loopInternalRays;
+        validRays += worker.validRays;
+        invalidRays += worker.invalidRays;
+        nohitRays += worker.nohitRays;
+    }
+    // [comment]
+    // Record a root ray of a pixel or a shade point, it becomes currRay so that the rays cast
+    // from it are recorded as its children until endRecord().
+    // [/comment]
+    uint32_t record(const RayType type, RayTree *tree, const uint32_t index,
                     const Vec3f &orig, const Vec3f &dir, const Vec3f &intensity = -1)
     {
-        if (links == nullptr || links+index == nullptr)
-            return nullptr;
-        // tracker the ray
-        Ray * currRay = new Ray(type, orig, dir);
-        totalMem += sizeof(Ray);
-        currRay = currRay;
-        links[index].push_back(std::unique_ptr<Ray>(currRay));
+        if (tree == nullptr || index >= tree->roots.size())
+            return RAY_NODE_NONE;
+        MY_UINT64_T footprint = tree->footprint();
+        currTree = tree;
+        currRay = tree->addRoot(index, type, orig, dir, intensity);
+        totalMem += tree->footprint() - footprint;
         return currRay;
     }
-    void dumpRay(const std::vector<std::unique_ptr<Ray>> &curr, uint32_t idx, uint32_t depth)
+    void endRecord(void)
+    {
+        currTree = nullptr;
+        currRay = RAY_NODE_NONE;
+    }
+    // [comment]
+    // Record a child ray of currRay and make it currRay, returns the ray to give back to
+    // popRay() once the child is cast. Does nothing if no ray is recorded.
+    // [/comment]
+    uint32_t pushRay(const RayType type, const Vec3f &orig, const Vec3f &dir,
+                     const bool inside, const Vec3f &intensity = -1)
+    {
+        uint32_t parent = currRay;
+        if (parent == RAY_NODE_NONE)
+            return parent;
+        MY_UINT64_T footprint = currTree->footprint();
+        currRay = currTree->addChild(parent, type, orig, dir, inside, intensity);
+        totalMem += currTree->footprint() - footprint;
+        return parent;
+    }
+    void popRay(const uint32_t parent) { currRay = parent; }
+    // the status of currRay, and what it hits if valid
+    void markRay(const RayStatus status, void *hitObject = nullptr, const Vec3f &hitPoint = 0)
+    {
+        if (currRay == RAY_NODE_NONE) return;
+        RayNode &ray = currTree->at(currRay);
+        ray.status = status;
+        if (status == OVERFLOW_RAY)
+            countOverflow(1);
+        if (hitObject != nullptr) {
+            ray.hitObject = hitObject;
+            ray.tHit = (hitPoint - ray.orig).length();
+        }
+    }
+    // child rays of currRay ignored as too weak
+    void countWeak(void)
+    {
+        if (currRay == RAY_NODE_NONE) return;
+        RayNode &ray = currTree->at(currRay);
+        ray.weakCount = std::min<uint32_t>(ray.weakCount + 1, RAY_NODE_COUNT_MAX);
+    }
+    // child rays of currRay dropped as per overflow
+    void countOverflow(const uint32_t count)
+    {
+        if (currRay == RAY_NODE_NONE) return;
+        RayNode &ray = currTree->at(currRay);
+        ray.overflowCount = std::min<uint32_t>(ray.overflowCount + count, RAY_NODE_COUNT_MAX);
+    }
+    // [comment]
+    // Follow the rays of the shade point being baked into currPath, see BakeTracker.
+    // pathRay() records a traced ray up to its hit point, or up to pathFar if nothing is hit.
+    // [/comment]
+    void pathSegment(const Vec3f &from, const Vec3f &to)
+    {
+        if (currPath == nullptr) return;
+        currPath->bounds.extend(from);
+        currPath->bounds.extend(to);
+    }
+    void pathRay(const Vec3f &orig, const Vec3f &dir, const bool hitted, const Vec3f &hitPoint)
+    {
+        if (currPath == nullptr) return;
+        pathSegment(orig, hitted ? hitPoint : orig + dir * pathFar);
+    }
+    void pathDeposit(Object *object, const Surface *surface, const Vec3f &amt)
+    {
+        if (currPath == nullptr) return;
+        BakeDeposit deposit = {object, surface->idx, amt};
+        currPath->deposits.push_back(deposit);
+    }
+    void dumpRay(const RayTree &tree, uint32_t idx, uint32_t depth)
     {
+        const RayNode &curr = tree.at(idx);
         #define MAX_DUMP_DEPTH 256 
-        char prefix[MAX_DUMP_DEPTH*2] = "";
         if(depth >= MAX_DUMP_DEPTH) {
             std::printf("dumpRay out of stack\n");
             return;
         }
 
+        Vec3f dir = curr.getDir(), intensity = curr.getIntensity();
         std::printf("%*s%d from(%f,%f,%f)-%d->to(%f,%f,%f), intensity(%f,%f,%f)*\n", depth, "#", depth,
-                    curr[idx]->orig.x, curr[idx]->orig.y, curr[idx]->orig.z, 
-                    curr[idx]->inside,
-                    curr[idx]->dir.x, curr[idx]->dir.y, curr[idx]->dir.z,
-                    curr[idx]->intensity.x, curr[idx]->intensity.y, curr[idx]->intensity.z);
-        if(curr[idx]->hitObject != nullptr) {
-            std::printf("%*s%d hit object: %p, point(%f, %f, %f)\n", depth, "#", depth, 
-                    ((Object *)(curr[idx]->hitObject))->name.c_str(), 
-                    curr[idx]->hitPoint.x, curr[idx]->hitPoint.y, curr[idx]->hitPoint.z);
+                    curr.orig.x, curr.orig.y, curr.orig.z, 
+                    curr.inside,
+                    dir.x, dir.y, dir.z,
+                    intensity.x, intensity.y, intensity.z);
+        if (curr.weakCount != 0 || curr.overflowCount != 0)
+            std::printf("%*s%d ignored weak:%d, overflow:%d\n", depth, "#", depth, curr.weakCount, curr.overflowCount);
+        if(curr.hitObject != nullptr) {
+            Vec3f hitPoint = curr.getHitPoint();
+            std::printf("%*s%d hit object: %s, point(%f, %f, %f)\n", depth, "#", depth, 
+                    ((Object *)(curr.hitObject))->name.c_str(), 
+                    hitPoint.x, hitPoint.y, hitPoint.z);
 
-            for(uint32_t i=0; i<curr[idx]->reflectionLink.size(); i++) {
-                std::printf("%*s%d reflect[%d]:\n", depth+1, "#", depth+1, i);
-                dumpRay(curr[idx]->reflectionLink, i, depth+1);
-            }
-
-            for(uint32_t i=0; i<curr[idx]->refractionLink.size(); i++) {
-                std::printf("%*s%d refract[%d]:\n", depth+1, "#", depth+1, i);
-                dumpRay(curr[idx]->refractionLink, i, depth+1);
-            }
-
-            for(uint32_t i=0; i<curr[idx]->diffuseLink.size(); i++) {
-                std::printf("%*s%d diffuse[%d]:\n", depth+1, "#", depth+1, i);
-                dumpRay(curr[idx]->diffuseLink, i, depth+1);
+            // children are linked in reverse record order
+            std::vector<uint32_t> children;
+            for (uint32_t child = curr.firstChild; child != RAY_NODE_NONE; child = tree.at(child).nextSibling)
+                children.push_back(child);
+            uint32_t types[] = {RAY_TYPE_REFLECTION, RAY_TYPE_REFRACTION, RAY_TYPE_DIFFUSE};
+            for (uint32_t t = 0; t < sizeof(types)/sizeof(types[0]); t++) {
+                uint32_t i = 0;
+                for (uint32_t c = children.size(); c-- > 0; ) {
+                    if (tree.at(children[c]).type != types[t]) continue;
+                    std::printf("%*s%d %s[%d]:\n", depth+1, "#", depth+1, RayTypeString[types[t]], i++);
+                    dumpRay(tree, children[c], depth+1);
+                }
             }
         }
         else
             std::printf("%*s%d nohit\n", depth, "#", depth);
     }
+    // dump the first recorded root ray of a pixel or shade point
+    void dumpRoot(const RayTree &tree, uint32_t index)
+    {
+        uint32_t idx = tree.roots[index];
+        if (idx == RAY_NODE_NONE) return;
+        // roots are linked in reverse record order too
+        while (tree.at(idx).nextSibling != RAY_NODE_NONE)
+            idx = tree.at(idx).nextSibling;
+        dumpRay(tree, idx, 1);
+    }
 
     void dumpObjectTraceLink(
         const std::vector<std::unique_ptr<Object>> &objects,
@@ -107,7 +234,7 @@ public:
         if (objects[objIdx]->traceLinks == nullptr) return;
         std::printf("***dump light trace rays of object-vertical-horizon(%s,%d,%d)***\n", objects[objIdx]->name.c_str(), vertical, horizon);
         uint32_t index = vertical*objects[objIdx]->hRes + horizon;
-        dumpRay(objects[objIdx]->traceLinks[index], 0, 1);
+        dumpRoot(*objects[objIdx]->traceLinks, index);
     }
 
     void dumpEyeTraceLink(
@@ -118,17 +245,28 @@ public:
         std::printf("***********dump eye trace rays of pixel(%d,%d)**************\n", vertical, horizon);
         assert( vertical < VIEW_HEIGHT && horizon < VIEW_WIDTH );
         uint32_t index = vertical*VIEW_WIDTH + horizon;
-        dumpRay(eyeTraceLinks[index], 0, 1);
+        dumpRoot(*eyeTraceLinks, index);
     }
 
     Options option;
     // Pixel point of current processing original ray
     Vec3f currPixel;
-    Ray *currRay;
+    // recorded ray being cast, RAY_NODE_NONE if the ray is not recorded
+    uint32_t currRay;
+    // index of the render worker owning this store, -1 for the main store
+    int32_t workerIdx = -1;
+
+    // tree of currRay and of its children
+    RayTree *currTree = nullptr;
+
+    RayTree *eyeTraceLinks = nullptr;
 
-    std::vector<std::unique_ptr<Ray>> *eyeTraceLinks = nullptr;
+    // path of the shade point being baked, nullptr if the bake is not tracked
+    BakePath *currPath = nullptr;
+    float pathFar = 0;
+    bool ownEyeTraceLinks = false;
 
-    // Counter of total memory to record rays
+    // Counter of total memory to record rays, as grown tree footprint
     MY_UINT64_T totalMem;
     // Counter of total rays, DO NOT include overflow rays
     uint32_t totalRays;
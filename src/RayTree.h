@@ -0,0 +1,102 @@
+#ifndef RAYTREEH
+#define RAYTREEH
+#include <cstdlib>
+#include <cstdio>
+#include <iostream>
+#include <iomanip>
+#include <cmath>
+#include <vector>
+#include <new>
+#include <cassert>
+
+#include "Values.h"
+#include "Ray.h"
+
+static_assert(sizeof(RayNode) == 48, "RayNode should stay 48 bytes");
+
+// rays in one chunk of a RayTree, a power of 2
+#define RAY_TREE_CHUNK 16384
+
+// [comment]
+// Recorded rays of a trace link (the eye rays of a RayStore or the rays of an object), as
+// RayNode linked by indices. The nodes are carved out of chunks of RAY_TREE_CHUNK nodes which
+// never move, index idx is node idx % RAY_TREE_CHUNK of chunk idx / RAY_TREE_CHUNK, so the
+// tree grows without copying its rays and all of them are freed at once.
+// roots[i] is the first root ray of pixel or shade point i, the other roots of the same point
+// follow through nextSibling.
+// New rays are linked in front of their siblings, so siblings are in reverse record order.
+// The tree is not thread safe, the render passes run on one thread while recording.
+// [/comment]
+class RayTree
+{
+public:
+    // rootNum is the number of pixels or shade points of the trace link
+    RayTree(const uint32_t rootNum) : roots(rootNum, RAY_NODE_NONE) {}
+    ~RayTree() { release(); }
+    RayTree(const RayTree &) = delete;
+    RayTree &operator=(const RayTree &) = delete;
+
+    RayNode &at(const uint32_t idx) { return chunks[idx / RAY_TREE_CHUNK][idx % RAY_TREE_CHUNK]; }
+    const RayNode &at(const uint32_t idx) const { return chunks[idx / RAY_TREE_CHUNK][idx % RAY_TREE_CHUNK]; }
+    uint32_t size(void) const { return top; }
+
+    // add a root ray to pixel or shade point rootIdx, returns its index
+    uint32_t addRoot(const uint32_t rootIdx, const RayType type, const Vec3f &orig, const Vec3f &dir,
+                     const Vec3f &intensity = -1)
+    {
+        uint32_t idx = newNode(type, RAY_NODE_NONE, orig, dir, false, intensity);
+        at(idx).nextSibling = roots[rootIdx];
+        roots[rootIdx] = idx;
+        return idx;
+    }
+
+    // add a child ray to ray parent, returns its index
+    uint32_t addChild(const uint32_t parent, const RayType type, const Vec3f &orig, const Vec3f &dir,
+                      const bool inside, const Vec3f &intensity = -1)
+    {
+        uint32_t idx = newNode(type, parent, orig, dir, inside, intensity);
+        at(idx).nextSibling = at(parent).firstChild;
+        at(parent).firstChild = idx;
+        return idx;
+    }
+
+    // memory held by the tree
+    MY_UINT64_T footprint(void) const
+    {
+        return (MY_UINT64_T)chunks.size() * RAY_TREE_CHUNK * sizeof(RayNode) + roots.capacity() * sizeof(uint32_t);
+    }
+
+    // free all the rays at once
+    void release(void)
+    {
+        for (uint32_t i = 0; i < chunks.size(); i++)
+            free(chunks[i]);
+        std::vector<RayNode *>().swap(chunks);
+        top = 0;
+        roots.assign(roots.size(), RAY_NODE_NONE);
+    }
+
+    // first root ray of each pixel or shade point
+    std::vector<uint32_t> roots;
+
+private:
+    uint32_t newNode(const RayType type, const uint32_t parent, const Vec3f &orig, const Vec3f &dir,
+                     const bool inside, const Vec3f &intensity)
+    {
+        if (top == chunks.size() * RAY_TREE_CHUNK) {
+            RayNode *chunk = (RayNode *)malloc(sizeof(RayNode) * RAY_TREE_CHUNK);
+            assert(chunk != nullptr);
+            chunks.push_back(chunk);
+        }
+        uint32_t idx = top++;
+        RayNode *node = new (&at(idx)) RayNode();
+        node->set(type, parent, orig, dir, inside, intensity);
+        return idx;
+    }
+
+    std::vector<RayNode *> chunks;
+    // index of the next free node
+    uint32_t top = 0;
+};
+
+#endif
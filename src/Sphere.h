@@ -10,10 +10,18 @@
 #include "Object.h"
 
 
+// [comment]
+// The shade points of a sphere are a grid of the directions of their normals. The polar grid
+// (ANGLE_MAPPING_POLAR) cuts theta and phi evenly, its shade points shrink towards the poles.
+// The octahedral grid (ANGLE_MAPPING_OCTAHEDRAL) gives all the shade points the same area,
+// as large as the polar ones at the equator, so it needs about a third less of them.
+// Any other mapping gives the polar grid.
+// [/comment]
 class Sphere : public Object
 {
 public:
-    Sphere(const std::string name, const MaterialType type, const Vec3f &c, const float &r) : center(c), radius(r), radius2(r * r) 
+    Sphere(const std::string name, const MaterialType type, const Vec3f &c, const float &r,
+           const AngleMapping mapping = ANGLE_MAPPING_POLAR) : center(c), radius(r), radius2(r * r)
     {
         materialType = type;
         switch (materialType) {
@@ -28,19 +36,19 @@ public:
         }
         // vertical range is [0,180], horizon range is [0,360)
         uint32_t vRes = (180.+1.)*ampRatio*r, hRes = 360.*ampRatio*r;
+        if (mapping == ANGLE_MAPPING_OCTAHEDRAL) {
+            // shade points of the area of a polar one at the equator, 181/vRes by 360/hRes degrees
+            vRes = hRes = ceil(sqrt(360. * vRes * hRes / (181. * M_PI)));
+            surfaceBins = AngleBins(181, vRes, hRes, ANGLE_MAPPING_OCTAHEDRAL);
+        }
+        else
+            surfaceBins = AngleBins(181, vRes, hRes);
         setType(OBJECT_TYPE_SPHERE);
         setName(name);
         setResolution(vRes, hRes);
-        //MY_UINT64_T size = (MY_UINT64_T)sizeof(Surface) * vRes * hRes;
-        //pSurfaces = (Surface *)malloc(size);
-        uint32_t vAngleRes = 0;
-        uint32_t hAngleRes = 0;
-        for (uint32_t i=0; i<vRes*hRes; i++) {
-            Surface *surface = new Surface(surfaceAngleRatio);
-            pSurfaces.push_back(std::unique_ptr<Surface>(surface));
-            if (vAngleRes < surface->vAngleRes) vAngleRes = surface->vAngleRes;
-            if (hAngleRes < surface->hAngleRes) hAngleRes = surface->hAngleRes;
-        }
+        initSurfaces(vRes*hRes, surfaceAngleRatio);
+        uint32_t vAngleRes = numSurfaces > 0 ? surfaces[0].vAngleRes : 0;
+        uint32_t hAngleRes = numSurfaces > 0 ? surfaces[0].hAngleRes : 0;
         uint64_t raysNum = vRes*hRes + vRes*hRes*vAngleRes*hAngleRes;
         std::printf("sphere:%s, shadePoint:%d (vRes:%d, hRes:%d), pointAngle:%d (vAngle:%d, hAngle:%d), rays:%lu\n", 
                     name.c_str(), vRes*hRes, vRes, hRes, vAngleRes*hAngleRes, vAngleRes, hAngleRes, raysNum);
@@ -53,6 +61,16 @@ public:
         Surface *curr;
         // DEBUG
         uint32_t idx = 0;
+        if (surfaceBins.mapping == ANGLE_MAPPING_OCTAHEDRAL) {
+            // the normal of a shade point is the center of its bin
+            for (uint32_t v = 0; v < vRes; ++v) {
+                for (uint32_t h = 0; h < hRes; ++h) {
+                    Vec3f normal = surfaceBins.direction(v, h);
+                    getSurfaceByVH(v, h)->reset(idx++, normal);
+                }
+            }
+            return;
+        }
         for (uint32_t v = 0; v < vRes; ++v) {
             for (uint32_t h = 0; h < hRes; ++h) {
                 curr = getSurfaceByVH(v, h);
@@ -62,8 +80,7 @@ public:
                 phi = deg2rad(360.f * h/hRes);
                 //Vec3f normal = Vec3f(sin(phi)*sin(theta), cos(theta), cos(phi)*sin(theta));
                 Vec3f normal = Vec3f(cos(phi)*sin(theta), cos(theta), sin(phi)*sin(theta));
-                Vec3f surfaceCenter = center+normal*radius;
-                curr->reset(idx++, normal, surfaceCenter);
+                curr->reset(idx++, normal);
 /*
                 if (v >= 360 )
                     std::printf("&&&&v=%d, vRes=%d, theta=%f, N.y=%f\n",v, vRes, theta, curr->N.y);
@@ -71,7 +88,7 @@ public:
             }
         }
     }
-    bool intersect(const Vec3f &orig, const Vec3f &dir, float &tnear, Vec3f &point, Vec2f &mapIdx, Surface **surface, SurfaceAngle **angle) const
+    bool intersect(const Vec3f &orig, const Vec3f &dir, float &tnear, uint32_t &, Vec2f &) const
     {
         // analytic solution
         Vec3f L = orig - center;
@@ -81,21 +98,79 @@ public:
         float t0, t1;
         if (!solveQuadratic(a, b, c, t0, t1)) return false;
         if (t0 < 0) t0 = t1;
-        if (t0 < 0) return false;
+        if (t0 < 0 || t0 >= tnear) return false;
         tnear = t0;
-
+        return true;
+    }
+    // [comment]
+    // The rays of a packet share L and c. The SSE kernel solves 4 of them at once with the
+    // operations of intersect() and solveQuadratic(), whose q is computed in double, so that
+    // every lane gives the distance of the single ray, bit for bit.
+    // [/comment]
+    void intersectPacket(RayPacket &packet, const uint32_t id) const
+    {
+        Vec3f L = packet.orig - center;
+        float c = dotProduct(L, L) - radius2;
+        uint32_t r = 0;
+#ifdef RAY_PACKET_SSE_KERNEL
+        __m128 Lx = _mm_set1_ps(L.x), Ly = _mm_set1_ps(L.y), Lz = _mm_set1_ps(L.z), cK = _mm_set1_ps(c);
+        for (; r + 4 <= packet.size; r += 4)
+            hitLanes(intersectLanes(Lx, Ly, Lz, cK, &packet.dir[0][r], &packet.dir[1][r], &packet.dir[2][r],
+                                    &packet.tNear[r]), id, &packet.object[r], &packet.index[r], &packet.uv[r]);
+#endif
+        for (; r < packet.size; r++) {
+            Vec3f dir = packet.direction(r);
+            float a = dotProduct(dir, dir);
+            float b = 2 * dotProduct(dir, L);
+            float t0, t1;
+            if (!solveQuadratic(a, b, c, t0, t1)) continue;
+            if (t0 < 0) t0 = t1;
+            if (t0 < 0 || !(t0 < packet.tNear[r])) continue;
+            packet.tNear[r] = t0;
+            packet.object[r] = id;
+            packet.index[r] = 0;
+            packet.uv[r] = 0;
+        }
+    }
+    // the same kernel with L and c of each ray
+    void intersectBatch(RayBatch &batch, const uint32_t id) const
+    {
+        uint32_t r = 0;
+#ifdef RAY_PACKET_SSE_KERNEL
+        __m128 cx = _mm_set1_ps(center.x), cy = _mm_set1_ps(center.y), cz = _mm_set1_ps(center.z);
+        __m128 r2 = _mm_set1_ps(radius2);
+        for (; r + 4 <= batch.size; r += 4) {
+            __m128 Lx = _mm_sub_ps(_mm_loadu_ps(&batch.orig[0][r]), cx);
+            __m128 Ly = _mm_sub_ps(_mm_loadu_ps(&batch.orig[1][r]), cy);
+            __m128 Lz = _mm_sub_ps(_mm_loadu_ps(&batch.orig[2][r]), cz);
+            __m128 c = _mm_sub_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(Lx, Lx), _mm_mul_ps(Ly, Ly)), _mm_mul_ps(Lz, Lz)), r2);
+            hitLanes(intersectLanes(Lx, Ly, Lz, c, &batch.dir[0][r], &batch.dir[1][r], &batch.dir[2][r],
+                                    &batch.tNear[r]), id, &batch.object[r], &batch.index[r], &batch.uv[r]);
+        }
+#endif
+        for (; r < batch.size; r++) {
+            uint32_t index = 0;
+            Vec2f uv = 0;
+            float t = batch.tNear[r];
+            // trace() drops the NaN distance of a null direction the same way
+            if (!intersect(batch.origin(r), batch.direction(r), t, index, uv) || !(t < batch.tNear[r])) continue;
+            batch.tNear[r] = t;
+            batch.object[r] = id;
+            batch.index[r] = 0;
+            batch.uv[r] = 0;
+        }
+    }
+    void resolveHit(const Vec3f &orig, const Vec3f &dir, const float tnear, const uint32_t, const Vec2f &,
+                    Vec3f &point, Vec2f &mapIdx, Surface **surface, SurfaceAngle **angle) const
+    {
         point = orig + dir * tnear;
         Vec3f N = normalize(point - center);
         /* caculate the hit point refer to sphere center on the surface */
-        float theta = rad2deg(acos(N.y));
-        //float phi = rad2deg(atan2(N.x, N.z));
-        float phi = rad2deg(atan2(N.z, N.x));
-        /* set the bitmap index */
-        mapIdx.x = theta;
-        mapIdx.y = phi;
+        /* set the bitmap index to theta and phi */
         uint32_t v,h;
-        v = floor(theta/181.0*vRes);
-        h = floor(phi/360.0*hRes);
+        surfaceBins.lookup(N, v, h, &mapIdx.x, &mapIdx.y);
+        if (surfaceBins.mapping != ANGLE_MAPPING_POLAR)
+            mapIdx = Vec2f(v, h);
         Surface *pSurface = getSurfaceByVH(v, h);
         assert(surface != nullptr);
         *surface = pSurface;
@@ -105,8 +180,6 @@ public:
             *angle = pSurface->getSurfaceAngleByDir(-dir);
         else
             *angle = nullptr;
-
-        return true;
     }
 
     Vec3f pointRel2Abs(const Vec3f &rel) const
@@ -119,18 +192,99 @@ public:
         return (abs - center) * (1/radius);
     }
 
+    BBox getBounds(void) const
+    {
+        return BBox(center - radius, center + radius);
+    }
+
+    // move the sphere, reset() places the shade points again
+    void setCenter(const Vec3f &c)
+    {
+        center = c;
+        geometryChanged();
+    }
+
+    uint64_t hashGeometry(uint64_t hash) const
+    {
+        hash = hashBytes(hash, &center, sizeof(center));
+        hash = hashBytes(hash, &radius, sizeof(radius));
+        return hashBytes(hash, &surfaceBins.mapping, sizeof(surfaceBins.mapping));
+    }
+
     Surface* getSurfaceByVH(const uint32_t &v, const uint32_t &h, Vec3f *worldPoint = nullptr) const
     {
         //assert( v < vRes && h < hRes);
         Surface *surface;
-        surface = pSurfaces.at(v%vRes*hRes + h%hRes).get();
+        surface = &surfaces[v%vRes*hRes + h%hRes];
         if (surface != nullptr && worldPoint != nullptr)
             *worldPoint = center + surface->N*radius;
         return surface;
     }
 
+#ifdef RAY_PACKET_SSE_KERNEL
+    // [comment]
+    // intersect() of 4 rays: the lanes of L, c and of the directions at dx, dy, dz. A lane hit
+    // closer than its tNear gets the distance, and its bit is set in the returned mask. The NaN
+    // distance of a null direction is no hit, as in trace().
+    // [/comment]
+    static uint32_t intersectLanes(const __m128 Lx, const __m128 Ly, const __m128 Lz, const __m128 c,
+                                   const float *dx, const float *dy, const float *dz, float *tNear)
+    {
+        __m128 zero = _mm_setzero_ps();
+        __m128d half = _mm_set1_pd(-0.5), zeroD = _mm_setzero_pd();
+        __m128 x = _mm_loadu_ps(dx), y = _mm_loadu_ps(dy), z = _mm_loadu_ps(dz);
+        __m128 a = _mm_add_ps(_mm_add_ps(_mm_mul_ps(x, x), _mm_mul_ps(y, y)), _mm_mul_ps(z, z));
+        __m128 b = _mm_mul_ps(_mm_set1_ps(2.f),
+            _mm_add_ps(_mm_add_ps(_mm_mul_ps(x, Lx), _mm_mul_ps(y, Ly)), _mm_mul_ps(z, Lz)));
+        __m128 discr = _mm_sub_ps(_mm_mul_ps(b, b), _mm_mul_ps(_mm_mul_ps(_mm_set1_ps(4.f), a), c));
+        __m128 solved = _mm_cmpge_ps(discr, zero);
+        if (_mm_movemask_ps(solved) == 0) return 0;
+        // q = -0.5 * (b +/- sqrt(discr)), and -0.5 * b / a for a double root, in double
+        __m128d qD[2], rootD[2];
+        for (uint32_t k = 0; k < 2; k++) {
+            // lanes 0 and 1, then lanes 2 and 3
+            __m128d bD = _mm_cvtps_pd(k == 0 ? b : _mm_movehl_ps(b, b));
+            __m128d aD = _mm_cvtps_pd(k == 0 ? a : _mm_movehl_ps(a, a));
+            __m128d sD = _mm_sqrt_pd(_mm_cvtps_pd(k == 0 ? discr : _mm_movehl_ps(discr, discr)));
+            __m128d positive = _mm_cmpgt_pd(bD, zeroD);
+            __m128d sum = _mm_or_pd(_mm_and_pd(positive, _mm_add_pd(bD, sD)),
+                                    _mm_andnot_pd(positive, _mm_sub_pd(bD, sD)));
+            qD[k] = _mm_mul_pd(half, sum);
+            rootD[k] = _mm_div_pd(_mm_mul_pd(half, bD), aD);
+        }
+        __m128 q = _mm_movelh_ps(_mm_cvtpd_ps(qD[0]), _mm_cvtpd_ps(qD[1]));
+        __m128 root = _mm_movelh_ps(_mm_cvtpd_ps(rootD[0]), _mm_cvtpd_ps(rootD[1]));
+        __m128 x0 = _mm_div_ps(q, a), x1 = _mm_div_ps(c, q);
+        __m128 single = _mm_cmpeq_ps(discr, zero);
+        x0 = _mm_or_ps(_mm_and_ps(single, root), _mm_andnot_ps(single, x0));
+        x1 = _mm_or_ps(_mm_and_ps(single, root), _mm_andnot_ps(single, x1));
+        __m128 swap = _mm_cmpgt_ps(x0, x1);
+        __m128 t0 = _mm_or_ps(_mm_and_ps(swap, x1), _mm_andnot_ps(swap, x0));
+        __m128 t1 = _mm_or_ps(_mm_and_ps(swap, x0), _mm_andnot_ps(swap, x1));
+        __m128 behind = _mm_cmplt_ps(t0, zero);
+        t0 = _mm_or_ps(_mm_and_ps(behind, t1), _mm_andnot_ps(behind, t0));
+        __m128 tOld = _mm_loadu_ps(tNear);
+        __m128 rejected = _mm_or_ps(_mm_cmplt_ps(t0, zero), _mm_cmpnlt_ps(t0, tOld));
+        __m128 hit = _mm_andnot_ps(rejected, solved);
+        _mm_storeu_ps(tNear, _mm_or_ps(_mm_and_ps(hit, t0), _mm_andnot_ps(hit, tOld)));
+        return _mm_movemask_ps(hit);
+    }
+    static void hitLanes(uint32_t hitMask, const uint32_t id, uint32_t *object, uint32_t *index, Vec2f *uv)
+    {
+        for (uint32_t lane = 0; hitMask != 0; lane++, hitMask >>= 1) {
+            if (!(hitMask & 1)) continue;
+            object[lane] = id;
+            index[lane] = 0;
+            uv[lane] = 0;
+        }
+    }
+#endif
+
     Vec3f center;
     float radius, radius2;
+    // shade point of a normal: theta bins of 181/vRes degrees and phi bins of 360/hRes degrees,
+    // or octahedral bins
+    AngleBins surfaceBins;
 };
 
 #endif
@@ -0,0 +1,57 @@
+#ifndef SPHERICALHARMONICSH
+#define SPHERICALHARMONICSH
+#include <cstdlib>
+#include <cstdio>
+#include <iostream>
+#include <iomanip>
+#include <cmath>
+
+#include "Vec3.h"
+
+// bands 0 to SH_ORDER_MAX, (SH_ORDER_MAX+1)^2 coefficients
+#define SH_ORDER_MAX    4
+#define SH_COEFFS_MAX   ((SH_ORDER_MAX + 1) * (SH_ORDER_MAX + 1))
+
+// coefficients of the bands 0 to order
+inline uint32_t shCoeffsNum(const uint32_t order) { return (order + 1) * (order + 1); }
+
+// [comment]
+// Real orthonormal spherical harmonics of the bands 0 to order (at most SH_ORDER_MAX) at the
+// unit direction d, into basis[l*l + l + m]. The polynomial forms, no trigonometry.
+// [/comment]
+inline void evalSH(const uint32_t order, const Vec3f &d, float *basis)
+{
+    float x = d.x, y = d.y, z = d.z;
+    float x2 = x * x, y2 = y * y, z2 = z * z;
+    basis[0] = 0.2820947918f;
+    if (order < 1) return;
+    basis[1] = 0.4886025119f * y;
+    basis[2] = 0.4886025119f * z;
+    basis[3] = 0.4886025119f * x;
+    if (order < 2) return;
+    basis[4] = 1.0925484306f * x * y;
+    basis[5] = 1.0925484306f * y * z;
+    basis[6] = 0.3153915653f * (3 * z2 - 1);
+    basis[7] = 1.0925484306f * x * z;
+    basis[8] = 0.5462742153f * (x2 - y2);
+    if (order < 3) return;
+    basis[9]  = 0.5900435899f * (3 * x2 - y2) * y;
+    basis[10] = 2.8906114426f * x * y * z;
+    basis[11] = 0.4570457995f * y * (5 * z2 - 1);
+    basis[12] = 0.3731763326f * z * (5 * z2 - 3);
+    basis[13] = 0.4570457995f * x * (5 * z2 - 1);
+    basis[14] = 1.4453057213f * (x2 - y2) * z;
+    basis[15] = 0.5900435899f * (x2 - 3 * y2) * x;
+    if (order < 4) return;
+    basis[16] = 2.5033429418f * x * y * (x2 - y2);
+    basis[17] = 1.7701307698f * (3 * x2 - y2) * y * z;
+    basis[18] = 0.9461746958f * x * y * (7 * z2 - 1);
+    basis[19] = 0.6690465436f * y * z * (7 * z2 - 3);
+    basis[20] = 0.1057855469f * (35 * z2 * z2 - 30 * z2 + 3);
+    basis[21] = 0.6690465436f * x * z * (7 * z2 - 3);
+    basis[22] = 0.4730873479f * (x2 - y2) * (7 * z2 - 1);
+    basis[23] = 1.7701307698f * (x2 - 3 * y2) * x * z;
+    basis[24] = 0.6258357354f * (x2 * (x2 - 3 * y2) - y2 * (3 * x2 - y2));
+}
+
+#endif
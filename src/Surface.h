@@ -11,45 +11,64 @@
 #include "Vec2.h"
 #include "Vec3.h"
 #include "SurfaceAngle.h"
+#include "AngleBins.h"
+#include "SphericalHarmonics.h"
 
 // shade point on each object
 class Surface {
 public:
-    Surface(const float surfaceAngleRatio) : angleRatio(surfaceAngleRatio) {
+    Surface() {}
+    // [comment]
+    // The angles are not owned by the surface, they are the part of the angle slab of its
+    // object starting at slab, vAngleRes*hAngleRes of them. bins maps the directions to them,
+    // it is shared by the surfaces of the object.
+    // [/comment]
+    void init(const float surfaceAngleRatio, const AngleMapping mapping, SurfaceAngle *slab, const AngleBins *bins) {
+        angleRatio = surfaceAngleRatio;
+        angleRes(angleRatio, mapping, vAngleRes, hAngleRes);
+        angles = (angleRatio > 0.) ? slab : nullptr;
+        angleBins = bins;
+    }
+    // [comment]
+    // Size of the angle grid. The polar grid cuts theta[0,90] and phi[0,360) in bins of
+    // 1/angleRatio degree, its bins shrink towards the normal. The concentric grid is n*n bins
+    // of the solid angle of the largest polar bin, the one at the horizon.
+    // [/comment]
+    static void angleRes(const float surfaceAngleRatio, const AngleMapping mapping, uint32_t &vRes, uint32_t &hRes)
+    {
         /* caculate the hit angle refer to sphere Normal on the surface */
         /* each surface will cast rays into a half sphere space which express as theta[0,90),phi[0,360) */
-        vAngleRes = (90.+1.)*angleRatio;
-        hAngleRes = (360.)*angleRatio;
-        if (angleRatio > 0.) {
-            MY_UINT64_T size = (MY_UINT64_T)sizeof(SurfaceAngle)*vAngleRes*hAngleRes;
-            angles = (SurfaceAngle *)malloc(size);
-            std::memset(angles, 0, size);
-        }
+        vRes = (90.+1.)*surfaceAngleRatio;
+        hRes = (360.)*surfaceAngleRatio;
+        if (mapping == ANGLE_MAPPING_CONCENTRIC)
+            vRes = hRes = ceil(sqrt(2. * vRes * hRes / M_PI));
     }
-    void reset(uint32_t index, Vec3f &normal, Vec3f center) {
+    // angles of each surface
+    static uint32_t angleNum(const float surfaceAngleRatio, const AngleMapping mapping)
+    {
+        if (surfaceAngleRatio <= 0.) return 0;
+        uint32_t vRes, hRes;
+        angleRes(surfaceAngleRatio, mapping, vRes, hRes);
+        return vRes * hRes;
+    }
+    void reset(uint32_t index, const Vec3f &normal) {
         idx = index;
         N = normal;
-        if (angleRatio > 0.0) {
-            local2World = lookAt(center, center+N);
-            world2Local = local2World.inverse();
-        }
-        MY_UINT64_T size = (MY_UINT64_T)sizeof(SurfaceAngle)*vAngleRes*hAngleRes;
-        std::memset(angles, 0, size);
+        for (uint32_t i = 0; angles != nullptr && i < vAngleRes*hAngleRes; i++)
+            angles[i].setColor(0);
+        for (uint32_t i = 0; sh != nullptr && i < shCoeffsNum(shOrder); i++)
+            sh[i] = 0;
     }
 
+    // the angle (v, h), nullptr if the angles are kept as SH, and its direction in world space
     SurfaceAngle* getSurfaceAngleByVH(const uint32_t v, const uint32_t h, Vec3f * relPoint=nullptr) const
     {
         SurfaceAngle *angle = nullptr;
-        if(angles == nullptr) return angle;
-        angle = angles + v%vAngleRes*hAngleRes + h%hAngleRes;
-        if (relPoint != nullptr) {
-            float theta = deg2rad(v*90.0/vAngleRes);
-            float phi = deg2rad(h*360.0/hAngleRes);
-            assert (theta>=0. && theta<=90.);
-            assert (phi>=0. && phi<360.);
-            Vec3f relPointN = Vec3f(cos(phi)*sin(theta), cos(theta), sin(phi)*sin(theta));
-            local2World.multDirMatrix(relPointN, *relPoint);
-        }
+        if(angleRatio <= 0.) return angle;
+        if (angles != nullptr)
+            angle = angles + v%vAngleRes*hAngleRes + h%hAngleRes;
+        if (relPoint != nullptr)
+            *relPoint = localToWorld(angleBins->direction(v, h));
         return angle;
     }    
 
@@ -59,31 +78,94 @@ public:
         /* caculate the hit angle refer to sphere Normal on the surface */
         /* each surface will cast rays into a half sphere space which express as theta[0,90),phi[0,360) */
         uint32_t v,h;
-        v = floor(theta/90.0*vAngleRes);
-        h = floor(phi/360.0*hAngleRes);
+        if (angleBins->mapping == ANGLE_MAPPING_POLAR) {
+            v = floor(theta/90.0*vAngleRes);
+            h = floor(phi/360.0*hAngleRes);
+        }
+        else {
+            float thetaRad = deg2rad(theta), phiRad = deg2rad(phi);
+            angleBins->lookup(Vec3f(cos(phiRad)*sin(thetaRad), cos(thetaRad), sin(phiRad)*sin(thetaRad)), v, h);
+        }
         return angles + v*hAngleRes + h;
     }
 
     SurfaceAngle* getSurfaceAngleByDir(const Vec3f &dir, uint32_t *angleV = nullptr, uint32_t *angleH = nullptr) const
     {
-        Vec3f dirWorld;
         if(angles == nullptr) return nullptr;
-        world2Local.multDirMatrix(dir, dirWorld);
-        float theta = rad2deg(acos(dirWorld.y));
-        float phi = rad2deg(atan2(dirWorld.z, dirWorld.x));
+        Vec3f dirWorld = worldToLocal(dir);
         /* caculate the hit angle refer to sphere Normal on the surface */
         /* each surface will cast rays into a half sphere space which express as theta[0,90),phi[0,360) */
         uint32_t v,h;
-        v = floor(theta/90.0*vAngleRes);
-        h = floor(phi/360.0*hAngleRes);
+        angleBins->lookup(dirWorld, v, h);
         if (angleV != nullptr) *angleV = v;
         if (angleH != nullptr) *angleH = h;
         return angles + v*hAngleRes + h;
     }
 
-    // there will be 90*angleRatio*360*angleRatio angles to cast rays
+    // [comment]
+    // Add color, cast for the angle (v, h), to the SH projection coeffs of the angle colors:
+    // the integral of the colors times each basis function, summed bin by bin with the solid
+    // angle of the bin. The colors are only known over the hemisphere, they are mirrored below
+    // it: a hemisphere and zero below would ring at the horizon, where views graze the surface.
+    // [/comment]
+    void projectSH(Vec3f *coeffs, const uint32_t v, const uint32_t h, const Vec3f &color) const
+    {
+        float basis[SH_COEFFS_MAX], mirrored[SH_COEFFS_MAX];
+        Vec3f dir = angleBins->direction(v, h);
+        evalSH(shOrder, dir, basis);
+        evalSH(shOrder, Vec3f(dir.x, -dir.y, dir.z), mirrored);
+        float weight = angleBins->solidAngle(v, h);
+        for (uint32_t k = 0; k < shCoeffsNum(shOrder); k++)
+            coeffs[k] += color * ((basis[k] + mirrored[k]) * weight);
+    }
+    // the angle color of the local direction dirLocal rebuilt from the SH coefficients
+    Vec3f getColorBySHLocal(const Vec3f &dirLocal) const
+    {
+        float basis[SH_COEFFS_MAX];
+        evalSH(shOrder, dirLocal, basis);
+        Vec3f color = 0;
+        for (uint32_t k = 0; k < shCoeffsNum(shOrder); k++)
+            color += sh[k] * basis[k];
+        return color;
+    }
+    // as getSurfaceAngleByDir(dir)->getColor() for the angles kept as SH
+    Vec3f getColorBySH(const Vec3f &dir) const
+    {
+        return getColorBySHLocal(worldToLocal(dir));
+    }
+
+    // [comment]
+    // Tangent frame of the shade point, in which the angles are binned: local y is the normal,
+    // local x and z the tangents which follow from N alone (Duff et al., "Building an
+    // Orthonormal Basis, Revisited"). Nothing is stored, and the frame being orthonormal,
+    // world to local is its transpose.
+    // [/comment]
+    void tangents(Vec3f &t, Vec3f &b) const
+    {
+        float sign = std::copysign(1.f, N.z);
+        float a = -1 / (sign + N.z);
+        float c = N.x * N.y * a;
+        b = Vec3f(1 + sign * N.x * N.x * a, sign * c, -sign * N.x);
+        t = Vec3f(c, sign + N.y * N.y * a, -N.y);
+    }
+    Vec3f localToWorld(const Vec3f &dir) const
+    {
+        Vec3f t, b;
+        tangents(t, b);
+        return t * dir.x + N * dir.y + b * dir.z;
+    }
+    Vec3f worldToLocal(const Vec3f &dir) const
+    {
+        Vec3f t, b;
+        tangents(t, b);
+        return Vec3f(dotProduct(dir, t), dotProduct(dir, N), dotProduct(dir, b));
+    }
+
+    // there will be vAngleRes*hAngleRes angles to cast rays, see angleRes()
     float angleRatio = 0.0;
-    uint32_t vAngleRes, hAngleRes;
+    uint32_t vAngleRes = 0, hAngleRes = 0;
+    // maps the directions to the angles: theta and phi bins, or concentric bins
+    const AngleBins *angleBins = nullptr;
 
     // hitColor = diffuseColor*diffuseAmt + specularColor * specularAmt;
     // diffuseAmt = SUM(diffuseAmt from each light)
@@ -95,14 +177,14 @@ public:
     //Vec3f specularAmt;
     // now set it to hitObject->Ks;
     //Vec3f specularColor;
-    Vec3f N; // normal
-    // Change local matrix system to world matrix system
-    Matrix44f local2World;
-    Matrix44f world2Local;
+    Vec3f N; // normal, local y of the tangent frame
     /* TBD: index of current surface inside object, it can be caculated instead of using memory */
     uint32_t   idx;
-    // store relfect and refract color to each angles
+    // store relfect and refract color to each angles, in the angle slab of the object
     struct SurfaceAngle *angles = nullptr;
+    // or the projection of the angle colors onto the SH bands 0 to shOrder, in the SH slab of the object
+    Vec3f *sh = nullptr;
+    uint32_t shOrder = 0;
 };
 
 #endif
@@ -2,9 +2,22 @@
 #define SURFACEANGLEH
 
 #include "Vec3.h"
+#include "Packing.h"
 
-// Surface light cast to a specific angle
+// [comment]
+// Surface light cast to a specific angle. The angle slabs are by far the largest baked data,
+// with ANGLE_COLOR_RGB9E5 the color is encoded when set and decoded when read, its largest
+// component within 1/512 of the float value.
+// [/comment]
 struct SurfaceAngle {
+#if ANGLE_COLOR_RGB9E5
+    Vec3f getColor(void) const { return unpackRGB9E5(angleColor); }
+    void setColor(const Vec3f &color) { angleColor = packRGB9E5(color); }
+    uint32_t angleColor;
+#else
+    Vec3f getColor(void) const { return angleColor; }
+    void setColor(const Vec3f &color) { angleColor = color; }
     Vec3f angleColor;
+#endif
 };
 #endif
@@ -0,0 +1,91 @@
+#ifndef THREADPOOLH
+#define THREADPOOLH
+#include <cstdlib>
+#include <cstdio>
+#include <iostream>
+#include <iomanip>
+#include <cmath>
+#include <vector>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <functional>
+
+// [comment]
+// Work stealing scheduler. run() splits the tasks into one contiguous range per worker queue.
+// A worker pops tasks from the front of its own queue and, once it is empty, steals from
+// the back of the queues of the other workers, so that slow tiles don't leave cores idle.
+// The calling thread is worker 0.
+// [/comment]
+class ThreadPool
+{
+public:
+    // threadNum 0 uses every hardware thread
+    ThreadPool(uint32_t threadNum = 0) : threads(threadNum)
+    {
+        if (threads == 0)
+            threads = std::thread::hardware_concurrency();
+        if (threads == 0)
+            threads = 1;
+    }
+    uint32_t size(void) const { return threads; }
+
+    // call task(taskIdx, workerIdx) for each taskIdx in [0, taskNum), returns once all of them are done
+    void run(uint32_t taskNum, const std::function<void(uint32_t, uint32_t)> &task)
+    {
+        queues.clear();
+        for (uint32_t w = 0; w < threads; w++)
+            queues.push_back(std::unique_ptr<WorkQueue>(new WorkQueue()));
+        for (uint32_t t = 0; t < taskNum; t++)
+            queues[(uint64_t)t * threads / taskNum]->tasks.push_back(t);
+
+        std::vector<std::thread> workers;
+        for (uint32_t w = 1; w < threads; w++)
+            workers.push_back(std::thread(&ThreadPool::work, this, w, std::cref(task)));
+        work(0, task);
+        for (uint32_t w = 0; w < workers.size(); w++)
+            workers[w].join();
+        queues.clear();
+    }
+
+private:
+    struct WorkQueue {
+        std::mutex lock;
+        std::deque<uint32_t> tasks;
+    };
+
+    void work(uint32_t worker, const std::function<void(uint32_t, uint32_t)> &task)
+    {
+        uint32_t taskIdx;
+        while (popTask(worker, taskIdx) || stealTask(worker, taskIdx))
+            task(taskIdx, worker);
+    }
+    bool popTask(uint32_t worker, uint32_t &taskIdx)
+    {
+        WorkQueue &queue = *queues[worker];
+        std::lock_guard<std::mutex> guard(queue.lock);
+        if (queue.tasks.empty()) return false;
+        taskIdx = queue.tasks.front();
+        queue.tasks.pop_front();
+        return true;
+    }
+    bool stealTask(uint32_t worker, uint32_t &taskIdx)
+    {
+        // no task is ever added while running, so empty queues everywhere means all done
+        for (uint32_t i = 1; i < threads; i++) {
+            WorkQueue &victim = *queues[(worker + i) % threads];
+            std::lock_guard<std::mutex> guard(victim.lock);
+            if (victim.tasks.empty()) continue;
+            taskIdx = victim.tasks.back();
+            victim.tasks.pop_back();
+            return true;
+        }
+        return false;
+    }
+
+    uint32_t threads;
+    std::vector<std::unique_ptr<WorkQueue>> queues;
+};
+
+#endif
@@ -0,0 +1,201 @@
+#ifndef TRIANGLEBLOCKH
+#define TRIANGLEBLOCKH
+#include <cstdlib>
+#include <cstdio>
+#include <iostream>
+#include <iomanip>
+#include <cmath>
+
+#include "Values.h"
+#include "Vec3.h"
+
+// build with -DTRIANGLE_SCALAR_KERNEL to force the plain C++ kernel
+#if !defined(TRIANGLE_SCALAR_KERNEL) && defined(__AVX2__)
+#include <immintrin.h>
+#define TRIANGLE_AVX2_KERNEL
+#define TRI_BLOCK_WIDTH 8
+#elif !defined(TRIANGLE_SCALAR_KERNEL) && defined(__SSE2__)
+#include <emmintrin.h>
+#define TRIANGLE_SSE_KERNEL
+#define TRI_BLOCK_WIDTH 4
+#else
+#define TRI_BLOCK_WIDTH 4
+#endif
+
+// [comment]
+// TRI_BLOCK_WIDTH triangles packed as structure of arrays, with the edges of Moller-Trumbore
+// already computed: e1 = v1 - v0, e2 = v2 - v0. Unused lanes hold a degenerated triangle
+// (null edges) which is never hit.
+// [/comment]
+struct TriangleBlock {
+    float v0[3][TRI_BLOCK_WIDTH];
+    float e1[3][TRI_BLOCK_WIDTH];
+    float e2[3][TRI_BLOCK_WIDTH];
+    // index of the triangle inside the mesh of each lane
+    uint32_t index[TRI_BLOCK_WIDTH];
+
+    void clear(void)
+    {
+        for (uint32_t lane = 0; lane < TRI_BLOCK_WIDTH; lane++)
+            set(lane, 0, 0, 0, 0);
+    }
+    void set(uint32_t lane, uint32_t triIndex, const Vec3f &p0, const Vec3f &p1, const Vec3f &p2)
+    {
+        Vec3f edge1 = p1 - p0;
+        Vec3f edge2 = p2 - p0;
+        for (uint8_t i = 0; i < 3; i++) {
+            v0[i][lane] = p0[i];
+            e1[i][lane] = edge1[i];
+            e2[i][lane] = edge2[i];
+        }
+        index[lane] = triIndex;
+    }
+};
+
+// [comment]
+// Keep the closest of the lanes set in hitMask, the first lane wins on equal distance
+// like the loop over the triangles does.
+// [/comment]
+inline bool closestLane(const TriangleBlock &block, uint32_t hitMask, const float *tK, const float *uK, const float *vK,
+                        float &tnear, uint32_t &index, float &u, float &v)
+{
+    bool hitted = false;
+    for (uint32_t lane = 0; hitMask != 0; lane++, hitMask >>= 1) {
+        if ((hitMask & 1) && tK[lane] < tnear) {
+            tnear = tK[lane];
+            index = block.index[lane];
+            u = uK[lane];
+            v = vK[lane];
+            hitted = true;
+        }
+    }
+    return hitted;
+}
+
+// [comment]
+// Plain C++ version of the block test. Each lane does exactly the same operations, in the same
+// order, as rayTriangleIntersect() so that the results are bit exact.
+// [/comment]
+inline bool intersectTriangleBlockScalar(const TriangleBlock &block, const Vec3f &orig, const Vec3f &dir,
+                                         float &tnear, uint32_t &index, float &u, float &v)
+{
+    float tK[TRI_BLOCK_WIDTH], uK[TRI_BLOCK_WIDTH], vK[TRI_BLOCK_WIDTH];
+    uint32_t hitMask = 0;
+    for (uint32_t lane = 0; lane < TRI_BLOCK_WIDTH; lane++) {
+        Vec3f v0v1(block.e1[0][lane], block.e1[1][lane], block.e1[2][lane]);
+        Vec3f v0v2(block.e2[0][lane], block.e2[1][lane], block.e2[2][lane]);
+        Vec3f pvec = dir.crossProduct(v0v2);
+        float det = v0v1.dotProduct(pvec);
+        if (fabs(det) < kEpsilon) continue;
+        float invDet = 1 / det;
+        Vec3f tvec = orig - Vec3f(block.v0[0][lane], block.v0[1][lane], block.v0[2][lane]);
+        uK[lane] = tvec.dotProduct(pvec) * invDet;
+        if (uK[lane] < 0 || uK[lane] > 1) continue;
+        Vec3f qvec = tvec.crossProduct(v0v1);
+        vK[lane] = dir.dotProduct(qvec) * invDet;
+        if (vK[lane] < 0 || uK[lane] + vK[lane] > 1) continue;
+        tK[lane] = v0v2.dotProduct(qvec) * invDet;
+        if (tK[lane] < 0) continue;
+        hitMask |= 1 << lane;
+    }
+    return closestLane(block, hitMask, tK, uK, vK, tnear, index, u, v);
+}
+
+#if defined(TRIANGLE_AVX2_KERNEL)
+// one ray against 8 triangles, lane by lane the same operations as the scalar kernel
+inline bool intersectTriangleBlockSIMD(const TriangleBlock &block, const Vec3f &orig, const Vec3f &dir,
+                                       float &tnear, uint32_t &index, float &u, float &v)
+{
+    const __m256 zero = _mm256_setzero_ps(), one = _mm256_set1_ps(1.f);
+    const __m256 dx = _mm256_set1_ps(dir.x), dy = _mm256_set1_ps(dir.y), dz = _mm256_set1_ps(dir.z);
+    __m256 e1x = _mm256_loadu_ps(block.e1[0]), e1y = _mm256_loadu_ps(block.e1[1]), e1z = _mm256_loadu_ps(block.e1[2]);
+    __m256 e2x = _mm256_loadu_ps(block.e2[0]), e2y = _mm256_loadu_ps(block.e2[1]), e2z = _mm256_loadu_ps(block.e2[2]);
+    // pvec = dir x e2
+    __m256 px = _mm256_sub_ps(_mm256_mul_ps(dy, e2z), _mm256_mul_ps(dz, e2y));
+    __m256 py = _mm256_sub_ps(_mm256_mul_ps(dz, e2x), _mm256_mul_ps(dx, e2z));
+    __m256 pz = _mm256_sub_ps(_mm256_mul_ps(dx, e2y), _mm256_mul_ps(dy, e2x));
+    __m256 det = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(e1x, px), _mm256_mul_ps(e1y, py)), _mm256_mul_ps(e1z, pz));
+    __m256 absDet = _mm256_andnot_ps(_mm256_set1_ps(-0.f), det);
+    __m256 mask = _mm256_cmp_ps(absDet, _mm256_set1_ps(kEpsilon), _CMP_GE_OQ);
+    if (_mm256_movemask_ps(mask) == 0) return false;
+    __m256 invDet = _mm256_div_ps(one, det);
+    // tvec = orig - v0
+    __m256 tx = _mm256_sub_ps(_mm256_set1_ps(orig.x), _mm256_loadu_ps(block.v0[0]));
+    __m256 ty = _mm256_sub_ps(_mm256_set1_ps(orig.y), _mm256_loadu_ps(block.v0[1]));
+    __m256 tz = _mm256_sub_ps(_mm256_set1_ps(orig.z), _mm256_loadu_ps(block.v0[2]));
+    __m256 uu = _mm256_mul_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(tx, px), _mm256_mul_ps(ty, py)), _mm256_mul_ps(tz, pz)), invDet);
+    mask = _mm256_and_ps(mask, _mm256_and_ps(_mm256_cmp_ps(uu, zero, _CMP_GE_OQ), _mm256_cmp_ps(uu, one, _CMP_LE_OQ)));
+    if (_mm256_movemask_ps(mask) == 0) return false;
+    // qvec = tvec x e1
+    __m256 qx = _mm256_sub_ps(_mm256_mul_ps(ty, e1z), _mm256_mul_ps(tz, e1y));
+    __m256 qy = _mm256_sub_ps(_mm256_mul_ps(tz, e1x), _mm256_mul_ps(tx, e1z));
+    __m256 qz = _mm256_sub_ps(_mm256_mul_ps(tx, e1y), _mm256_mul_ps(ty, e1x));
+    __m256 vv = _mm256_mul_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(dx, qx), _mm256_mul_ps(dy, qy)), _mm256_mul_ps(dz, qz)), invDet);
+    mask = _mm256_and_ps(mask, _mm256_and_ps(_mm256_cmp_ps(vv, zero, _CMP_GE_OQ), _mm256_cmp_ps(_mm256_add_ps(uu, vv), one, _CMP_LE_OQ)));
+    __m256 tt = _mm256_mul_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(e2x, qx), _mm256_mul_ps(e2y, qy)), _mm256_mul_ps(e2z, qz)), invDet);
+    mask = _mm256_and_ps(mask, _mm256_cmp_ps(tt, zero, _CMP_GE_OQ));
+    mask = _mm256_and_ps(mask, _mm256_cmp_ps(tt, _mm256_set1_ps(tnear), _CMP_LT_OQ));
+    uint32_t hitMask = _mm256_movemask_ps(mask);
+    if (hitMask == 0) return false;
+    float tK[8], uK[8], vK[8];
+    _mm256_storeu_ps(tK, tt);
+    _mm256_storeu_ps(uK, uu);
+    _mm256_storeu_ps(vK, vv);
+    return closestLane(block, hitMask, tK, uK, vK, tnear, index, u, v);
+}
+#elif defined(TRIANGLE_SSE_KERNEL)
+// one ray against 4 triangles, lane by lane the same operations as the scalar kernel
+inline bool intersectTriangleBlockSIMD(const TriangleBlock &block, const Vec3f &orig, const Vec3f &dir,
+                                       float &tnear, uint32_t &index, float &u, float &v)
+{
+    const __m128 zero = _mm_setzero_ps(), one = _mm_set1_ps(1.f);
+    const __m128 dx = _mm_set1_ps(dir.x), dy = _mm_set1_ps(dir.y), dz = _mm_set1_ps(dir.z);
+    __m128 e1x = _mm_loadu_ps(block.e1[0]), e1y = _mm_loadu_ps(block.e1[1]), e1z = _mm_loadu_ps(block.e1[2]);
+    __m128 e2x = _mm_loadu_ps(block.e2[0]), e2y = _mm_loadu_ps(block.e2[1]), e2z = _mm_loadu_ps(block.e2[2]);
+    // pvec = dir x e2
+    __m128 px = _mm_sub_ps(_mm_mul_ps(dy, e2z), _mm_mul_ps(dz, e2y));
+    __m128 py = _mm_sub_ps(_mm_mul_ps(dz, e2x), _mm_mul_ps(dx, e2z));
+    __m128 pz = _mm_sub_ps(_mm_mul_ps(dx, e2y), _mm_mul_ps(dy, e2x));
+    __m128 det = _mm_add_ps(_mm_add_ps(_mm_mul_ps(e1x, px), _mm_mul_ps(e1y, py)), _mm_mul_ps(e1z, pz));
+    __m128 absDet = _mm_andnot_ps(_mm_set1_ps(-0.f), det);
+    __m128 mask = _mm_cmpge_ps(absDet, _mm_set1_ps(kEpsilon));
+    if (_mm_movemask_ps(mask) == 0) return false;
+    __m128 invDet = _mm_div_ps(one, det);
+    // tvec = orig - v0
+    __m128 tx = _mm_sub_ps(_mm_set1_ps(orig.x), _mm_loadu_ps(block.v0[0]));
+    __m128 ty = _mm_sub_ps(_mm_set1_ps(orig.y), _mm_loadu_ps(block.v0[1]));
+    __m128 tz = _mm_sub_ps(_mm_set1_ps(orig.z), _mm_loadu_ps(block.v0[2]));
+    __m128 uu = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(tx, px), _mm_mul_ps(ty, py)), _mm_mul_ps(tz, pz)), invDet);
+    mask = _mm_and_ps(mask, _mm_and_ps(_mm_cmpge_ps(uu, zero), _mm_cmple_ps(uu, one)));
+    if (_mm_movemask_ps(mask) == 0) return false;
+    // qvec = tvec x e1
+    __m128 qx = _mm_sub_ps(_mm_mul_ps(ty, e1z), _mm_mul_ps(tz, e1y));
+    __m128 qy = _mm_sub_ps(_mm_mul_ps(tz, e1x), _mm_mul_ps(tx, e1z));
+    __m128 qz = _mm_sub_ps(_mm_mul_ps(tx, e1y), _mm_mul_ps(ty, e1x));
+    __m128 vv = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, qx), _mm_mul_ps(dy, qy)), _mm_mul_ps(dz, qz)), invDet);
+    mask = _mm_and_ps(mask, _mm_and_ps(_mm_cmpge_ps(vv, zero), _mm_cmple_ps(_mm_add_ps(uu, vv), one)));
+    __m128 tt = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(e2x, qx), _mm_mul_ps(e2y, qy)), _mm_mul_ps(e2z, qz)), invDet);
+    mask = _mm_and_ps(mask, _mm_cmpge_ps(tt, zero));
+    mask = _mm_and_ps(mask, _mm_cmplt_ps(tt, _mm_set1_ps(tnear)));
+    uint32_t hitMask = _mm_movemask_ps(mask);
+    if (hitMask == 0) return false;
+    float tK[4], uK[4], vK[4];
+    _mm_storeu_ps(tK, tt);
+    _mm_storeu_ps(uK, uu);
+    _mm_storeu_ps(vK, vv);
+    return closestLane(block, hitMask, tK, uK, vK, tnear, index, u, v);
+}
+#endif
+
+// closest triangle of the block hit closer than tnear
+inline bool intersectTriangleBlock(const TriangleBlock &block, const Vec3f &orig, const Vec3f &dir,
+                                   float &tnear, uint32_t &index, float &u, float &v)
+{
+#if defined(TRIANGLE_AVX2_KERNEL) || defined(TRIANGLE_SSE_KERNEL)
+    return intersectTriangleBlockSIMD(block, orig, dir, tnear, index, u, v);
+#else
+    return intersectTriangleBlockScalar(block, orig, dir, tnear, index, u, v);
+#endif
+}
+
+#endif
@@ -197,4 +197,20 @@ Matrix44f lookAt(const Vec3f& from, const Vec3f& to, const Vec3f& tmp = Vec3f(0,
 
     return camToWorld;
 }
+// hash to start hashBytes() with
+#define HASH_SEED 14695981039346656037ULL
+
+// [comment]
+// FNV-1a hash of size bytes, chained from a previous hash
+// [/comment]
+inline
+uint64_t hashBytes(uint64_t hash, const void *data, const size_t size)
+{
+    const unsigned char *bytes = (const unsigned char *)data;
+    for (size_t i = 0; i < size; i++) {
+        hash ^= bytes[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
 #endif
@@ -4,7 +4,21 @@
 #define MY_UINT64_T     uint64_t
 #define VIEW_WIDTH      640
 #define VIEW_HEIGHT     480
+// eyeRender splits the framebuffer into tiles of RENDER_TILE_SIZE*RENDER_TILE_SIZE pixels
+#define RENDER_TILE_SIZE 16
+// eyeRender traces the primary rays of RAY_PACKET_WIDTH*RAY_PACKET_WIDTH pixels as one packet
+#define RAY_PACKET_WIDTH 4
+// castWavefront() can sort the rays of a wave by a Morton code of their origins on this many
+// bits per axis, see RaySorter
+#define RAY_SORT_BITS 9
+// objectRender hands the surfaces to the render threads by chunks of OBJECT_RENDER_CHUNK surfaces
+#define OBJECT_RENDER_CHUNK 64
 #define RAY_CAST_DESITY 0.25
+// 1 keeps the baked angle colors as RGB9E5, 4 bytes instead of the 12 of three floats, build
+// with -DANGLE_COLOR_RGB9E5=1 to turn it on
+#ifndef ANGLE_COLOR_RGB9E5
+#define ANGLE_COLOR_RGB9E5 0
+#endif
 static const float kEpsilon = 1e-8; 
 
 /*
@@ -15,6 +29,13 @@ static const float kEpsilon = 1e-8;
 */
 
 #define OVERSTACK_PROTECT_DEPTH 9 
+// pending rays of the iterative casters: a hit takes its ray off the stack and puts back at
+// most 3, so 1024 holds the rays of any maxDepth (an uint8_t)
+#define CAST_STACK_SIZE 1024
+// trace() only walks the objects BVH when the scene has more objects than this
+#define BVH_MIN_OBJECTS 4
+// bounds in the BVH are grown by this so that hits on the border of a box are never missed
+#define BVH_BOUNDS_PAD  1e-3
 //#define INTENSITY_TOO_WEAK   0.01*0.01
 #define INTENSITY_TOO_WEAK   0.001*0.001
 const float kInfinity = std::numeric_limits<float>::max();
@@ -22,6 +43,14 @@ const float kInfinity = std::numeric_limits<float>::max();
 enum ObjectType { OBJECT_TYPE_NONE, OBJECT_TYPE_MESH, OBJECT_TYPE_SPHERE };
 enum MaterialType { DIFFUSE_AND_GLOSSY, REFLECTION_AND_REFRACTION, REFLECTION };
 enum RayStatus { VALID_RAY, NOHIT_RAY, INVISIBLE_RAY, OVERFLOW_RAY };
+// how directions are cut into bins, see AngleBins: the hemisphere of a shade point into
+// SurfaceAngle bins (polar or concentric), the sphere of normals of a Sphere into shade points
+// (polar or octahedral)
+enum AngleMapping { ANGLE_MAPPING_POLAR, ANGLE_MAPPING_CONCENTRIC, ANGLE_MAPPING_OCTAHEDRAL };
+// how the rays are cast: backwardCastRay() and forwordCastRay() recursing for each ray, the
+// same walking an explicit stack of pending rays, or in eyeRender castWavefront() casting the
+// rays of a whole tile wave by wave (the other passes recurse then)
+enum RayCaster { RAY_CASTER_RECURSIVE, RAY_CASTER_WAVEFRONT, RAY_CASTER_ITERATIVE };
 enum RayType { RAY_TYPE_ORIG, RAY_TYPE_REFLECTION, RAY_TYPE_REFRACTION, RAY_TYPE_DIFFUSE };
 char RayTypeString[10][20] = {"orig", "reflect", "refract", "diffuse"};
 #endif
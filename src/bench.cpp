@@ -0,0 +1,567 @@
+/*********************************************************
+    Benchmarks of the intersection kernels
+    Usage: c++ -O2 -std=c++11 -o bench bench.cpp
+    (add -march=native -ffp-contract=off for the AVX2 kernel)
+*********************************************************/
+
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <vector>
+#include <utility>
+#include <cstdint>
+#include <iostream>
+#include <fstream>
+#include <cmath>
+#include <limits>
+#include <cstring>
+#include <string>
+#include <chrono>
+#include <assert.h>
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#include "Values.h"
+#include "Vec2.h"
+#include "Vec3.h"
+#include "Light.h"
+#include "Matrix44.h"
+#include "Object.h"
+#include "Sphere.h"
+#include "MeshTriangle.h"
+#include "Utils.h"
+#include "Option.h"
+#include "SurfaceAngle.h"
+
+static double nowSeconds(void)
+{
+    return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// [comment]
+// Create a bumpy n*n grid in the xz plane of [-10,10]x[-10,10] around height y, it has
+// 2*n*n triangles.
+// [/comment]
+MeshTriangle *createGridMesh(uint32_t n, float y = 0)
+{
+    std::vector<Vec3f> verts((n + 1) * (n + 1));
+    std::vector<Vec2f> st((n + 1) * (n + 1));
+    std::vector<uint32_t> vertIndex(n * n * 6);
+    for (uint32_t j = 0; j <= n; j++) {
+        for (uint32_t i = 0; i <= n; i++) {
+            float x = -10 + 20.f * i / n, z = -10 + 20.f * j / n;
+            verts[j * (n + 1) + i] = Vec3f(x, y + sinf(x) * cosf(z), z);
+            st[j * (n + 1) + i] = Vec2f((float)i / n, (float)j / n);
+        }
+    }
+    for (uint32_t j = 0; j < n; j++) {
+        for (uint32_t i = 0; i < n; i++) {
+            uint32_t *idx = &vertIndex[(j * n + i) * 6];
+            uint32_t p = j * (n + 1) + i;
+            idx[0] = p; idx[1] = p + 1; idx[2] = p + n + 1;
+            idx[3] = p + 1; idx[4] = p + n + 2; idx[5] = p + n + 1;
+        }
+    }
+    return new MeshTriangle("grid", DIFFUSE_AND_GLOSSY, verts.data(), vertIndex.data(), n * n * 2, st.data());
+}
+
+// rays from above the grid towards random points of it
+void createRays(uint32_t num, std::vector<Vec3f> &origs, std::vector<Vec3f> &dirs)
+{
+    srand(1);
+    origs.resize(num);
+    dirs.resize(num);
+    for (uint32_t i = 0; i < num; i++) {
+        origs[i] = Vec3f(-15 + 30.f * rand() / RAND_MAX, 10, -15 + 30.f * rand() / RAND_MAX);
+        Vec3f target = Vec3f(-10 + 20.f * rand() / RAND_MAX, 0, -10 + 20.f * rand() / RAND_MAX);
+        dirs[i] = normalize(target - origs[i]);
+    }
+}
+
+void benchMeshBVH(void)
+{
+    std::printf("###closest hit of MeshTriangle: BVH vs brute force###\n");
+    std::printf("%-10s %-10s %-14s %-14s %-10s %-10s\n", "triangles", "rays", "BVH(rays/s)", "brute(rays/s)", "speedup", "mismatch");
+    uint32_t grids[] = {1, 4, 16, 64, 128, 256};
+    for (uint32_t g = 0; g < sizeof(grids)/sizeof(grids[0]); g++) {
+        std::unique_ptr<MeshTriangle> mesh(createGridMesh(grids[g]));
+        // keep the brute force loop around one second
+        uint32_t numRays = std::max(2000u, 40000000u / mesh->numTriangles);
+        std::vector<Vec3f> origs, dirs;
+        createRays(numRays, origs, dirs);
+        std::vector<float> tBVH(numRays, kInfinity), tBrute(numRays, kInfinity);
+
+        double start = nowSeconds();
+        for (uint32_t i = 0; i < numRays; i++) {
+            uint32_t index; float u, v;
+            mesh->closestTriangle(origs[i], dirs[i], tBVH[i], index, u, v);
+        }
+        double bvhTime = nowSeconds() - start;
+        start = nowSeconds();
+        for (uint32_t i = 0; i < numRays; i++) {
+            uint32_t index; float u, v;
+            mesh->closestTriangleBruteForce(origs[i], dirs[i], tBrute[i], index, u, v);
+        }
+        double bruteTime = nowSeconds() - start;
+
+        uint32_t mismatch = 0;
+        for (uint32_t i = 0; i < numRays; i++)
+            if (tBVH[i] != tBrute[i]) mismatch++;
+        std::printf("%-10u %-10u %-14.0f %-14.0f %-10.1f %-10u\n", mesh->numTriangles, numRays,
+                    numRays / bvhTime, numRays / bruteTime, bruteTime / bvhTime, mismatch);
+    }
+}
+
+// [comment]
+// Primary rays of a 640x480 camera above the grid, with a sphere on it: one ray at a time as
+// trace() does, and by packets of RAY_PACKET_WIDTH*RAY_PACKET_WIDTH pixels as eyeRender does.
+// [/comment]
+void benchRayPacket(void)
+{
+    uint32_t grids[] = {16, 128, 256};
+    const uint32_t scenes = sizeof(grids)/sizeof(grids[0]);
+    // built first, their constructors print
+    std::vector<std::unique_ptr<Object>> objects[scenes];
+    for (uint32_t g = 0; g < scenes; g++) {
+        objects[g].push_back(std::unique_ptr<Object>(createGridMesh(grids[g])));
+        objects[g].push_back(std::unique_ptr<Object>(new Sphere("sph", DIFFUSE_AND_GLOSSY, Vec3f(0, 3, 0), 3)));
+    }
+    std::printf("###primary rays: single rays vs packets of %ux%u###\n", RAY_PACKET_WIDTH, RAY_PACKET_WIDTH);
+    std::printf("%-10s %-14s %-14s %-10s %-10s\n", "triangles", "single(rays/s)", "packet(rays/s)", "speedup", "mismatch");
+    const uint32_t width = VIEW_WIDTH, height = VIEW_HEIGHT;
+    Vec3f orig(0, 12, 14);
+    float scale = tan(deg2rad(45 * 0.5)), aspect = width / (float)height;
+    // looking down the grid
+    auto primaryDir = [&](uint32_t i, uint32_t j) {
+        float x = (2 * (i + 0.5) / (float)width - 1) * aspect * scale;
+        float y = (1 - 2 * (j + 0.5) / (float)height) * scale;
+        return normalize(Vec3f(x, y - 0.8f, -1));
+    };
+    for (uint32_t g = 0; g < scenes; g++) {
+        const std::vector<std::unique_ptr<Object>> &scene = objects[g];
+        uint32_t numTriangles = static_cast<MeshTriangle *>(scene[0].get())->numTriangles;
+        std::vector<float> tSingle(width * height, kInfinity), tPacket(width * height, kInfinity);
+
+        double start = nowSeconds();
+        for (uint32_t j = 0; j < height; j++) {
+            for (uint32_t i = 0; i < width; i++) {
+                Vec3f dir = primaryDir(i, j);
+                for (uint32_t k = 0; k < scene.size(); k++) {
+                    uint32_t index = 0;
+                    Vec2f uv = 0;
+                    scene[k]->intersect(orig, dir, tSingle[j * width + i], index, uv);
+                }
+            }
+        }
+        double singleTime = nowSeconds() - start;
+        start = nowSeconds();
+        RayPacket packet;
+        for (uint32_t jBlock = 0; jBlock < height; jBlock += RAY_PACKET_WIDTH) {
+            for (uint32_t iBlock = 0; iBlock < width; iBlock += RAY_PACKET_WIDTH) {
+                packet.reset(orig);
+                for (uint32_t j = jBlock; j < jBlock + RAY_PACKET_WIDTH; j++)
+                    for (uint32_t i = iBlock; i < iBlock + RAY_PACKET_WIDTH; i++)
+                        packet.add(primaryDir(i, j));
+                packet.bound();
+                for (uint32_t k = 0; k < scene.size(); k++)
+                    scene[k]->intersectPacket(packet, k);
+                uint32_t r = 0;
+                for (uint32_t j = jBlock; j < jBlock + RAY_PACKET_WIDTH; j++)
+                    for (uint32_t i = iBlock; i < iBlock + RAY_PACKET_WIDTH; i++)
+                        tPacket[j * width + i] = packet.tNear[r++];
+            }
+        }
+        double packetTime = nowSeconds() - start;
+
+        uint32_t mismatch = 0;
+        for (uint32_t i = 0; i < width * height; i++)
+            if (tSingle[i] != tPacket[i]) mismatch++;
+        uint32_t numRays = width * height;
+        std::printf("%-10u %-14.0f %-14.0f %-10.2f %-10u\n", numTriangles, numRays / singleTime,
+                    numRays / packetTime, singleTime / packetTime, mismatch);
+    }
+}
+
+// [comment]
+// The rays objectRender casts at shade points of the floor of the scene, with its spheres and
+// its wall: one ray at a time through every object as trace() does, and as one batch per
+// shade point, the floor first and the other objects only where the rays reach them.
+// [/comment]
+void benchRayBatch(void)
+{
+    std::vector<std::unique_ptr<Object>> objects;
+    objects.push_back(std::unique_ptr<Object>(new Sphere("sph1", DIFFUSE_AND_GLOSSY, Vec3f(-4, 0, -8), 2)));
+    objects.push_back(std::unique_ptr<Object>(new Sphere("sph2", DIFFUSE_AND_GLOSSY, Vec3f(4, 0, -8), 2)));
+    Vec3f verts[4] = {{-10,-2,0}, {10,-2,0}, {10,-2,-14}, {-10,-2,-14}};
+    Vec3f verts2[4] = {{-10,-2,-14}, {10,-2,-14}, {10,18,-14}, {-10,18,-14}};
+    uint32_t vertIndex[6] = {0, 1, 3, 1, 2, 3};
+    Vec2f st[4] = {{0, 0}, {1, 0}, {1, 1}, {0, 1}};
+    objects.push_back(std::unique_ptr<Object>(new MeshTriangle("floor", DIFFUSE_AND_GLOSSY, verts, vertIndex, 2, st)));
+    objects.push_back(std::unique_ptr<Object>(new MeshTriangle("wall", DIFFUSE_AND_GLOSSY, verts2, vertIndex, 2, st)));
+    const uint32_t floor = 2;
+    std::vector<BBox> objectBounds;
+    for (uint32_t k = 0; k < objects.size(); k++) {
+        objectBounds.push_back(objects[k]->getBounds());
+        objectBounds.back().pad(BVH_BOUNDS_PAD);
+    }
+    // the angles of a shade point of the floor, REFLECTION material
+    uint32_t vAngleRes, hAngleRes;
+    Surface::angleRes(RAY_CAST_DESITY, ANGLE_MAPPING_POLAR, vAngleRes, hAngleRes);
+    AngleBins bins(90, vAngleRes, hAngleRes);
+    Surface surface;
+    surface.init(RAY_CAST_DESITY, ANGLE_MAPPING_POLAR, nullptr, &bins);
+    Vec3f normal(0, 1, 0);
+    surface.reset(0, normal);
+
+    uint32_t points = 2000;
+    srand(11);
+    std::vector<Vec3f> targets(points);
+    for (uint32_t p = 0; p < points; p++)
+        targets[p] = Vec3f(-10 + 20.f * rand() / RAND_MAX, -2, -14 + 14.f * rand() / RAND_MAX);
+    uint32_t numRays = points * vAngleRes * hAngleRes;
+    std::vector<float> tSingle(numRays, kInfinity), tBatch(numRays, kInfinity);
+
+    double start = nowSeconds();
+    for (uint32_t p = 0, n = 0; p < points; p++) {
+        for (uint32_t v = 0; v < vAngleRes; v++) {
+            for (uint32_t h = 0; h < hAngleRes; h++, n++) {
+                Vec3f dir;
+                surface.getSurfaceAngleByVH(v, h, &dir);
+                for (uint32_t k = 0; k < objects.size(); k++) {
+                    uint32_t index = 0;
+                    Vec2f uv = 0;
+                    objects[k]->intersect(targets[p] + dir, -dir, tSingle[n], index, uv);
+                }
+            }
+        }
+    }
+    double singleTime = nowSeconds() - start;
+    start = nowSeconds();
+    RayBatch batch;
+    for (uint32_t p = 0, n = 0; p < points; p++) {
+        batch.clear();
+        for (uint32_t v = 0; v < vAngleRes; v++) {
+            for (uint32_t h = 0; h < hAngleRes; h++) {
+                Vec3f dir;
+                surface.getSurfaceAngleByVH(v, h, &dir);
+                batch.add(targets[p] + dir, -dir);
+            }
+        }
+        objects[floor]->intersectBatch(batch, floor);
+        BBox reach = batch.segmentBounds(BVH_BOUNDS_PAD);
+        for (uint32_t k = 0; k < objects.size(); k++)
+            if (k != floor && reach.overlaps(objectBounds[k]))
+                objects[k]->intersectBatch(batch, k);
+        for (uint32_t r = 0; r < batch.size; r++)
+            tBatch[n++] = batch.tNear[r];
+    }
+    double batchTime = nowSeconds() - start;
+
+    uint32_t mismatch = 0;
+    for (uint32_t i = 0; i < numRays; i++)
+        if (tSingle[i] != tBatch[i]) mismatch++;
+    std::printf("###rays of the shade points of the floor: single rays vs batches###\n");
+    std::printf("%-10s %-14s %-14s %-10s %-10s\n", "rays", "single(rays/s)", "batch(rays/s)", "speedup", "mismatch");
+    std::printf("%-10u %-14.0f %-14.0f %-10.2f %-10u\n", numRays, numRays / singleTime, numRays / batchTime,
+                singleTime / batchTime, mismatch);
+}
+
+// [comment]
+// Hardware cache misses of the calling thread between start() and stop(), from
+// perf_event_open(). stop() gives -1 when the kernel has no such counter.
+// [/comment]
+struct CacheMisses {
+    void start(void)
+    {
+#ifdef __linux__
+        perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.config = PERF_COUNT_HW_CACHE_MISSES;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        fd = syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+        if (fd >= 0) ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+#endif
+    }
+    long long stop(void)
+    {
+        long long count = -1;
+#ifdef __linux__
+        if (fd < 0) return -1;
+        if (read(fd, &count, sizeof(count)) != sizeof(count)) count = -1;
+        close(fd);
+        fd = -1;
+#endif
+        return count;
+    }
+    int fd = -1;
+};
+
+// [comment]
+// Reflection rays of a 640x480 camera between a bumpy floor and a bumpy ceiling, the rays
+// castWavefront() traces after the primary rays. Each wave, the rays of a 16x16 tile or those
+// of the whole frame, is traced in pixel order, then in the order of RaySorter, sort included.
+// [/comment]
+void benchRaySort(void)
+{
+    uint32_t grids[] = {256, 1024};
+    const uint32_t scenes = sizeof(grids)/sizeof(grids[0]);
+    // built first, their constructors print
+    std::vector<std::unique_ptr<Object>> objects[scenes];
+    for (uint32_t g = 0; g < scenes; g++) {
+        objects[g].push_back(std::unique_ptr<Object>(createGridMesh(grids[g])));
+        objects[g].push_back(std::unique_ptr<Object>(createGridMesh(grids[g], 6)));
+    }
+    std::printf("###reflection rays: pixel order vs sorted by origin and direction###\n");
+    std::printf("%-10s %-10s %-10s %-14s %-14s %-10s %-16s %-16s %-10s\n", "triangles", "wave", "rays", "pixel(rays/s)",
+                "sorted(rays/s)", "speedup", "pixel(misses)", "sorted(misses)", "mismatch");
+    const uint32_t width = VIEW_WIDTH, height = VIEW_HEIGHT;
+    Vec3f orig(0, 3, 14);
+    float scale = tan(deg2rad(60 * 0.5)), aspect = width / (float)height;
+    auto primaryDir = [&](uint32_t i, uint32_t j) {
+        float x = (2 * (i + 0.5) / (float)width - 1) * aspect * scale;
+        float y = (1 - 2 * (j + 0.5) / (float)height) * scale;
+        return normalize(Vec3f(x, y - 0.2f, -1));
+    };
+    for (uint32_t g = 0; g < scenes; g++) {
+        const std::vector<std::unique_ptr<Object>> &scene = objects[g];
+        uint32_t numTriangles = 0;
+        for (uint32_t k = 0; k < scene.size(); k++)
+            numTriangles += static_cast<MeshTriangle *>(scene[k].get())->numTriangles;
+        // the reflection rays, tile by tile as eyeRender gives them
+        std::vector<Vec3f> origs, dirs;
+        std::vector<uint32_t> tiles;
+        for (uint32_t jTile = 0; jTile < height; jTile += RENDER_TILE_SIZE) {
+            for (uint32_t iTile = 0; iTile < width; iTile += RENDER_TILE_SIZE) {
+                tiles.push_back(origs.size());
+                for (uint32_t j = jTile; j < std::min(jTile + RENDER_TILE_SIZE, height); j++) {
+                    for (uint32_t i = iTile; i < std::min(iTile + RENDER_TILE_SIZE, width); i++) {
+                        Vec3f dir = primaryDir(i, j);
+                        float tNear = kInfinity;
+                        uint32_t hitObject = 0, hitIndex = 0;
+                        for (uint32_t k = 0; k < scene.size(); k++) {
+                            uint32_t index = 0;
+                            Vec2f uv = 0;
+                            if (scene[k]->intersect(orig, dir, tNear, index, uv)) {
+                                hitObject = k;
+                                hitIndex = index;
+                            }
+                        }
+                        if (tNear == kInfinity) continue;
+                        // normal of the triangle hit, the grids have no shade points
+                        const MeshTriangle *mesh = static_cast<const MeshTriangle *>(scene[hitObject].get());
+                        const Vec3f &v0 = mesh->vertices[mesh->vertexIndex[hitIndex * 3]];
+                        const Vec3f &v1 = mesh->vertices[mesh->vertexIndex[hitIndex * 3 + 1]];
+                        const Vec3f &v2 = mesh->vertices[mesh->vertexIndex[hitIndex * 3 + 2]];
+                        Vec3f N = normalize(crossProduct(v1 - v0, v2 - v0));
+                        Vec3f point = orig + dir * tNear;
+                        Vec3f reflectionDirection = reflect(dir, N);
+                        origs.push_back(dotProduct(reflectionDirection, N) < 0 ? point - N * 1e-3 : point + N * 1e-3);
+                        dirs.push_back(reflectionDirection);
+                    }
+                }
+            }
+        }
+        tiles.push_back(origs.size());
+        uint32_t numRays = origs.size();
+
+        for (uint32_t frame = 0; frame < 2; frame++) {
+            std::vector<uint32_t> waves = tiles;
+            if (frame) waves = {0, numRays};
+            double time[2];
+            long long misses[2];
+            std::vector<float> tNear[2];
+            for (uint32_t sorted = 0; sorted < 2; sorted++) {
+                tNear[sorted].assign(numRays, kInfinity);
+                RaySorter sorter;
+                CacheMisses counter;
+                counter.start();
+                double start = nowSeconds();
+                for (uint32_t w = 0; w + 1 < waves.size(); w++) {
+                    sorter.clear();
+                    for (uint32_t r = waves[w]; r < waves[w + 1]; r++)
+                        sorter.add(origs[r], dirs[r]);
+                    if (sorted)
+                        sorter.sort();
+                    for (uint32_t n = 0; n < sorter.size(); n++) {
+                        uint32_t r = waves[w] + sorter.at(n);
+                        for (uint32_t k = 0; k < scene.size(); k++) {
+                            uint32_t index = 0;
+                            Vec2f uv = 0;
+                            scene[k]->intersect(origs[r], dirs[r], tNear[sorted][r], index, uv);
+                        }
+                    }
+                }
+                time[sorted] = nowSeconds() - start;
+                misses[sorted] = counter.stop();
+            }
+            uint32_t mismatch = 0;
+            for (uint32_t r = 0; r < numRays; r++)
+                if (tNear[0][r] != tNear[1][r]) mismatch++;
+            char pixelMisses[32] = "-", sortedMisses[32] = "-";
+            if (misses[0] >= 0 && misses[1] >= 0) {
+                std::snprintf(pixelMisses, sizeof(pixelMisses), "%lld", misses[0]);
+                std::snprintf(sortedMisses, sizeof(sortedMisses), "%lld", misses[1]);
+            }
+            std::printf("%-10u %-10s %-10u %-14.0f %-14.0f %-10.2f %-16s %-16s %-10u\n", numTriangles,
+                        frame ? "frame" : "tile", numRays, numRays / time[0], numRays / time[1], time[0] / time[1],
+                        pixelMisses, sortedMisses, mismatch);
+        }
+    }
+}
+
+// resident memory of the process in MB
+static double residentMB(void)
+{
+    long pages = 0, resident = 0;
+    FILE *fp = fopen("/proc/self/statm", "r");
+    if (fp == nullptr) return 0;
+    if (fscanf(fp, "%ld %ld", &pages, &resident) != 2) resident = 0;
+    fclose(fp);
+    return resident * 4096.0 / (1024 * 1024);
+}
+
+// [comment]
+// Shade points and angles of the floor of the scene (REFLECTION material, so every shade
+// point has its angle grid): construction, then reading every angle of every shade point in
+// scan order and diffuseAmt of shade points in random order, with the angles cut by mapping.
+// [/comment]
+void benchSurfaceStorage(const AngleMapping mapping)
+{
+    std::printf("###shade points and angles of a REFLECTION mesh, %s angles###\n",
+                mapping == ANGLE_MAPPING_POLAR ? "polar" : "concentric");
+    Vec3f verts[4] = {{-10,-2,0}, {10,-2,0}, {10,-2,-14}, {-10,-2,-14}};
+    uint32_t vertIndex[6] = {0, 1, 3, 1, 2, 3};
+    Vec2f st[4] = {{0, 0}, {1, 0}, {1, 1}, {0, 1}};
+    double rss = residentMB();
+    double start = nowSeconds();
+    std::unique_ptr<MeshTriangle> mesh(new MeshTriangle("mesh1", REFLECTION, verts, vertIndex, 2, st));
+    mesh->setAngleMapping(mapping);
+    double buildTime = nowSeconds() - start;
+    rss = residentMB() - rss;
+
+    start = nowSeconds();
+    Vec3f sum = 0;
+    uint64_t angles = 0;
+    for (uint32_t v = 0; v < mesh->vRes; v++) {
+        for (uint32_t h = 0; h < mesh->hRes; h++) {
+            Surface *surface = mesh->getSurfaceByVH(v, h);
+            for (uint32_t vAngle = 0; vAngle < surface->vAngleRes; vAngle++)
+                for (uint32_t hAngle = 0; hAngle < surface->hAngleRes; hAngle++)
+                    sum += surface->getSurfaceAngleByVH(vAngle, hAngle)->getColor();
+            angles += surface->vAngleRes * surface->hAngleRes;
+        }
+    }
+    double scanTime = nowSeconds() - start;
+
+    uint32_t lookups = 20000000;
+    srand(7);
+    std::vector<uint32_t> order(1 << 16);
+    for (uint32_t i = 0; i < order.size(); i++)
+        order[i] = rand();
+    start = nowSeconds();
+    for (uint32_t i = 0; i < lookups; i++) {
+        uint32_t r = order[i & 0xffff] ^ i;
+        sum += mesh->getSurfaceByVH(r % mesh->vRes, (r >> 8) % mesh->hRes)->diffuseAmt;
+    }
+    double lookupTime = nowSeconds() - start;
+    std::printf("%-10s %-10s %-10s %-10s %-16s %-16s\n", "points", "angles", "build(s)", "RSS(MB)", "angle scan(ns)", "point lookup(ns)");
+    std::printf("%-10u %-10lu %-10.3f %-10.1f %-16.2f %-16.2f (%g)\n", mesh->vRes * mesh->hRes, angles, buildTime, rss,
+                scanTime * 1e9 / angles, lookupTime * 1e9 / lookups, sum.x);
+}
+
+// [comment]
+// Direction to angle bin of a shade point of ratio 1 (91x360 bins), with acos/atan2 and with
+// the boundary tables of AngleBins, over random unit directions.
+// [/comment]
+void benchAngleBins(void)
+{
+    std::printf("###direction to angle bin###\n");
+    AngleBins bins(90, 91, 360);
+    srand(3);
+    std::vector<Vec3f> dirs(1 << 16);
+    for (uint32_t i = 0; i < dirs.size(); i++)
+        dirs[i] = normalize(Vec3f(rand() - RAND_MAX / 2, rand() - RAND_MAX / 2, rand() - RAND_MAX / 2));
+    uint32_t lookups = 20000000, sum = 0, v, h;
+    double start = nowSeconds();
+    for (uint32_t i = 0; i < lookups; i++) {
+        bins.lookupExact(dirs[i & 0xffff], v, h);
+        sum += v + h;
+    }
+    double exactTime = nowSeconds() - start;
+    start = nowSeconds();
+    for (uint32_t i = 0; i < lookups; i++) {
+        bins.lookup(dirs[i & 0xffff], v, h);
+        sum += v + h;
+    }
+    double fastTime = nowSeconds() - start;
+    std::printf("%-16s %-16s\n", "acos/atan2(ns)", "tables(ns)");
+    std::printf("%-16.2f %-16.2f (%u)\n", exactTime * 1e9 / lookups, fastTime * 1e9 / lookups, sum);
+}
+
+// [comment]
+// Angle color of a view direction on a shade point of ratio 1: the bin of the direction in the
+// polar grid, or the spherical harmonics of orders 2 to SH_ORDER_MAX rebuilt for it.
+// [/comment]
+void benchAngleColors(void)
+{
+    std::printf("###angle color of a view direction###\n");
+    uint32_t vRes, hRes;
+    Surface::angleRes(1, ANGLE_MAPPING_POLAR, vRes, hRes);
+    AngleBins bins(90, vRes, hRes);
+    std::vector<SurfaceAngle> slab(vRes * hRes);
+    Vec3f coeffs[SH_COEFFS_MAX];
+    Surface surface;
+    surface.init(1, ANGLE_MAPPING_POLAR, slab.data(), &bins);
+    Vec3f normal(0, 1, 0);
+    surface.reset(0, normal);
+    srand(5);
+    for (uint32_t i = 0; i < slab.size(); i++)
+        slab[i].setColor(Vec3f(rand(), rand(), rand()) / (float)RAND_MAX);
+    for (uint32_t k = 0; k < SH_COEFFS_MAX; k++)
+        coeffs[k] = Vec3f(rand(), rand(), rand()) / (float)RAND_MAX;
+    surface.sh = coeffs;
+    std::vector<Vec3f> dirs(1 << 16);
+    for (uint32_t i = 0; i < dirs.size(); i++) {
+        dirs[i] = normalize(Vec3f(rand() - RAND_MAX / 2, rand() - RAND_MAX / 2, rand() - RAND_MAX / 2));
+        dirs[i].y = std::fabs(dirs[i].y);
+    }
+    uint32_t lookups = 20000000;
+    Vec3f sum = 0;
+    double start = nowSeconds();
+    for (uint32_t i = 0; i < lookups; i++)
+        sum += surface.getSurfaceAngleByDir(dirs[i & 0xffff])->getColor();
+    std::printf("%-10s %-10s %-10s\n", "colors", "bytes", "lookup(ns)");
+    std::printf("%-10s %-10lu %-10.2f\n", "grid", (unsigned long)(vRes * hRes * sizeof(SurfaceAngle)),
+                (nowSeconds() - start) * 1e9 / lookups);
+    for (uint32_t order = 2; order <= SH_ORDER_MAX; order++) {
+        surface.shOrder = order;
+        start = nowSeconds();
+        for (uint32_t i = 0; i < lookups; i++)
+            sum += surface.getColorBySH(dirs[i & 0xffff]);
+        char name[16];
+        std::snprintf(name, sizeof(name), "sh%u", order);
+        std::printf("%-10s %-10lu %-10.2f\n", name, (unsigned long)(shCoeffsNum(order) * sizeof(Vec3f)),
+                    (nowSeconds() - start) * 1e9 / lookups);
+    }
+    std::printf("(%g)\n", sum.x);
+}
+
+int main(int argc, char **argv)
+{
+    benchMeshBVH();
+    benchRayPacket();
+    benchRayBatch();
+    benchRaySort();
+    benchSurfaceStorage(ANGLE_MAPPING_POLAR);
+    benchSurfaceStorage(ANGLE_MAPPING_CONCENTRIC);
+    benchAngleBins();
+    benchAngleColors();
+    return 0;
+}
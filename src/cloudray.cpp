@@ -1,7 +1,8 @@
 /*********************************************************
     Leo, lili 
     Prototype to verify cloud ray tracing
-    Usage: c++ -O0 -g -std=c++11 -o cloudray.cpp cloudray 
+    Usage: c++ -O0 -g -std=c++11 -pthread -o cloudray cloudray.cpp
+           ./cloudray [--bake-cache <file>]
 *********************************************************/
 
 #include <cstdio>
@@ -31,8 +32,33 @@
 #include "Option.h"
 #include "SurfaceAngle.h"
 #include "RayStore.h"
+#include "BVH.h"
+#include "ThreadPool.h"
+#include "BakeCache.h"
+#include "LightBake.h"
+#include "BakeTracker.h"
 
 
+// top level BVH over the bounds of the objects, trace() uses it once it is built for the scene
+BVH objectsBVH;
+
+// [comment]
+// (Re)build the top level BVH. It needs to be done again each time an object moves.
+// Scenes with only a few objects keep the linear scan in trace().
+// [/comment]
+void buildObjectsBVH(const std::vector<std::unique_ptr<Object>> &objects)
+{
+    objectsBVH.clear();
+    if (objects.size() <= BVH_MIN_OBJECTS) return;
+    std::vector<BBox> objectBounds;
+    for (uint32_t k = 0; k < objects.size(); ++k) {
+        BBox bounds = objects[k]->getBounds();
+        bounds.pad(BVH_BOUNDS_PAD);
+        objectBounds.push_back(bounds);
+    }
+    objectsBVH.build(objectBounds);
+}
+
 // [comment]
 // Returns true if the ray intersects an object, false otherwise.
 //
@@ -44,13 +70,12 @@
 //
 // \param[out] tNear contains the distance to the cloesest intersected object.
 //
-// \param[out] index stores the index of the intersect triangle if the interesected object is a mesh.
-//
-// \param[out] uv stores the u and v barycentric coordinates of the intersected point
+// \param[out] hitPoint, mapIdx, *hitSurface and *hitAngle store the point hit, its shade point
+// and the angle of the shade point the ray comes from, resolved for the closest hit only.
 //
 // \param[out] *hitObject stores the pointer to the intersected object (used to retrieve material information, etc.)
 //
-// \param isShadowRay is it a shadow ray. We can return from the function sooner as soon as we have found a hit.
+// Shadow rays, which only need to know if anything is hit, use occluded() instead.
 // [/comment]
 bool trace(
     const Vec3f &orig, const Vec3f &dir,
@@ -58,26 +83,133 @@ bool trace(
     float &tNear, Vec3f &hitPoint, Vec2f &mapIdx, Surface **hitSurface, SurfaceAngle **hitAngle, Object **hitObject)
 {
     *hitObject = nullptr;
-    for (uint32_t k = 0; k < objects.size(); ++k) {
-        float tNearK = kInfinity;
-        Vec3f pointK = 0;
-        Vec2f mapK = 0;
-        Surface *surfaceK = nullptr;
-        SurfaceAngle *angleK = nullptr;
-        if (objects[k]->intersect(orig, dir, tNearK, pointK, mapK, &surfaceK, &angleK) && tNearK < tNear) {
+    uint32_t hitIndex = 0;
+    Vec2f hitUV = 0;
+    auto intersectObject = [&](uint32_t k, float &tNearest) -> bool {
+        float tNearK = tNearest;
+        uint32_t indexK = 0;
+        Vec2f uvK = 0;
+        if (objects[k]->intersect(orig, dir, tNearK, indexK, uvK) && tNearK < tNearest) {
             *hitObject = objects[k].get();
-            tNear = tNearK;
-            *hitSurface = surfaceK;
-            *hitAngle = angleK;
-            hitPoint = pointK;
-            mapIdx = mapK;
+            tNearest = tNearK;
+            hitIndex = indexK;
+            hitUV = uvK;
+            return true;
         }
+        return false;
+    };
+
+    if (!objectsBVH.empty() && objectsBVH.size() == objects.size())
+        objectsBVH.intersect(orig, dir, tNear, intersectObject);
+    else {
+        for (uint32_t k = 0; k < objects.size(); ++k)
+            intersectObject(k, tNear);
     }
     
     bool hitted = (*hitObject != nullptr);
+    // the shade point and the angle of the closest hit only
+    if (hitted)
+        (*hitObject)->resolveHit(orig, dir, tNear, hitIndex, hitUV, hitPoint, mapIdx, hitSurface, hitAngle);
     return hitted;
+}
+
+// closest hit of a ray, resolved like trace() gives it
+struct TraceHit {
+    bool hitted = false;
+    float tNear = kInfinity;
+    Vec3f point = 0;
+    Vec2f mapIdx = 0;
+    Surface *surface = nullptr;
+    SurfaceAngle *angle = nullptr;
+    Object *object = nullptr;
+};
+
+// [comment]
+// trace() for all the rays of a packet sharing their origin: the objects, and the top level
+// BVH when there is one, are walked once for the whole packet. packet.object of each ray is
+// the index of the object it hits, resolvePacketHit() resolves that hit.
+// [/comment]
+void tracePacket(RayPacket &packet, const std::vector<std::unique_ptr<Object>> &objects)
+{
+    if (!objectsBVH.empty() && objectsBVH.size() == objects.size())
+        objectsBVH.intersectPacket(packet, [&](uint32_t k) { objects[k]->intersectPacket(packet, k); });
+    else {
+        for (uint32_t k = 0; k < objects.size(); ++k)
+            objects[k]->intersectPacket(packet, k);
+    }
+}
 
-//    return (*hitObject != nullptr);
+// [comment]
+// trace() for a batch of rays, without resolving the hits: each object tests all the rays at
+// once, or each ray walks the top level BVH when there is one.
+// [/comment]
+void traceBatch(RayBatch &batch, const std::vector<std::unique_ptr<Object>> &objects)
+{
+    if (objectsBVH.empty() || objectsBVH.size() != objects.size()) {
+        for (uint32_t k = 0; k < objects.size(); ++k)
+            objects[k]->intersectBatch(batch, k);
+        return;
+    }
+    for (uint32_t r = 0; r < batch.size; r++) {
+        Vec3f orig = batch.origin(r), dir = batch.direction(r);
+        objectsBVH.intersect(orig, dir, batch.tNear[r], [&](uint32_t k, float &tNearest) -> bool {
+            float tNearK = tNearest;
+            uint32_t indexK = 0;
+            Vec2f uvK = 0;
+            if (!objects[k]->intersect(orig, dir, tNearK, indexK, uvK) || tNearK >= tNearest) return false;
+            tNearest = tNearK;
+            batch.object[r] = k;
+            batch.index[r] = indexK;
+            batch.uv[r] = uvK;
+            return true;
+        });
+    }
+}
+
+// [comment]
+// The same for a batch of rays cast at one object, like the rays of a shade point. Object
+// first is tested first; an other object is then only tested when its bounds meet the
+// segments from the origins of the rays to their hits.
+// [/comment]
+void traceBatch(RayBatch &batch, const std::vector<std::unique_ptr<Object>> &objects,
+                const std::vector<BBox> &objectBounds, const uint32_t first)
+{
+    objects[first]->intersectBatch(batch, first);
+    BBox reach = batch.segmentBounds(BVH_BOUNDS_PAD);
+    for (uint32_t k = 0; k < objects.size(); ++k) {
+        if (k == first || !reach.overlaps(objectBounds[k])) continue;
+        objects[k]->intersectBatch(batch, k);
+    }
+}
+
+// resolve the hit of ray r of a RayPacket or of a RayBatch
+template<typename Rays>
+void resolveRayHit(const Rays &rays, const uint32_t r,
+                   const std::vector<std::unique_ptr<Object>> &objects, TraceHit &hit)
+{
+    hit.hitted = (rays.object[r] != RAY_PACKET_NO_HIT);
+    if (!hit.hitted) return;
+    hit.tNear = rays.tNear[r];
+    hit.object = objects[rays.object[r]].get();
+    hit.object->resolveHit(rays.origin(r), rays.direction(r), hit.tNear, rays.index[r], rays.uv[r],
+                           hit.point, hit.mapIdx, &hit.surface, &hit.angle);
+}
+
+// [comment]
+// Shadow and visibility query: is anything hit closer than tMax along the ray. It returns at
+// the first hit found, sets tMax to it, and resolves no shade point.
+// [/comment]
+bool occluded(
+    const Vec3f &orig, const Vec3f &dir,
+    const std::vector<std::unique_ptr<Object>> &objects,
+    float &tMax)
+{
+    if (!objectsBVH.empty() && objectsBVH.size() == objects.size())
+        return objectsBVH.intersect(orig, dir, tMax,
+            [&](uint32_t k, float &tNearest) { return objects[k]->occluded(orig, dir, tNearest); }, true);
+    for (uint32_t k = 0; k < objects.size(); ++k)
+        if (objects[k]->occluded(orig, dir, tMax)) return true;
+    return false;
 }
 
 /* precast ray from light to object*/
@@ -94,15 +226,11 @@ Vec3f forwordCastRay(
     Vec3f targetPoint = 0,
     Vec2f targetMapIdx = 0)
 {
-    Ray * newRay = nullptr;
-    Ray * currRay = nullptr;
+    uint32_t parentRay = RAY_NODE_NONE;
 
     if (depth > OVERSTACK_PROTECT_DEPTH) {
         rayStore.overflowRays++;
-        if(rayStore.currRay != nullptr) {
-            rayStore.currRay->status = OVERFLOW_RAY;
-            rayStore.currRay->overflowCount++;
-        }
+        rayStore.markRay(OVERFLOW_RAY);
         return options.backgroundColor;
     }
 
@@ -116,7 +244,17 @@ Vec3f forwordCastRay(
     SurfaceAngle *hitAngle = nullptr;
     Vec3f hitPoint = 0;
     Vec2f mapIdx = 0;
-    bool hitted = trace(orig, dir, objects, tnear, hitPoint, mapIdx, &hitSurface, &hitAngle, &hitObject);
+    bool hitted = false;
+    if (targetObject != nullptr) {
+        // only what blocks the way to the target, orig + dir, matters: any hit up to t = 1
+        tnear = std::nextafter(1.f, kInfinity);
+        hitted = occluded(orig, dir, objects, tnear);
+        rayStore.pathSegment(orig, orig + dir * (hitted ? tnear : 1.f));
+    }
+    else {
+        hitted = trace(orig, dir, objects, tnear, hitPoint, mapIdx, &hitSurface, &hitAngle, &hitObject);
+        rayStore.pathRay(orig, dir, hitted, hitPoint);
+    }
     bool insideObject = false;
 /*
     if(hitted && depth >=1)
@@ -134,13 +272,10 @@ Vec3f forwordCastRay(
                         hitPoint.x, hitPoint.y, hitPoint.z, tnear);
         }
 */
-        if (hitted && tnear <=1) {
+        if (hitted) {
       //      std::printf("targetPoint(%f,%f,%f) is in shadow of tnear(%f)\n", dir.x, dir.y, dir.z, tnear);
             rayStore.nohitRays++;
-            if(rayStore.currRay != nullptr) {
-                rayStore.currRay->status = NOHIT_RAY;
-                rayStore.currRay->nohitCount++;
-            }
+            rayStore.markRay(NOHIT_RAY);
             return hitColor;
         }
         hitObject = targetObject;
@@ -151,10 +286,7 @@ Vec3f forwordCastRay(
     else {
         if (!hitted) {
             rayStore.nohitRays++;
-            if(rayStore.currRay != nullptr) {
-                rayStore.currRay->status = NOHIT_RAY;
-                rayStore.currRay->nohitCount++;
-            }
+            rayStore.markRay(NOHIT_RAY);
             return hitColor;
         }
     }
@@ -176,12 +308,7 @@ Vec3f forwordCastRay(
 */
 
 
-    if(rayStore.currRay != nullptr) {
-        rayStore.currRay->status = VALID_RAY;
-        rayStore.currRay->validCount++;
-        rayStore.currRay->hitObject = hitObject;
-        rayStore.currRay->hitPoint = hitPoint;
-    }
+    rayStore.markRay(VALID_RAY, hitObject, hitPoint);
 
     switch (hitObject->materialType) {
         case REFLECTION_AND_REFRACTION:
@@ -192,8 +319,7 @@ Vec3f forwordCastRay(
             float leftSqureValue = dotProduct(leftIntensity, leftIntensity);
             if (leftSqureValue < INTENSITY_TOO_WEAK) {
                 rayStore.weakRays ++;
-                if(rayStore.currRay != nullptr)
-                    rayStore.currRay->weakCount ++;
+                rayStore.countWeak();
                 break;
             }
             Vec3f reflectionDirection = normalize(reflect(dir, N));
@@ -214,14 +340,9 @@ Vec3f forwordCastRay(
             if(!insideObject) {
                 rayStore.reflectionRays++;
                 // tracker the ray
-                if(rayStore.currRay != nullptr) {
-                    newRay = rayStore.record(RAY_TYPE_REFLECTION, &rayStore.currRay->reflectionLink, 0, reflectionRayOrig, reflectionDirection, leftIntensity);
-                    newRay->inside = insideObject;
-                    currRay = rayStore.currRay;
-                    rayStore.currRay = newRay;
-                }
+                parentRay = rayStore.pushRay(RAY_TYPE_REFLECTION, reflectionRayOrig, reflectionDirection, insideObject, leftIntensity);
                 reflectionColor = forwordCastRay(rayStore, reflectionRayOrig, reflectionDirection, objects, leftIntensity, options, depth + 1);
-                rayStore.currRay = currRay;
+                rayStore.popRay(parentRay);
                 //Vec3f reflectionColor = forwordCastRay(rayStore, reflectionRayOrig, reflectionDirection, objects, intensity*kr, options, depth + 1);
             }
 
@@ -233,14 +354,9 @@ Vec3f forwordCastRay(
                 hitPoint + N * options.bias;
             rayStore.refractionRays++;
             // tracker the ray
-            if(rayStore.currRay != nullptr) {
-                newRay = rayStore.record(RAY_TYPE_REFRACTION, &rayStore.currRay->refractionLink, 0, refractionRayOrig, refractionDirection, leftIntensity);
-                newRay->inside = insideObject;
-                currRay = rayStore.currRay;
-                rayStore.currRay = newRay;
-            }
+            parentRay = rayStore.pushRay(RAY_TYPE_REFRACTION, refractionRayOrig, refractionDirection, insideObject, leftIntensity);
             Vec3f refractionColor = forwordCastRay(rayStore, refractionRayOrig, refractionDirection, objects, leftIntensity, options, depth + 1);
-            rayStore.currRay = currRay;
+            rayStore.popRay(parentRay);
             hitColor = reflectionColor * kr + refractionColor * (1 - kr);
             break;
         }
@@ -252,8 +368,7 @@ Vec3f forwordCastRay(
             float leftSqureValue = dotProduct(leftIntensity, leftIntensity);
             if (leftSqureValue < INTENSITY_TOO_WEAK) {
                 rayStore.weakRays ++;
-                if(rayStore.currRay != nullptr)
-                    rayStore.currRay->weakCount ++;
+                rayStore.countWeak();
                 break;
             }
             Vec3f reflectionDirection = reflect(dir, N);
@@ -263,15 +378,10 @@ Vec3f forwordCastRay(
                 hitPoint + N * options.bias;
             rayStore.reflectionRays++;
             // tracker the ray
-            if(rayStore.currRay != nullptr) {
-                newRay = rayStore.record(RAY_TYPE_REFLECTION, &rayStore.currRay->reflectionLink, 0, reflectionRayOrig, reflectionDirection, leftIntensity);
-                newRay->inside = insideObject;
-                currRay = rayStore.currRay;
-                rayStore.currRay = newRay;
-            }
+            parentRay = rayStore.pushRay(RAY_TYPE_REFLECTION, reflectionRayOrig, reflectionDirection, insideObject, leftIntensity);
            // hitColor = forwordCastRay(rayStore, reflectionRayOrig, reflectionDirection, objects, intensity*(1-kr), options, depth + 1) * kr;
             hitColor = forwordCastRay(rayStore, reflectionRayOrig, reflectionDirection, objects, leftIntensity, options, depth + 1) * kr;
-            rayStore.currRay = currRay;
+            rayStore.popRay(parentRay);
             break;
         }
         default:
@@ -285,16 +395,14 @@ Vec3f forwordCastRay(
             // Prevent memory waste before overflow
             if (depth+1 > OVERSTACK_PROTECT_DEPTH) {
                 rayStore.overflowRays += count;
-                if(rayStore.currRay != nullptr)
-                    rayStore.currRay->overflowCount += count;
+                rayStore.countOverflow(count);
             }
             //leftIntensity = intensity*(1.0-kr)*(1.0/(count+1));
             leftIntensity = intensity*hitObject->Kd*(1.0/(count+1));
             float leftSqureValue = dotProduct(leftIntensity, leftIntensity);
             if (leftSqureValue < INTENSITY_TOO_WEAK) {
                 rayStore.weakRays ++;
-                if(rayStore.currRay != nullptr)
-                    rayStore.currRay->weakCount ++;
+                rayStore.countWeak();
                 break;
             }
             else {
@@ -310,15 +418,10 @@ Vec3f forwordCastRay(
                     rayStore.diffuseRays++;
                     //std::printf("DEBUG--(%d, %d)-->Total rays(%d) = Origin rays(%d) + Reflection rays(%d) + Refraction rays(%d) + Diffuse rays(%d)\n", i, depth, rays.totalRays, rays.originRays, rays.reflectionRays, rays.refractionRays, rays.diffuseRays);
                     // tracker the ray
-                    if(rayStore.currRay != nullptr) {
-                        newRay = rayStore.record(RAY_TYPE_DIFFUSE, &rayStore.currRay->diffuseLink, 0, reflectionRayOrig, reflectionDirection, leftIntensity);
-                        newRay->inside = insideObject;
-                        currRay = rayStore.currRay;
-                        rayStore.currRay = newRay;
-                    }
+                    parentRay = rayStore.pushRay(RAY_TYPE_DIFFUSE, reflectionRayOrig, reflectionDirection, insideObject, leftIntensity);
                     
                     forwordCastRay(rayStore, reflectionRayOrig, reflectionDirection, objects, leftIntensity, options, depth + 1);
-                    rayStore.currRay = currRay;
+                    rayStore.popRay(parentRay);
                 }
             }
             
@@ -334,7 +437,9 @@ Vec3f forwordCastRay(
     if (intensity.x < 0 || intensity.y <0 || intensity.z < 0 || Kd <0)
         std::printf("ERROR: intensity=(%f,%f,%f), Kd=%f\n", intensity.x, intensity.y, intensity.z, Kd);
     /* pre-caculate diffuse amt */
-    hitSurface->diffuseAmt += intensity * LdotN * Kd;
+    Vec3f diffuseAmt = intensity * LdotN * Kd;
+    hitObject->addDiffuseAmt(hitSurface, diffuseAmt, rayStore.workerIdx);
+    rayStore.pathDeposit(hitObject, hitSurface, diffuseAmt);
     /* pre-caculate specular amt */
     /*
     Vec3f reflectionDirection = reflect(lightDir, N);
@@ -342,6 +447,85 @@ Vec3f forwordCastRay(
     */
     return hitColor;
 }
+
+// color of a hit read from the bake: the SH or the angle of the shade point, or its diffuseAmt
+Vec3f bakedColor(const Vec3f &dir, const Vec2f &mapIdx, const Surface *hitSurface, const SurfaceAngle *hitAngle,
+                 const Object *hitObject)
+{
+    if (hitSurface->sh != nullptr)
+        return hitSurface->getColorBySH(-dir);
+    if (hitAngle == nullptr)
+        return hitSurface->diffuseAmt * hitObject->evalDiffuseColor(mapIdx);
+    return hitAngle->getColor();
+}
+
+// [comment]
+// Phong shading of a hit on a DIFFUSE_AND_GLOSSY object: globalAmt is the light gathered at the
+// hit so far, the lights add their diffuse part (unless withLightRender, where diffuseAmt of
+// the shade point replaces it) and their specular part. With pDeltaAmt the diffuse part of the
+// lights goes there instead.
+// [/comment]
+Vec3f shadePhong(
+    RayStore &rayStore,
+    const Vec3f &dir, const Vec3f &hitPoint, const Vec3f &N, const Vec2f &mapIdx,
+    const Surface *hitSurface, const Object *hitObject, const Vec3f &shadowPointOrig,
+    const std::vector<std::unique_ptr<Object>> &objects,
+    const std::vector<std::unique_ptr<Light>> &lights,
+    const bool withLightRender,
+    Vec3f globalAmt,
+    Vec3f *pDeltaAmt)
+{
+    Vec3f localAmt = 0, specularColor = 0;
+    // [comment]
+    // Loop over all lights in the scene and sum their contribution up
+    // We also apply the lambert cosine law here though we haven't explained yet what this means.
+    // [/comment]
+    Vec3f tmpAmt = 0;
+    for (uint32_t i = 0; i < lights.size(); ++i) {
+        Vec3f lightDir = lights[i]->position - hitPoint;
+        // square of the distance between hitPoint and the light
+        float lightDistance2 = dotProduct(lightDir, lightDir);
+        lightDir = normalize(lightDir);
+        if (!withLightRender) {
+            float LdotN = std::max(0.f, dotProduct(lightDir, N));
+            // is the point in shadow: is any object closer to the point than the light itself?
+            float tNearShadow = sqrtf(lightDistance2);
+            bool inShadow = occluded(shadowPointOrig, lightDir, objects, tNearShadow);
+            rayStore.pathSegment(shadowPointOrig, inShadow ? shadowPointOrig + lightDir * tNearShadow : lights[i]->position);
+
+/*
+            if (inShadow)
+                std::printf("inShadow: point(%f)\n", tNearShadow);
+*/
+            tmpAmt = (1 - inShadow) * lights[i]->intensity * LdotN * hitObject->Kd;
+            if (pDeltaAmt != nullptr)
+                *pDeltaAmt += tmpAmt;
+            else
+                localAmt += tmpAmt;
+                
+        }
+        Vec3f reflectionDirection = reflect(-lightDir, N);
+        specularColor += powf(std::max(0.f, -dotProduct(reflectionDirection, dir)), hitObject->specularExponent) * lights[i]->intensity;
+    }
+    if (withLightRender) {
+        globalAmt = hitSurface->diffuseAmt;
+        localAmt = 0;
+    }
+
+    if (tmpAmt == 0) rayStore.invisibleRays++;
+    else rayStore.validRays++;
+
+    Vec3f hitColor = (globalAmt + localAmt) * hitObject->evalDiffuseColor(mapIdx) + specularColor * hitObject->Ks;
+
+/*
+    if(rayStore.currPixel.x < 240.)
+        std::printf("o(%f,%f), object(%s), point(%f,%f,%f), mapidx(%f,%f)\n", 
+                    rayStore.currPixel.x, rayStore.currPixel.y, hitObject->name.c_str(),
+                    hitPoint.x, hitPoint.y, hitPoint.z, mapIdx.x, mapIdx.y);
+*/
+    return hitColor;
+}
+
 // [comment]
 // Implementation of the Whitted-syle light transport algorithm (E [S*] (D|G) L)
 //
@@ -367,21 +551,18 @@ Vec3f backwardCastRay(
     uint32_t depth,
     bool withLightRender = false,
     bool withObjectRender = false,
-    Vec3f *pDeltaAmt = nullptr)
+    Vec3f *pDeltaAmt = nullptr,
+    const TraceHit *primaryHit = nullptr)
 {
 /*
     uint32_t  xPos = (uint32_t)rayStore.currPixel.x;
     uint32_t  yPos = (uint32_t)rayStore.currPixel.y;
 */
-    Ray * newRay = nullptr;
-    Ray * currRay = nullptr;
+    uint32_t parentRay = RAY_NODE_NONE;
 
     if (depth > options.maxDepth) {
         rayStore.overflowRays++;
-        if(rayStore.currRay != nullptr) {
-            rayStore.currRay->status = OVERFLOW_RAY;
-            rayStore.currRay->overflowCount++;
-        }
+        rayStore.markRay(OVERFLOW_RAY);
         return options.backgroundColor;
     }
 
@@ -394,30 +575,31 @@ Vec3f backwardCastRay(
     SurfaceAngle *hitAngle = nullptr;
     Vec3f hitPoint = 0;
     Vec2f mapIdx = 0;
-    Vec3f globalAmt = 0, localAmt = 0, specularColor = 0;
+    Vec3f globalAmt = 0;
     bool  insideObject = false;
-    if (trace(orig, dir, objects, tnear, hitPoint, mapIdx, &hitSurface, &hitAngle, &hitObject)) {
+    bool hitted = false;
+    if (primaryHit != nullptr) {
+        // a primary ray already traced with its packet
+        hitted = primaryHit->hitted;
+        tnear = primaryHit->tNear;
+        hitPoint = primaryHit->point;
+        mapIdx = primaryHit->mapIdx;
+        hitSurface = primaryHit->surface;
+        hitAngle = primaryHit->angle;
+        hitObject = primaryHit->object;
+    }
+    else
+        hitted = trace(orig, dir, objects, tnear, hitPoint, mapIdx, &hitSurface, &hitAngle, &hitObject);
+    rayStore.pathRay(orig, dir, hitted, hitPoint);
+    if (hitted) {
         Vec3f N = hitSurface->N; // normal
 //        std::printf("%*s%d hit[%s]:\n", depth+1, "#", depth+1, hitObject->name.c_str());
 //        Vec3f testColor = hitObject->evalDiffuseColor(mapIdx);
 //        std::printf("#hitPoint(%f, %f, %f), color(%f, %f, %f) \n", hitPoint.x, hitPoint.y, hitPoint.z, testColor.x, testColor.y, testColor.z);
-        if(rayStore.currRay != nullptr) {
-            rayStore.currRay->status = VALID_RAY;
-            rayStore.currRay->validCount++;
-            rayStore.currRay->hitObject = hitObject;
-            rayStore.currRay->hitPoint = hitPoint;
-        }
+        rayStore.markRay(VALID_RAY, hitObject, hitPoint);
 
-        if (withObjectRender) {
-            if (hitAngle == nullptr) {
-                globalAmt = hitSurface->diffuseAmt;
-                localAmt = 0;
-                hitColor = (globalAmt + localAmt) * hitObject->evalDiffuseColor(mapIdx) + specularColor * hitObject->Ks;
-            }
-            else
-                hitColor = hitAngle->angleColor;
-            return hitColor;
-        }
+        if (withObjectRender)
+            return bakedColor(dir, mapIdx, hitSurface, hitAngle, hitObject);
 
             
 /*
@@ -440,14 +622,9 @@ Vec3f backwardCastRay(
                 if(!insideObject) {
                     rayStore.reflectionRays++;
                     // tracker the ray
-                    if(rayStore.currRay != nullptr) {
-                        newRay = rayStore.record(RAY_TYPE_REFLECTION, &rayStore.currRay->reflectionLink, 0, reflectionRayOrig, reflectionDirection);
-                        newRay->inside = insideObject;
-                        currRay = rayStore.currRay;
-                        rayStore.currRay = newRay;
-                    }
+                    parentRay = rayStore.pushRay(RAY_TYPE_REFLECTION, reflectionRayOrig, reflectionDirection, insideObject);
                     reflectionColor = backwardCastRay(rayStore, reflectionRayOrig, reflectionDirection, objects, lights, options, depth + 1, withLightRender);
-                    rayStore.currRay = currRay;
+                    rayStore.popRay(parentRay);
                 }
 
                 Vec3f refractionDirection = normalize(refract(dir, N, hitObject->ior));
@@ -458,14 +635,9 @@ Vec3f backwardCastRay(
 
                 rayStore.refractionRays++;
                 // tracker the ray
-                if(rayStore.currRay != nullptr) {
-                    newRay = rayStore.record(RAY_TYPE_REFRACTION, &rayStore.currRay->refractionLink, 0, refractionRayOrig, refractionDirection);
-                    newRay->inside = insideObject;
-                    currRay = rayStore.currRay;
-                    rayStore.currRay = newRay;
-                }
+                parentRay = rayStore.pushRay(RAY_TYPE_REFRACTION, refractionRayOrig, refractionDirection, insideObject);
                 Vec3f refractionColor = backwardCastRay(rayStore, refractionRayOrig, refractionDirection, objects, lights, options, depth + 1, withLightRender);
-                rayStore.currRay = currRay;
+                rayStore.popRay(parentRay);
                 if (withLightRender)
                     diffuseColor = hitSurface->diffuseAmt * hitObject->evalDiffuseColor(mapIdx);
                 hitColor = reflectionColor * kr + refractionColor * (1 - kr) + diffuseColor;
@@ -485,17 +657,12 @@ Vec3f backwardCastRay(
                     hitPoint + N * options.bias;
                 rayStore.reflectionRays++;
                 // tracker the ray
-                if(rayStore.currRay != nullptr) {
-                    newRay = rayStore.record(RAY_TYPE_REFLECTION, &rayStore.currRay->reflectionLink, 0, reflectionRayOrig, reflectionDirection);
-                    newRay->inside = insideObject;
-                    currRay = rayStore.currRay;
-                    rayStore.currRay = newRay;
-                }
+                parentRay = rayStore.pushRay(RAY_TYPE_REFLECTION, reflectionRayOrig, reflectionDirection, insideObject);
                 reflectionColor = backwardCastRay(rayStore, reflectionRayOrig, reflectionDirection, objects, lights, options, depth + 1, withLightRender) * kr;
                 if (withLightRender)
                     diffuseColor = hitSurface->diffuseAmt * hitObject->evalDiffuseColor(mapIdx);
                 hitColor = reflectionColor + diffuseColor;
-                rayStore.currRay = currRay;
+                rayStore.popRay(parentRay);
                 break;
             }
             default:
@@ -520,8 +687,7 @@ Vec3f backwardCastRay(
                     // Prevent memory waste before overflow
                     if (depth+1 > options.maxDepth) {
                         rayStore.overflowRays += count;
-                        if(rayStore.currRay != nullptr)
-                            rayStore.currRay->overflowCount += count;
+                        rayStore.countOverflow(count);
                     }
                     else {
                         //for (uint32_t i=1; i<=count; i++) {
@@ -534,164 +700,806 @@ Vec3f backwardCastRay(
                             rayStore.diffuseRays++;
                             //std::printf("DEBUG--(%d, %d)-->Total rays(%d) = Origin rays(%d) + Reflection rays(%d) + Refraction rays(%d) + Diffuse rays(%d)\n", i, depth, rays.totalRays, rays.originRays, rays.reflectionRays, rays.refractionRays, rays.diffuseRays);
                             // tracker the ray
-                            if(rayStore.currRay != nullptr) {
-                                newRay = rayStore.record(RAY_TYPE_DIFFUSE, &rayStore.currRay->diffuseLink, 0, reflectionRayOrig, reflectionDirection);
-                                newRay->inside = insideObject;
-                                currRay = rayStore.currRay;
-                                rayStore.currRay = newRay;
-                            }
+                            parentRay = rayStore.pushRay(RAY_TYPE_DIFFUSE, reflectionRayOrig, reflectionDirection, insideObject);
                             Vec3f deltaAmt = 0;
                             backwardCastRay(rayStore, reflectionRayOrig, reflectionDirection, objects, lights, options, depth + 1, false, false, &deltaAmt);
-                            rayStore.currRay = currRay;
+                            rayStore.popRay(parentRay);
                             globalAmt += deltaAmt * powf(weight, depth+1);
                         }
                     }
                 }
 
-                // [comment]
-                // Loop over all lights in the scene and sum their contribution up
-                // We also apply the lambert cosine law here though we haven't explained yet what this means.
-                // [/comment]
-                Vec3f tmpAmt = 0;
-                for (uint32_t i = 0; i < lights.size(); ++i) {
-                    Vec3f lightDir = lights[i]->position - hitPoint;
-                    // square of the distance between hitPoint and the light
-                    float lightDistance2 = dotProduct(lightDir, lightDir);
-                    lightDir = normalize(lightDir);
-                    if (!withLightRender) {
-                        float LdotN = std::max(0.f, dotProduct(lightDir, N));
-                        Object *shadowHitObject = nullptr;
-                        Surface *shadowHitSurface = nullptr;
-                        SurfaceAngle *shadowHitAngle = nullptr;
-                        Vec3f shadowHitPoint = 0;
-                        Vec2f shadowMapIdx = 0;
-                        float tNearShadow = kInfinity;
-                        // is the point in shadow, and is the nearest occluding object closer to the object than the light itself?
-                        bool inShadow = trace(shadowPointOrig, lightDir, objects, tNearShadow, shadowHitPoint, shadowMapIdx, 
-                              &shadowHitSurface, &shadowHitAngle, &shadowHitObject) && tNearShadow * tNearShadow < lightDistance2;
+                hitColor = shadePhong(rayStore, dir, hitPoint, N, mapIdx, hitSurface, hitObject, shadowPointOrig,
+                                      objects, lights, withLightRender, globalAmt, pDeltaAmt);
+                break;
+            }
+        }
+    }
+    else {
+        rayStore.nohitRays++;
+        //std::printf("%*s%d nohit\n", depth+1, "#", depth+1);
+        rayStore.markRay(NOHIT_RAY);
+    }
 
-/*
-                        if (inShadow)
-                            std::printf("inShadow: obj(%s), point(%f)\n", shadowHitObject->name.c_str(), tNearShadow);
-*/
-                        tmpAmt = (1 - inShadow) * lights[i]->intensity * LdotN * hitObject->Kd;
-                        if (pDeltaAmt != nullptr)
-                            *pDeltaAmt += tmpAmt;
-                        else
-                            localAmt += tmpAmt;
-                            
-                    }
-                    Vec3f reflectionDirection = reflect(-lightDir, N);
-                    specularColor += powf(std::max(0.f, -dotProduct(reflectionDirection, dir)), hitObject->specularExponent) * lights[i]->intensity;
+    return hitColor;
+}
+
+// [comment]
+// A ray waiting on the stack of the iterative casters. It is recorded under parent by
+// pushRay() only when it comes off the stack, and the rays a hit casts are put on the stack
+// in reverse, so the rays are traced, counted and recorded in the order of the recursion.
+// [/comment]
+struct PendingRay {
+    Vec3f orig, dir;
+    // what the color of the ray is multiplied by for backwardCastRayIterative(), the light it
+    // carries for forwordCastRayIterative()
+    Vec3f weight;
+    uint32_t depth;
+    // the recorded ray casting it, and the type and side it is recorded with
+    uint32_t parent;
+    RayType type;
+    bool inside;
+    // not a ray when set: weight is the diffuseAmt of depositSurface, deposited once the rays
+    // cast from the hit are done, as forwordCastRay() deposits it
+    Object *depositObject;
+    Surface *depositSurface;
+};
+
+// fixed stack of the pending rays, one per thread so that it is never allocated again
+struct PendingRays {
+    bool push(const PendingRay &ray)
+    {
+        if (size == CAST_STACK_SIZE) return false;
+        rays[size++] = ray;
+        return true;
+    }
+    PendingRay rays[CAST_STACK_SIZE];
+    uint32_t size = 0;
+};
+thread_local PendingRays pendingRays;
+
+// [comment]
+// forwordCastRay() without recursion. A hit puts on the stack its deposit, then the rays it
+// casts with the intensity left to them, so the shade points get their diffuseAmt in the order
+// of forwordCastRay() and the bake is the same.
+// [/comment]
+void forwordCastRayIterative(
+    RayStore &rayStore,
+    const Vec3f &orig, const Vec3f &dir,
+    const std::vector<std::unique_ptr<Object>> &objects,
+    const Vec3f intensity,
+    const Options &options,
+    uint32_t depth,
+    // index of object which is direct casted
+    Object *targetObject=nullptr,
+    Surface *targetSurface=nullptr,
+    Vec3f targetPoint = 0)
+{
+    PendingRays &stack = pendingRays;
+    uint32_t bottom = stack.size;
+    uint32_t rootRay = rayStore.currRay;
+    auto pend = [&](const PendingRay &ray) {
+        if (stack.push(ray)) return;
+        if (ray.depositObject != nullptr) {
+            ray.depositObject->addDiffuseAmt(ray.depositSurface, ray.weight, rayStore.workerIdx);
+            rayStore.pathDeposit(ray.depositObject, ray.depositSurface, ray.weight);
+            return;
+        }
+        rayStore.overflowRays++;
+        rayStore.countOverflow(1);
+    };
+    pend({orig, dir, intensity, depth, rootRay, RAY_TYPE_ORIG, false, nullptr, nullptr});
+    for (bool root = true; stack.size > bottom; root = false) {
+        PendingRay ray = stack.rays[--stack.size];
+        if (ray.depositObject != nullptr) {
+            ray.depositObject->addDiffuseAmt(ray.depositSurface, ray.weight, rayStore.workerIdx);
+            rayStore.pathDeposit(ray.depositObject, ray.depositSurface, ray.weight);
+            continue;
+        }
+        rayStore.currRay = ray.parent;
+        if (!root)
+            rayStore.pushRay(ray.type, ray.orig, ray.dir, ray.inside, ray.weight);
+
+        if (ray.depth > OVERSTACK_PROTECT_DEPTH) {
+            rayStore.overflowRays++;
+            rayStore.markRay(OVERFLOW_RAY);
+            continue;
+        }
+        rayStore.totalRays++;
+
+        float tnear = kInfinity;
+        Object *hitObject = nullptr;
+        Surface *hitSurface = nullptr;
+        SurfaceAngle *hitAngle = nullptr;
+        Vec3f hitPoint = 0;
+        Vec2f mapIdx = 0;
+        bool hitted = false;
+        if (root && targetObject != nullptr) {
+            // only what blocks the way to the target, orig + dir, matters: any hit up to t = 1
+            tnear = std::nextafter(1.f, kInfinity);
+            hitted = occluded(ray.orig, ray.dir, objects, tnear);
+            rayStore.pathSegment(ray.orig, ray.orig + ray.dir * (hitted ? tnear : 1.f));
+            hitObject = targetObject;
+            hitSurface = targetSurface;
+            hitPoint = targetPoint;
+            tnear = 1.0;
+            // in the shadow of what was hit
+            hitted = !hitted;
+        }
+        else {
+            hitted = trace(ray.orig, ray.dir, objects, tnear, hitPoint, mapIdx, &hitSurface, &hitAngle, &hitObject);
+            rayStore.pathRay(ray.orig, ray.dir, hitted, hitPoint);
+        }
+        if (!hitted) {
+            rayStore.nohitRays++;
+            rayStore.markRay(NOHIT_RAY);
+            continue;
+        }
+        if (hitSurface == nullptr) {
+            std::printf("BUG: ####targetSurface should not be NULL here\n");
+            continue;
+        }
+        Vec3f N = hitSurface->N; // normal
+        rayStore.markRay(VALID_RAY, hitObject, hitPoint);
+
+        /* pre-caculate diffuse amt */
+        float Kd = hitObject->Kd;
+        Vec3f lightDir = normalize(hitPoint - ray.orig);
+        float LdotN = std::max(0.f, dotProduct(-lightDir, N));
+        if (ray.weight.x < 0 || ray.weight.y <0 || ray.weight.z < 0 || Kd <0)
+            std::printf("ERROR: intensity=(%f,%f,%f), Kd=%f\n", ray.weight.x, ray.weight.y, ray.weight.z, Kd);
+        pend({0, 0, ray.weight * LdotN * Kd, 0, 0, RAY_TYPE_ORIG, false, hitObject, hitSurface});
+
+        uint32_t parent = rayStore.currRay;
+        switch (hitObject->materialType) {
+            case REFLECTION_AND_REFRACTION:
+            {
+                float kr;
+                fresnel(ray.dir, N, hitObject->ior, kr);
+                Vec3f leftIntensity = ray.weight*kr;
+                if (dotProduct(leftIntensity, leftIntensity) < INTENSITY_TOO_WEAK) {
+                    rayStore.weakRays ++;
+                    rayStore.countWeak();
+                    break;
                 }
-                if (withLightRender) {
-                    globalAmt = hitSurface->diffuseAmt;
-                    localAmt = 0;
+                Vec3f reflectionDirection = normalize(reflect(ray.dir, N));
+                bool reflectionInside = (dotProduct(reflectionDirection, N) < 0);
+                Vec3f reflectionRayOrig = reflectionInside ?
+                    hitPoint - N * options.bias :
+                    hitPoint + N * options.bias;
+                Vec3f refractionDirection = normalize(refract(ray.dir, N, hitObject->ior));
+                bool refractionInside = (dotProduct(refractionDirection, N) < 0);
+                Vec3f refractionRayOrig = refractionInside ?
+                    hitPoint - N * options.bias :
+                    hitPoint + N * options.bias;
+                rayStore.refractionRays++;
+                pend({refractionRayOrig, refractionDirection, ray.weight*(1-kr), ray.depth + 1, parent,
+                      RAY_TYPE_REFRACTION, refractionInside, nullptr, nullptr});
+                /* don't trace reflection ray inside object */
+                if (!reflectionInside) {
+                    rayStore.reflectionRays++;
+                    pend({reflectionRayOrig, reflectionDirection, leftIntensity, ray.depth + 1, parent,
+                          RAY_TYPE_REFLECTION, reflectionInside, nullptr, nullptr});
                 }
+                break;
+            }
+            case REFLECTION:
+            {
+                float kr = 0.9;
+                Vec3f leftIntensity = ray.weight*kr;
+                if (dotProduct(leftIntensity, leftIntensity) < INTENSITY_TOO_WEAK) {
+                    rayStore.weakRays ++;
+                    rayStore.countWeak();
+                    break;
+                }
+                Vec3f reflectionDirection = reflect(ray.dir, N);
+                bool insideObject = (dotProduct(reflectionDirection, N) < 0);
+                Vec3f reflectionRayOrig = insideObject ?
+                    hitPoint - N * options.bias :
+                    hitPoint + N * options.bias;
+                rayStore.reflectionRays++;
+                pend({reflectionRayOrig, reflectionDirection, leftIntensity, ray.depth + 1, parent,
+                      RAY_TYPE_REFLECTION, insideObject, nullptr, nullptr});
+                break;
+            }
+            default:
+                // no diffuse rays, as forwordCastRay()
+                break;
+        }
+    }
+    rayStore.currRay = rootRay;
+}
 
-                if (tmpAmt == 0) rayStore.invisibleRays++;
-                else rayStore.validRays++;
-
-                hitColor = (globalAmt + localAmt) * hitObject->evalDiffuseColor(mapIdx) + specularColor * hitObject->Ks;
+// [comment]
+// backwardCastRay() without recursion. A pending ray carries the product of the kr along its
+// path, and the color of the ray is the sum of the colors of the hits times their weight.
+// These sums are not made in the order of backwardCastRay(), so behind reflective and
+// refractive objects the colors may differ from its colors by float rounding.
+// [/comment]
+Vec3f backwardCastRayIterative(
+    RayStore &rayStore,
+    const Vec3f &orig, const Vec3f &dir,
+    const std::vector<std::unique_ptr<Object>> &objects,
+    const std::vector<std::unique_ptr<Light>> &lights,
+    const Options &options,
+    uint32_t depth,
+    bool withLightRender = false,
+    bool withObjectRender = false,
+    Vec3f *pDeltaAmt = nullptr,
+    const TraceHit *primaryHit = nullptr)
+{
+    PendingRays &stack = pendingRays;
+    uint32_t bottom = stack.size;
+    uint32_t rootRay = rayStore.currRay;
+    Vec3f hitColor = 0;
+    auto pend = [&](const PendingRay &ray) {
+        if (stack.push(ray)) return;
+        rayStore.overflowRays++;
+        rayStore.countOverflow(1);
+        hitColor += options.backgroundColor * ray.weight;
+    };
+    pend({orig, dir, Vec3f(1), depth, rootRay, RAY_TYPE_ORIG, false, nullptr, nullptr});
+    for (bool root = true; stack.size > bottom; root = false) {
+        PendingRay ray = stack.rays[--stack.size];
+        rayStore.currRay = ray.parent;
+        if (!root)
+            rayStore.pushRay(ray.type, ray.orig, ray.dir, ray.inside);
+
+        if (ray.depth > options.maxDepth) {
+            rayStore.overflowRays++;
+            rayStore.markRay(OVERFLOW_RAY);
+            hitColor += options.backgroundColor * ray.weight;
+            continue;
+        }
+        rayStore.totalRays++;
+
+        TraceHit hit;
+        if (root && primaryHit != nullptr)
+            hit = *primaryHit;
+        else
+            hit.hitted = trace(ray.orig, ray.dir, objects, hit.tNear, hit.point, hit.mapIdx, &hit.surface,
+                               &hit.angle, &hit.object);
+        rayStore.pathRay(ray.orig, ray.dir, hit.hitted, hit.point);
+        if (!hit.hitted) {
+            rayStore.nohitRays++;
+            rayStore.markRay(NOHIT_RAY);
+            hitColor += options.backgroundColor * ray.weight;
+            continue;
+        }
+        rayStore.markRay(VALID_RAY, hit.object, hit.point);
+        if (root && withObjectRender) {
+            hitColor += bakedColor(ray.dir, hit.mapIdx, hit.surface, hit.angle, hit.object) * ray.weight;
+            continue;
+        }
 
-/*
-                if(rayStore.currPixel.x < 240.)
-                    std::printf("o(%f,%f), object(%s), point(%f,%f,%f), mapidx(%f,%f)\n", 
-                                rayStore.currPixel.x, rayStore.currPixel.y, hitObject->name.c_str(),
-                                hitPoint.x, hitPoint.y, hitPoint.z, mapIdx.x, mapIdx.y);
-*/
-                            
+        Vec3f N = hit.surface->N; // normal
+        uint32_t parent = rayStore.currRay;
+        switch (hit.object->materialType) {
+            case REFLECTION_AND_REFRACTION:
+            {
+                Vec3f reflectionDirection = normalize(reflect(ray.dir, N));
+                bool reflectionInside = (dotProduct(reflectionDirection, N) < 0);
+                Vec3f reflectionRayOrig = reflectionInside ?
+                    hit.point - N * options.bias :
+                    hit.point + N * options.bias;
+                float kr;
+                fresnel(ray.dir, N, hit.object->ior, kr);
+                Vec3f refractionDirection = normalize(refract(ray.dir, N, hit.object->ior));
+                bool refractionInside = (dotProduct(refractionDirection, N) < 0);
+                Vec3f refractionRayOrig = refractionInside ?
+                    hit.point - N * options.bias :
+                    hit.point + N * options.bias;
+                rayStore.refractionRays++;
+                pend({refractionRayOrig, refractionDirection, ray.weight * (1 - kr), ray.depth + 1, parent,
+                      RAY_TYPE_REFRACTION, refractionInside, nullptr, nullptr});
+                /* don't trace reflection ray inside object */
+                if (!reflectionInside) {
+                    rayStore.reflectionRays++;
+                    pend({reflectionRayOrig, reflectionDirection, ray.weight * kr, ray.depth + 1, parent,
+                          RAY_TYPE_REFLECTION, reflectionInside, nullptr, nullptr});
+                }
+                if (withLightRender)
+                    hitColor += hit.surface->diffuseAmt * hit.object->evalDiffuseColor(hit.mapIdx) * ray.weight;
+                break;
+            }
+            case REFLECTION:
+            {
+                float kr = 0.5;
+                Vec3f reflectionDirection = reflect(ray.dir, N);
+                bool insideObject = (dotProduct(reflectionDirection, N) < 0);
+                Vec3f reflectionRayOrig = insideObject ?
+                    hit.point - N * options.bias :
+                    hit.point + N * options.bias;
+                rayStore.reflectionRays++;
+                pend({reflectionRayOrig, reflectionDirection, ray.weight * kr, ray.depth + 1, parent,
+                      RAY_TYPE_REFLECTION, insideObject, nullptr, nullptr});
+                if (withLightRender)
+                    hitColor += hit.surface->diffuseAmt * hit.object->evalDiffuseColor(hit.mapIdx) * ray.weight;
+                break;
+            }
+            default:
+            {
+                Vec3f shadowPointOrig = (dotProduct(ray.dir, N) < 0) ?
+                    hit.point + N * options.bias :
+                    hit.point - N * options.bias;
+                // only the ray cast gathers into pDeltaAmt, as in backwardCastRay()
+                hitColor += shadePhong(rayStore, ray.dir, hit.point, N, hit.mapIdx, hit.surface, hit.object,
+                                       shadowPointOrig, objects, lights, withLightRender, 0,
+                                       root ? pDeltaAmt : nullptr) * ray.weight;
                 break;
             }
         }
     }
-    else {
-        rayStore.nohitRays++;
-        //std::printf("%*s%d nohit\n", depth+1, "#", depth+1);
-        if(rayStore.currRay != nullptr) {
-            rayStore.currRay->status = NOHIT_RAY;
-            rayStore.currRay->nohitCount++;
+    rayStore.currRay = rootRay;
+    return hitColor;
+}
+
+// the ray trees are not thread safe, passes recording rays run on one thread
+uint32_t renderThreads(
+    const RayStore &rayStore,
+    const Options &options,
+    const std::vector<std::unique_ptr<Object>> &objects)
+{
+    if (rayStore.eyeTraceLinks != nullptr) return 1;
+    for (uint32_t i=0; i<objects.size(); i++)
+        if (objects[i]->recorderEnabled) return 1;
+    return options.threads;
+}
+
+// node of a ray in the tree of colors of castWavefront(), WAVE_NODE_NONE for a ray not cast
+#define WAVE_NODE_NONE 0xffffffff
+
+enum WaveNodeType { WAVE_NODE_DONE, WAVE_NODE_REFLECTION, WAVE_NODE_REFLECTION_AND_REFRACTION };
+
+// [comment]
+// How the color of a ray is made of the colors of the rays it casts, as backwardCastRay()
+// returns it. REFLECTION: reflection * kr + diffuse. REFLECTION_AND_REFRACTION:
+// reflection * kr + refraction * (1 - kr) + diffuse, without reflection inside the object.
+// color is the diffuse term until the node is done.
+// [/comment]
+struct WaveNode {
+    WaveNodeType type;
+    Vec3f color;
+    float kr;
+    uint32_t reflection, refraction;
+};
+
+// a ray of a wave, its color goes to node
+struct WaveRay {
+    Vec3f orig, dir;
+    uint32_t depth;
+    uint32_t node;
+    // the ray in the RayTree of the recorder
+    uint32_t recordRay;
+};
+
+// [comment]
+// Rays and colors of castWavefront(), kept by a worker from one tile to the next.
+// addPrimary() gives the primary rays with their hits, their colors are nodes[0..] once cast.
+// [/comment]
+struct Wavefront {
+    void clear(void)
+    {
+        nodes.clear();
+        rays.clear();
+        hits.clear();
+    }
+    void addPrimary(const Vec3f &orig, const Vec3f &dir, const TraceHit &hit, const uint32_t recordRay)
+    {
+        WaveRay ray = {orig, dir, 0, addNode(), recordRay};
+        rays.push_back(ray);
+        hits.push_back(hit);
+    }
+    uint32_t addNode(void)
+    {
+        WaveNode node = {WAVE_NODE_DONE, Vec3f(0), 0, WAVE_NODE_NONE, WAVE_NODE_NONE};
+        nodes.push_back(node);
+        return nodes.size() - 1;
+    }
+
+    std::vector<WaveNode> nodes;
+    // the wave being cast, its hits and the wave it casts
+    std::vector<WaveRay> rays;
+    std::vector<TraceHit> hits;
+    std::vector<WaveRay> next;
+    // the rays of the wave to trace, and the order in which they are traced
+    std::vector<uint32_t> traced;
+    RaySorter sorter;
+    RayBatch batch;
+    // rays of the wave with a hit, by material of the object hit
+    std::vector<uint32_t> queues[3];
+};
+
+// [comment]
+// backwardCastRay() for many rays at once, wave by wave instead of recursing for each ray.
+// Each wave is traced as one batch (with options.sortRays in the order of RaySorter, the hits
+// going back to their rays), the hits are sorted into one queue per material, and
+// each queue is shaded in turn, which casts the reflection and refraction rays of the next
+// wave. The color of a ray which depends on the colors of its children is left in its node,
+// and once the last wave is shaded the nodes are combined back from the leaves, with the
+// operations of backwardCastRay() in the same order, so the colors are the same bit for bit.
+// Rays are counted and recorded as backwardCastRay() does, tree is the RayTree of the
+// recorded primary rays.
+// [/comment]
+void castWavefront(
+    RayStore &rayStore,
+    Wavefront &wave,
+    RayTree *tree,
+    const std::vector<std::unique_ptr<Object>> &objects,
+    const std::vector<std::unique_ptr<Light>> &lights,
+    const Options &options,
+    bool withLightRender = false,
+    bool withObjectRender = false)
+{
+    rayStore.currTree = tree;
+    // the first wave comes with its hits
+    bool traced = true;
+    while (!wave.rays.empty()) {
+        std::vector<WaveRay> &rays = wave.rays;
+        std::vector<TraceHit> &hits = wave.hits;
+        if (!traced) {
+            // the rays to trace, in the order of the wave or sorted
+            wave.sorter.clear();
+            for (uint32_t r = 0; r < rays.size(); r++)
+                if (rays[r].depth <= options.maxDepth)
+                    wave.sorter.add(rays[r].orig, rays[r].dir);
+            if (options.sortRays)
+                wave.sorter.sort();
+            wave.traced.clear();
+            for (uint32_t r = 0; r < rays.size(); r++)
+                if (rays[r].depth <= options.maxDepth)
+                    wave.traced.push_back(r);
+            wave.batch.clear();
+            for (uint32_t b = 0; b < wave.sorter.size(); b++) {
+                const WaveRay &ray = rays[wave.traced[wave.sorter.at(b)]];
+                wave.batch.add(ray.orig, ray.dir);
+            }
+            traceBatch(wave.batch, objects);
+            // the hits back to their rays
+            hits.assign(rays.size(), TraceHit());
+            for (uint32_t b = 0; b < wave.sorter.size(); b++)
+                resolveRayHit(wave.batch, b, objects, hits[wave.traced[wave.sorter.at(b)]]);
         }
+        traced = false;
+
+        // sort the hits by material, the other rays are done
+        for (uint32_t m = 0; m < 3; m++)
+            wave.queues[m].clear();
+        for (uint32_t r = 0; r < rays.size(); r++) {
+            const WaveRay &ray = rays[r];
+            WaveNode &node = wave.nodes[ray.node];
+            rayStore.currRay = ray.recordRay;
+            if (ray.depth > options.maxDepth) {
+                rayStore.overflowRays++;
+                rayStore.markRay(OVERFLOW_RAY);
+                node.color = options.backgroundColor;
+                continue;
+            }
+            rayStore.totalRays++;
+            if (!hits[r].hitted) {
+                rayStore.nohitRays++;
+                rayStore.markRay(NOHIT_RAY);
+                node.color = options.backgroundColor;
+                continue;
+            }
+            rayStore.markRay(VALID_RAY, hits[r].object, hits[r].point);
+            // only the primary rays are given withObjectRender
+            if (withObjectRender && ray.depth == 0) {
+                node.color = bakedColor(ray.dir, hits[r].mapIdx, hits[r].surface, hits[r].angle, hits[r].object);
+                continue;
+            }
+            wave.queues[hits[r].object->materialType].push_back(r);
+        }
+
+        // cast a child ray of ray, returns its node
+        wave.next.clear();
+        auto castChild = [&](const WaveRay &ray, const RayType type, const Vec3f &orig, const Vec3f &dir,
+                             const bool inside) -> uint32_t {
+            rayStore.currRay = ray.recordRay;
+            rayStore.pushRay(type, orig, dir, inside);
+            WaveRay child = {orig, dir, ray.depth + 1, wave.addNode(), rayStore.currRay};
+            wave.next.push_back(child);
+            return child.node;
+        };
+
+        for (uint32_t q = 0; q < wave.queues[REFLECTION_AND_REFRACTION].size(); q++) {
+            uint32_t r = wave.queues[REFLECTION_AND_REFRACTION][q];
+            const WaveRay &ray = rays[r];
+            const TraceHit &hit = hits[r];
+            Vec3f N = hit.surface->N;
+            Vec3f reflectionDirection = normalize(reflect(ray.dir, N));
+            bool insideObject = (dotProduct(reflectionDirection, N) < 0);
+            Vec3f reflectionRayOrig = insideObject ?
+                hit.point - N * options.bias :
+                hit.point + N * options.bias;
+            float kr;
+            fresnel(ray.dir, N, hit.object->ior, kr);
+            uint32_t reflection = WAVE_NODE_NONE;
+            /* don't trace reflection ray inside object */
+            if (!insideObject) {
+                rayStore.reflectionRays++;
+                reflection = castChild(ray, RAY_TYPE_REFLECTION, reflectionRayOrig, reflectionDirection, insideObject);
+            }
+            Vec3f refractionDirection = normalize(refract(ray.dir, N, hit.object->ior));
+            insideObject = (dotProduct(refractionDirection, N) < 0);
+            Vec3f refractionRayOrig = insideObject ?
+                hit.point - N * options.bias :
+                hit.point + N * options.bias;
+            rayStore.refractionRays++;
+            uint32_t refraction = castChild(ray, RAY_TYPE_REFRACTION, refractionRayOrig, refractionDirection, insideObject);
+            // castChild() may have moved the nodes
+            WaveNode &node = wave.nodes[ray.node];
+            node.type = WAVE_NODE_REFLECTION_AND_REFRACTION;
+            node.kr = kr;
+            node.reflection = reflection;
+            node.refraction = refraction;
+            node.color = 0;
+            if (withLightRender)
+                node.color = hit.surface->diffuseAmt * hit.object->evalDiffuseColor(hit.mapIdx);
+        }
+
+        for (uint32_t q = 0; q < wave.queues[REFLECTION].size(); q++) {
+            uint32_t r = wave.queues[REFLECTION][q];
+            const WaveRay &ray = rays[r];
+            const TraceHit &hit = hits[r];
+            Vec3f N = hit.surface->N;
+            Vec3f reflectionDirection = reflect(ray.dir, N);
+            bool insideObject = (dotProduct(reflectionDirection, N) < 0);
+            Vec3f reflectionRayOrig = insideObject ?
+                hit.point - N * options.bias :
+                hit.point + N * options.bias;
+            rayStore.reflectionRays++;
+            uint32_t reflection = castChild(ray, RAY_TYPE_REFLECTION, reflectionRayOrig, reflectionDirection, insideObject);
+            WaveNode &node = wave.nodes[ray.node];
+            node.type = WAVE_NODE_REFLECTION;
+            node.kr = 0.5;
+            node.reflection = reflection;
+            node.color = 0;
+            if (withLightRender)
+                node.color = hit.surface->diffuseAmt * hit.object->evalDiffuseColor(hit.mapIdx);
+        }
+
+        for (uint32_t q = 0; q < wave.queues[DIFFUSE_AND_GLOSSY].size(); q++) {
+            uint32_t r = wave.queues[DIFFUSE_AND_GLOSSY][q];
+            const WaveRay &ray = rays[r];
+            const TraceHit &hit = hits[r];
+            Vec3f N = hit.surface->N;
+            Vec3f shadowPointOrig = (dotProduct(ray.dir, N) < 0) ?
+                hit.point + N * options.bias :
+                hit.point - N * options.bias;
+            wave.nodes[ray.node].color = shadePhong(rayStore, ray.dir, hit.point, N, hit.mapIdx, hit.surface, hit.object,
+                                                    shadowPointOrig, objects, lights, withLightRender, 0, nullptr);
+        }
+        std::swap(wave.rays, wave.next);
     }
 
-    return hitColor;
+    // the children of a node are always after it
+    for (uint32_t n = wave.nodes.size(); n-- > 0;) {
+        WaveNode &node = wave.nodes[n];
+        if (node.type == WAVE_NODE_REFLECTION)
+            node.color = wave.nodes[node.reflection].color * node.kr + node.color;
+        else if (node.type == WAVE_NODE_REFLECTION_AND_REFRACTION) {
+            Vec3f reflectionColor = 0;
+            if (node.reflection != WAVE_NODE_NONE)
+                reflectionColor = wave.nodes[node.reflection].color;
+            node.color = reflectionColor * node.kr + wave.nodes[node.refraction].color * (1 - node.kr) + node.color;
+        }
+        node.type = WAVE_NODE_DONE;
+    }
+    rayStore.endRecord();
 }
 
-/* objectRender the object from Surface angles */
+// [comment]
+// objectRender the object from Surface angles.
+// The surfaces of every object are cut into chunks of OBJECT_RENDER_CHUNK surfaces which the
+// thread pool balances between the workers. Each SurfaceAngle is written by the only task
+// owning its surface, so no reduction is needed.
+// With a tracker, only the surfaces it flagged are cast and their paths are recorded into it.
+// [/comment]
 void objectRender(
     RayStore &rayStore,
     const Options &options,
     const std::vector<std::unique_ptr<Object>> &objects,
-    const std::vector<std::unique_ptr<Light>> &lights)
+    const std::vector<std::unique_ptr<Light>> &lights,
+    BakeTracker *tracker = nullptr)
 {
-    Object *targetObject;
-    Surface *targetSurface;
-    Vec3f   target;
-    Vec3f   dir = 0;
-    Vec3f   orig = 0;
-    uint32_t v=0, h=0;
-
 //#define DEBUG_ANGLE_ZERO
 
+    ThreadPool pool(renderThreads(rayStore, options, objects));
+    std::vector<std::unique_ptr<RayStore>> workerStores;
+    for (uint32_t w = 0; w < pool.size(); w++)
+        workerStores.push_back(std::unique_ptr<RayStore>(new RayStore(rayStore, w)));
+    // (object, first surface) of each task
+    std::vector<std::pair<uint32_t, uint32_t>> chunks;
     for (uint32_t i=0; i<objects.size(); i++) {
-        targetObject = objects[i].get();
-
-        if (targetObject->surfaceAngleRatio <= 0.) continue;
-        for (v=0; v<objects[i]->vRes; v++) {
-            for (h=0; h<objects[i]->hRes; h++) {
-                targetSurface = targetObject->getSurfaceByVH(v, h, &target);
-                if (targetSurface == nullptr) continue;
+        if (objects[i]->surfaceAngleRatio <= 0.) continue;
+        for (uint32_t s=0; s<objects[i]->vRes*objects[i]->hRes; s+=OBJECT_RENDER_CHUNK)
+            chunks.push_back(std::make_pair(i, s));
+    }
 
-                // LEO: debug a angle color
-#ifdef DEBUG_ANGLE_ZERO
-                Vec3f debugDir = normalize(Vec3f(0) - target);
-                uint32_t vAngleTarget = 0, hAngleTarget = 0;
-                targetSurface->getSurfaceAngleByDir(debugDir, &vAngleTarget, &hAngleTarget);
-#endif
+    // bounds of the objects for traceBatch()
+    std::vector<BBox> objectBounds;
+    for (uint32_t k = 0; k < objects.size(); ++k) {
+        objectBounds.push_back(objects[k]->getBounds());
+        objectBounds.back().pad(BVH_BOUNDS_PAD);
+    }
 
-                for (uint32_t vAngle=0; vAngle<targetSurface->vAngleRes; vAngle++) {
-                    for (uint32_t hAngle=0; hAngle<targetSurface->hAngleRes; hAngle++) {
-                        SurfaceAngle *angle = targetSurface->getSurfaceAngleByVH(vAngle, hAngle, &dir);
-                        if (angle == nullptr) continue;
+    // [comment]
+    // The rays of a shade point are traced as one batch, all of them starting around the shade
+    // point and going through it, then each one goes on from its own hit.
+    // [/comment]
+    pool.run(chunks.size(), [&](uint32_t task, uint32_t worker) {
+        RayStore &store = *workerStores[worker];
+        uint32_t i = chunks[task].first;
+        Object *targetObject = objects[i].get();
+        uint32_t end = std::min(chunks[task].second + OBJECT_RENDER_CHUNK, targetObject->vRes*targetObject->hRes);
+        Vec3f   target;
+        Vec3f   dir = 0;
+        RayBatch batch;
+        // (vAngle, hAngle) of each ray of the batch
+        std::vector<std::pair<uint32_t, uint32_t>> batchAngles;
+        for (uint32_t s=chunks[task].second; s<end; s++) {
+            uint32_t v = s / targetObject->hRes, h = s % targetObject->hRes;
+            Surface *targetSurface = targetObject->getSurfaceByVH(v, h, &target);
+            if (targetSurface == nullptr) continue;
+            if (tracker != nullptr) {
+                if (!tracker->angleDirty[i][s]) continue;
+                store.currPath = &tracker->anglePaths[i][s];
+                store.pathFar = tracker->pathFar;
+            }
 
+            // LEO: debug a angle color
 #ifdef DEBUG_ANGLE_ZERO
-                        if (abs(vAngleTarget-vAngle)<5*ceil(targetSurface->angleRatio) && \
-                            abs(hAngleTarget-hAngle)<5*ceil(targetSurface->angleRatio)) {
+            Vec3f debugDir = normalize(Vec3f(0) - target);
+            uint32_t vAngleTarget = 0, hAngleTarget = 0;
+            targetSurface->getSurfaceAngleByDir(debugDir, &vAngleTarget, &hAngleTarget);
 #endif
-                            // dir of forwordCastRay is relative to orig
-                            rayStore.originRays++;
-                            // tracker the ray
-                            if (objects[i]->recorderEnabled)
-                                rayStore.record(RAY_TYPE_ORIG, objects[i]->traceLinks, v*objects[i]->hRes + h, orig, dir);
-                            orig = target + dir;
-                            rayStore.currPixel = {(float)v, (float)h, 0};
-                            angle->angleColor = backwardCastRay(rayStore, orig, -dir, objects, lights, options, 0);
-                            //std::cout << angle->angleColor <<  std::endl;
+
+            batch.clear();
+            batchAngles.clear();
+            for (uint32_t vAngle=0; vAngle<targetSurface->vAngleRes; vAngle++) {
+                for (uint32_t hAngle=0; hAngle<targetSurface->hAngleRes; hAngle++) {
+                    SurfaceAngle *angle = targetSurface->getSurfaceAngleByVH(vAngle, hAngle, &dir);
+                    if (angle == nullptr && targetSurface->sh == nullptr) continue;
 #ifdef DEBUG_ANGLE_ZERO
-                        }
+                    if (abs(vAngleTarget-vAngle)>=5*ceil(targetSurface->angleRatio) || \
+                        abs(hAngleTarget-hAngle)>=5*ceil(targetSurface->angleRatio))
+                        continue;
 #endif
-                    }
+                    // dir of forwordCastRay is relative to orig
+                    batch.add(target + dir, -dir);
+                    batchAngles.push_back(std::make_pair(vAngle, hAngle));
                 }
-                // rayStore.dumpObjectTraceLink(objects, i, 0, 0);
-                // dump object shadepoint as ppm file
-                //objects[i]->dumpSurfaceAngles(options);
             }
+            if (batch.size > 0)
+                traceBatch(batch, objects, objectBounds, i);
+
+            // the angles kept as SH are projected as they are cast
+            Vec3f shCoeffs[SH_COEFFS_MAX];
+            for (uint32_t k = 0; k < targetObject->shStride; k++)
+                shCoeffs[k] = 0;
+            for (uint32_t r = 0; r < batch.size; r++) {
+                uint32_t vAngle = batchAngles[r].first, hAngle = batchAngles[r].second;
+                SurfaceAngle *angle = targetSurface->getSurfaceAngleByVH(vAngle, hAngle);
+                Vec3f orig = batch.origin(r);
+                store.originRays++;
+                // tracker the ray
+                if (targetObject->recorderEnabled)
+                    store.record(RAY_TYPE_ORIG, targetObject->traceLinks, v*targetObject->hRes + h, orig, batch.direction(r));
+                store.currPixel = {(float)v, (float)h, 0};
+                TraceHit hit;
+                resolveRayHit(batch, r, objects, hit);
+                Vec3f color = (options.caster == RAY_CASTER_ITERATIVE) ?
+                    backwardCastRayIterative(store, orig, batch.direction(r), objects, lights, options, 0,
+                                             false, false, nullptr, &hit) :
+                    backwardCastRay(store, orig, batch.direction(r), objects, lights, options, 0,
+                                    false, false, nullptr, &hit);
+                if (angle != nullptr)
+                    angle->setColor(color);
+                else
+                    targetSurface->projectSH(shCoeffs, vAngle, hAngle, color);
+                store.endRecord();
+                //std::cout << angle->getColor() <<  std::endl;
+            }
+            for (uint32_t k = 0; k < targetObject->shStride; k++)
+                targetSurface->sh[k] = shCoeffs[k];
+            store.currPath = nullptr;
         }
+    });
+
+    for (uint32_t w = 0; w < workerStores.size(); w++)
+        rayStore.merge(*workerStores[w]);
+    for (uint32_t i=0; i<objects.size(); i++) {
+        if (objects[i]->surfaceAngleRatio <= 0.) continue;
+        // rayStore.dumpObjectTraceLink(objects, i, 0, 0);
+        // dump object shadepoint as ppm file
         objects[i]->dumpSurfaceAngles(options);
     }
-
-    // LEO: debug a angle color
-    //ofs.close();
 }
 
 
-/* lightRender the object from light */
+// [comment]
+// Parallel version of lightRender. The tasks are the rows of surfaces of every object, each
+// task casts the rays of all the lights to its own surfaces. The forward rays can land on any
+// surface, so workers accumulate diffuseAmt into their own buffers which are reduced at the end.
+// The result is the serial one up to the order of the float additions.
+// [/comment]
+void lightRenderParallel(
+    RayStore &rayStore,
+    ThreadPool &pool,
+    const Options &options,
+    const std::vector<std::unique_ptr<Object>> &objects,
+    const std::vector<std::unique_ptr<Light>> &lights,
+    BakeTracker *tracker = nullptr)
+{
+    std::vector<std::unique_ptr<RayStore>> workerStores;
+    for (uint32_t w = 0; w < pool.size(); w++)
+        workerStores.push_back(std::unique_ptr<RayStore>(new RayStore(rayStore, w)));
+    // (object, row) of each task
+    std::vector<std::pair<uint32_t, uint32_t>> rows;
+    for (uint32_t i=0; i<objects.size(); i++) {
+        objects[i]->prepareWorkerDiffuseAmt(pool.size());
+        for (uint32_t v=0; v<objects[i]->vRes; v++)
+            rows.push_back(std::make_pair(i, v));
+    }
+
+    pool.run(rows.size(), [&](uint32_t task, uint32_t worker) {
+        RayStore &store = *workerStores[worker];
+        uint32_t i = rows[task].first, v = rows[task].second;
+        Object *targetObject = objects[i].get();
+        Vec3f   targetPoint;
+        for (uint32_t l=0; l<lights.size(); l++) {
+            Vec3f orig = lights[l]->position;
+            for (uint32_t h=0; h<targetObject->hRes; h++) {
+                Surface *targetSurface = targetObject->getSurfaceByVH(v, h, &targetPoint);
+                if (targetSurface == nullptr)
+                    continue;
+                if (tracker != nullptr) {
+                    if (!tracker->lightDirty[i][v*targetObject->hRes + h]) continue;
+                    store.currPath = &tracker->lightPaths[i][v*targetObject->hRes + h];
+                    store.pathFar = tracker->pathFar;
+                }
+                Vec3f testPoint = normalize(targetPoint + targetSurface->N*options.bias - orig);
+                store.originRays++;
+                // tracker the ray
+                if (targetObject->recorderEnabled)
+                    store.record(RAY_TYPE_ORIG, targetObject->traceLinks, v*targetObject->hRes + h, orig, testPoint);
+                store.currPixel = {(float)v, (float)h, 0};
+                if (options.caster == RAY_CASTER_ITERATIVE)
+                    forwordCastRayIterative(store, orig, testPoint, objects, lights[l]->intensity, options, 0,
+                                            targetObject, targetSurface, targetPoint);
+                else
+                    forwordCastRay(store, orig, testPoint, objects, lights[l]->intensity, options, 0, targetObject, targetSurface, targetPoint);
+                store.endRecord();
+                store.currPath = nullptr;
+            }
+        }
+    });
+
+    for (uint32_t w = 0; w < workerStores.size(); w++)
+        rayStore.merge(*workerStores[w]);
+    for (uint32_t i=0; i<objects.size(); i++) {
+        objects[i]->reduceDiffuseAmt();
+        rayStore.dumpObjectTraceLink(objects, i, 0, 0);
+        // dump object shadepoint as ppm file
+        objects[i]->dumpSurface(options);
+    }
+}
+
+/* lightRender the object from light, only the targets flagged by tracker if there is one */
 void lightRender(
     RayStore &rayStore,
     const Options &options,
     const std::vector<std::unique_ptr<Object>> &objects,
-    const std::vector<std::unique_ptr<Light>> &lights)
+    const std::vector<std::unique_ptr<Light>> &lights,
+    BakeTracker *tracker = nullptr)
 {
+    ThreadPool pool(renderThreads(rayStore, options, objects));
+    if (pool.size() > 1) {
+        lightRenderParallel(rayStore, pool, options, objects, lights, tracker);
+        return;
+    }
+
     Object *targetObject;
     Surface *targetSurface;
     Vec3f   targetPoint;
@@ -708,6 +1516,11 @@ void lightRender(
                 targetSurface = targetObject->getSurfaceByVH(v, h, &targetPoint);
                 if (targetSurface == nullptr)
                     continue;
+                if (tracker != nullptr) {
+                    if (!tracker->lightDirty[i][v*objects[i]->hRes + h]) continue;
+                    rayStore.currPath = &tracker->lightPaths[i][v*objects[i]->hRes + h];
+                    rayStore.pathFar = tracker->pathFar;
+                }
                 // dir of forwordCastRay is relative to orig
                 // dir = center + P.rel(theta, phi)*radius - orig
                 // set the test point a little bit far away the center of sphere. test point is rel address from orig.
@@ -729,7 +1542,13 @@ void lightRender(
                             testPoint.x,testPoint.y, testPoint.z);
     */
                 rayStore.currPixel = {(float)v, (float)h, 0};
-                forwordCastRay(rayStore, orig, testPoint, objects, lights[l]->intensity, options, 0, targetObject, targetSurface, targetPoint);
+                if (options.caster == RAY_CASTER_ITERATIVE)
+                    forwordCastRayIterative(rayStore, orig, testPoint, objects, lights[l]->intensity, options, 0,
+                                            targetObject, targetSurface, targetPoint);
+                else
+                    forwordCastRay(rayStore, orig, testPoint, objects, lights[l]->intensity, options, 0, targetObject, targetSurface, targetPoint);
+                rayStore.endRecord();
+                rayStore.currPath = nullptr;
                 //std::printf("light[%d]:%.0f%%\r",l, (h*vRes+v)*100.0/(vRes*hRes));
                 }
             }
@@ -740,6 +1559,34 @@ void lightRender(
     }
 }
 
+// [comment]
+// lightRender keeping the contribution of each light in bake. Only the lights which are new,
+// moved or re-intensified since the last call are cast, each one alone from a cleared
+// diffuseAmt, then diffuseAmt is rebuilt as the sum of the contributions of the lights.
+// [/comment]
+void lightRenderIncremental(
+    RayStore &rayStore,
+    const Options &options,
+    const std::vector<std::unique_ptr<Object>> &objects,
+    const std::vector<std::unique_ptr<Light>> &lights,
+    LightBake &bake)
+{
+    // the contributions are for this scene whatever the lights
+    bake.setScene(BakeCache::sceneHash(options, objects, std::vector<std::unique_ptr<Light>>()));
+    bake.prune(lights);
+    std::vector<uint32_t> stale = bake.staleLights(lights);
+    for (uint32_t k=0; k<stale.size(); k++) {
+        std::vector<std::unique_ptr<Light>> single;
+        single.push_back(std::unique_ptr<Light>(new Light(*lights[stale[k]])));
+        LightBake::clearDiffuseAmt(objects);
+        lightRender(rayStore, options, objects, single);
+        bake.add(*lights[stale[k]], objects);
+    }
+    bake.apply(lights, objects);
+    std::printf("light bake: %lu of %lu lights re-baked\n", stale.size(), lights.size());
+    for (uint32_t i=0; i<objects.size(); i++)
+        objects[i]->dumpSurface(options);
+}
 
 // [comment]
 // The main eyeRender function. This where we iterate over all pixels in the image, generate
@@ -759,58 +1606,126 @@ void eyeRender(
     Vec3f orig = viewpoint;
     // change the camera to world
 #ifdef CAMERATOWORLD
-    Vec3f origWorld, dirWorld;
     Matrix44f cameraToWorld(orig, orig+Vec3f{0.,0.,-1.});
     std::cout << cameraToWorld << std::endl;
 #endif
     Vec3f *framebuffer = new Vec3f[options.width * options.height];
-    Vec3f *pix = framebuffer;
     float scale = tan(deg2rad(options.fov * 0.5));
     float imageAspectRatio = options.width / (float)options.height;
     //Vec3f orig(0);
+
+    // each worker counts its rays in its own store, merged into rayStore at the end
+    ThreadPool pool(renderThreads(rayStore, options, objects));
+    std::vector<std::unique_ptr<RayStore>> workerStores;
+    for (uint32_t w = 0; w < pool.size(); w++)
+        workerStores.push_back(std::unique_ptr<RayStore>(new RayStore(rayStore, w)));
+    uint32_t tilesX = (options.width + RENDER_TILE_SIZE - 1) / RENDER_TILE_SIZE;
+    uint32_t tilesY = (options.height + RENDER_TILE_SIZE - 1) / RENDER_TILE_SIZE;
+
+    // direction of the primary ray of pixel (i, j)
+    auto primaryDir = [&](uint32_t i, uint32_t j) -> Vec3f {
 #if 1
-    for (uint32_t j = 0; j < options.height; ++j) {
-        for (uint32_t i = 0; i < options.width; ++i) {
-            // generate primary ray direction
-            float x = (2 * (i + 0.5) / (float)options.width - 1) * imageAspectRatio * scale;
-            float y = (1 - 2 * (j + 0.5) / (float)options.height) * scale;
-            Vec3f dir = normalize(Vec3f(x, y, -1));
-            rayStore.originRays++;
-            rayStore.currPixel = {(float)j, (float)i, -1.0};
-            // tracker the ray
-            rayStore.record(RAY_TYPE_ORIG, rayStore.eyeTraceLinks, j*VIEW_WIDTH+i, orig, dir);
+        // generate primary ray direction
+        float x = (2 * (i + 0.5) / (float)options.width - 1) * imageAspectRatio * scale;
+        float y = (1 - 2 * (j + 0.5) / (float)options.height) * scale;
+        return normalize(Vec3f(x, y, -1));
 
 //DEBUG by LEO to compare backward tracing and forward tracing
 #else
-    for (uint32_t i = 0; i < options.width; ++i) {
-        for (uint32_t j = 0; j < options.height; ++j) {
-            Object *obj = objects[1].get();
-            uint32_t h = (uint32_t)((float)j * obj->hRes / options.height);
-            uint32_t v = (uint32_t)((float)i * obj->vRes / options.width);
-            Vec3f  worldTarget;
-            obj->getSurfaceByVH(v, h, &worldTarget);
-            Vec3f dir = normalize(worldTarget-orig);
-
-
+        Object *obj = objects[1].get();
+        uint32_t h = (uint32_t)((float)j * obj->hRes / options.height);
+        uint32_t v = (uint32_t)((float)i * obj->vRes / options.width);
+        Vec3f  worldTarget;
+        obj->getSurfaceByVH(v, h, &worldTarget);
+        return normalize(worldTarget-orig);
+#endif
+    };
+#ifdef CAMERATOWORLD
+    Vec3f origWorld;
+    cameraToWorld.multVecMatrix(orig, origWorld);
+#else
+    Vec3f origWorld = orig;
 #endif
 
+    // [comment]
+    // The primary rays of a block of RAY_PACKET_WIDTH*RAY_PACKET_WIDTH pixels are coherent:
+    // they are traced together as one packet, then each pixel goes on from its own hit and
+    // its secondary rays are traced one by one, or the rays of the whole tile are cast by
+    // waves with RAY_CASTER_WAVEFRONT.
+    // [/comment]
+    std::vector<Wavefront> wavefronts(pool.size());
+    pool.run(tilesX * tilesY, [&](uint32_t tile, uint32_t worker) {
+        RayStore &store = *workerStores[worker];
+        uint32_t jStart = tile / tilesX * RENDER_TILE_SIZE, iStart = tile % tilesX * RENDER_TILE_SIZE;
+        uint32_t jEnd = std::min(jStart + RENDER_TILE_SIZE, options.height);
+        uint32_t iEnd = std::min(iStart + RENDER_TILE_SIZE, options.width);
+        RayPacket packet;
+        Vec3f dirs[RAY_PACKET_SIZE];
+        Wavefront &wave = wavefronts[worker];
+        // pixel of each primary ray of the wavefront
+        std::vector<Vec3f *> wavePixels;
+        wave.clear();
+        for (uint32_t jBlock = jStart; jBlock < jEnd; jBlock += RAY_PACKET_WIDTH) {
+            for (uint32_t iBlock = iStart; iBlock < iEnd; iBlock += RAY_PACKET_WIDTH) {
+                uint32_t jBlockEnd = std::min(jBlock + RAY_PACKET_WIDTH, jEnd);
+                uint32_t iBlockEnd = std::min(iBlock + RAY_PACKET_WIDTH, iEnd);
+                packet.reset(origWorld);
+                for (uint32_t j = jBlock; j < jBlockEnd; ++j) {
+                    for (uint32_t i = iBlock; i < iBlockEnd; ++i) {
+                        Vec3f dir = primaryDir(i, j);
+                        dirs[packet.size] = dir;
 #ifdef CAMERATOWORLD
-            cameraToWorld.multVecMatrix(orig, origWorld);
-            cameraToWorld.multDirMatrix(dir, dirWorld);
-            dirWorld.normalize();
-            *(pix++) = backwardCastRay(rayStore, origWorld, dirWorld, objects, lights, options, 0, withLightRender, withObjectRender);
+                        Vec3f dirWorld;
+                        cameraToWorld.multDirMatrix(dir, dirWorld);
+                        dirWorld.normalize();
+                        packet.add(dirWorld);
 #else
-            *(pix++) = backwardCastRay(rayStore, orig, dir, objects, lights, options, 0, withLightRender, withObjectRender);
+                        packet.add(dir);
 #endif
+                    }
+                }
+                packet.bound();
+                tracePacket(packet, objects);
+
+                uint32_t r = 0;
+                for (uint32_t j = jBlock; j < jBlockEnd; ++j) {
+                    for (uint32_t i = iBlock; i < iBlockEnd; ++i, ++r) {
+                        store.originRays++;
+                        store.currPixel = {(float)j, (float)i, -1.0};
+                        // tracker the ray
+                        store.record(RAY_TYPE_ORIG, store.eyeTraceLinks, j*VIEW_WIDTH+i, orig, dirs[r]);
+                        Vec3f *pix = framebuffer + j*options.width + i;
+                        TraceHit hit;
+                        resolveRayHit(packet, r, objects, hit);
+                        if (options.caster == RAY_CASTER_WAVEFRONT) {
+                            wave.addPrimary(origWorld, packet.direction(r), hit, store.currRay);
+                            wavePixels.push_back(pix);
+                        }
+                        else if (options.caster == RAY_CASTER_ITERATIVE)
+                            *pix = backwardCastRayIterative(store, origWorld, packet.direction(r), objects, lights, options, 0,
+                                                            withLightRender, withObjectRender, nullptr, &hit);
+                        else
+                            *pix = backwardCastRay(store, origWorld, packet.direction(r), objects, lights, options, 0,
+                                                   withLightRender, withObjectRender, nullptr, &hit);
+                        store.endRecord();
 
 #if 0
-            std::cout << "oooo===" << v << "," << h << "," << 0 << "," << 0 << *(pix-1) << "===" << std::endl;
-            std::cout << dir << std::endl;
-//            std::printf("%.0f%%\r",(j*options.width+i)*100.0/(options.width * options.height));
+                        std::cout << "oooo===" << *pix << "===" << std::endl;
+                        std::cout << dirs[r] << std::endl;
 #endif
+                    }
+                }
+            }
         }
-        //std::printf("%f\r",(j*1.0/options.height));
-    }
+        if (options.caster == RAY_CASTER_WAVEFRONT) {
+            castWavefront(store, wave, store.eyeTraceLinks, objects, lights, options, withLightRender, withObjectRender);
+            for (uint32_t p = 0; p < wavePixels.size(); p++)
+                *wavePixels[p] = wave.nodes[p].color;
+        }
+    });
+
+    for (uint32_t w = 0; w < workerStores.size(); w++)
+        rayStore.merge(*workerStores[w]);
 
     // save framebuffer to file
     std::ofstream ofs;
@@ -918,6 +1833,15 @@ int main(int argc, char **argv)
     options[0].doTraditionalRender = true;
     options[0].doRenderAfterDiffusePreprocess = true;
     options[0].doRenderAfterDiffuseAndReflectPreprocess = true;
+    // all hardware threads
+    options[0].threads = 0;
+    // bake every run unless a cache file is given: cloudray --bake-cache <file>
+    options[0].bakeCache = nullptr;
+    for (int32_t i = 1; i + 1 < argc; i++)
+        if (std::string(argv[i]) == "--bake-cache")
+            options[0].bakeCache = argv[i + 1];
+    options[0].caster = RAY_CASTER_RECURSIVE;
+    options[0].sortRays = false;
 
 /*
     options[0].viewpoints[0] = Vec3f(0, 5, 0);
@@ -1001,21 +1925,59 @@ int main(int argc, char **argv)
                 "origin", "reflect", "refract", "diffuse", 
                 "nohit", "invis", "weak", "overflow", "CPU(Rays)", "TIME(S)", "MEM(GB)");
     time_t start, end;
+    // contributions of each light, kept from one options to the next
+    LightBake lightBake;
+    // what the last bake went through, to re-bake only what an object change reaches
+    BakeTracker bakeTracker;
     //std::printf("split\t depth\t total\t origin\t reflect\t refract\t diffuse\t nohit\t invis\t overflow\t CPUConsumed\n");
     for (int i =0; i<sizeof(options)/sizeof(struct Options); i++){
         if(options[i].width == 0) break;
 
-        for (uint32_t i=0; i<objects.size(); i++) {
-            objects[i]->reset();
+        bool tracking = options[i].trackDirtyRegions &&
+            (options[i].doRenderAfterDiffusePreprocess == true || options[i].doRenderAfterDiffuseAndReflectPreprocess == true);
+        for (uint32_t k=0; k<objects.size(); k++) {
+            // the shade points of a tracked object keep their bake until it changes
+            if (!tracking || !bakeTracker.isBaked(k, objects[k].get()))
+                objects[k]->reset();
+        }
+        buildObjectsBVH(objects);
+        if (tracking) {
+            bakeTracker.update(options[i], objects, lights);
+            std::printf("bake tracker: %u light targets and %u angle surfaces to bake again\n",
+                        bakeTracker.lightDirtyNum, bakeTracker.angleDirtyNum);
         }
 
-        if (options[i].doRenderAfterDiffusePreprocess == true || options[i].doRenderAfterDiffuseAndReflectPreprocess == true) {
+        // skip lightRender and objectRender if they are baked in the cache already
+        BakeCache bakeCache;
+        uint64_t bakeHash = BakeCache::sceneHash(options[i], objects, lights);
+        bool baked = false;
+        if (options[i].bakeCache != nullptr && !tracking &&
+            (options[i].doRenderAfterDiffusePreprocess == true || options[i].doRenderAfterDiffuseAndReflectPreprocess == true)) {
+            start = time(NULL);
+            baked = bakeCache.load(options[i].bakeCache, bakeHash, objects);
+            end = time(NULL);
+            if (baked) {
+                std::printf("###bake cache %s loaded in %.0fs###\n", options[i].bakeCache, difftime(end, start));
+                for (uint32_t k=0; k<objects.size(); k++) {
+                    objects[k]->dumpSurface(options[i]);
+                    if (objects[k]->surfaceAngleRatio > 0.)
+                        objects[k]->dumpSurfaceAngles(options[i]);
+                }
+            }
+        }
+
+        if (!baked && (options[i].doRenderAfterDiffusePreprocess == true || options[i].doRenderAfterDiffuseAndReflectPreprocess == true)) {
             // do lightRender
             // setting up ray store
             rayStore = new RayStore(options[i]);
             // caculate time consumed
             start = time(NULL);
-            lightRender(*rayStore, options[i], objects, lights);
+            if (tracking)
+                lightRender(*rayStore, options[i], objects, lights, &bakeTracker);
+            else if (options[i].incrementalLightRender)
+                lightRenderIncremental(*rayStore, options[i], objects, lights, lightBake);
+            else
+                lightRender(*rayStore, options[i], objects, lights);
             end = time(NULL);
             std::printf("###pre render for doRenderAfterDiffusePreprocess & doRenderAfterDiffuseAndReflectPreprocess from light###\n");
             std::printf("%-10u %-10u %-10u %-10u %-10u %-10u %-10u %-10u %-10u %-10u %-10u %-10.0f %-10.2f\n",
@@ -1056,14 +2018,14 @@ int main(int argc, char **argv)
             }
         }
 
-        if (options[i].doRenderAfterDiffuseAndReflectPreprocess == true) {
+        if (!baked && options[i].doRenderAfterDiffuseAndReflectPreprocess == true) {
             // do objectRender
             // setting up ray store
             rayStore = new RayStore(options[i]);
             // caculate time consumed
             std::printf("###pre render for doRenderAfterDiffuseAndReflectPreprocess from object surface angle###\n");
             start = time(NULL);
-            objectRender(*rayStore, options[i], objects, lights);
+            objectRender(*rayStore, options[i], objects, lights, tracking ? &bakeTracker : nullptr);
             end = time(NULL);
             std::printf("%-10u %-10u %-10u %-10u %-10u %-10u %-10u %-10u %-10u %-10u %-10u %-10.0f %-10.2f\n",
                         options[i].diffuseSpliter, options[i].maxDepth,
@@ -1071,7 +2033,13 @@ int main(int argc, char **argv)
                         rayStore->nohitRays, rayStore->invisibleRays, rayStore->weakRays, rayStore->overflowRays, 
                         rayStore->totalRays, difftime(end, start), rayStore->totalMem*1.0/(1024.0*1024.0*1024.0));
             delete rayStore;
+            if (options[i].bakeCache != nullptr && !tracking)
+                BakeCache::save(options[i].bakeCache, bakeHash, objects);
+        }
+        if (tracking)
+            bakeTracker.commit(objects);
 
+        if (options[i].doRenderAfterDiffuseAndReflectPreprocess == true) {
             // do post render from eyes after lightRender
             // calcule all the viewpoints with same options 
             std::printf("###post render for doRenderAfterDiffuseAndReflectPreprocess###\n");
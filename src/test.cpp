@@ -1,18 +1,42 @@
+/*********************************************************
+    Checks of the intersection kernels
+    Usage: c++ -O2 -std=c++11 -o test test.cpp
+    With -march flags enabling FMA, add -ffp-contract=off
+    or the compiler fuses the scalar reference differently.
+*********************************************************/
+
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <vector>
+#include <cstdint>
+#include <iostream>
+#include <fstream>
+#include <cmath>
+#include <limits>
+#include <cstring>
+#include <string>
+#include <assert.h>
+
+#include "Values.h"
 #include "Vec2.h"
 #include "Vec3.h"
 #include "Matrix44.h"
-#include "utils.h"
-#define MY_UINT64_T     uint64_t
-#define VIEW_WIDTH      640
-#define VIEW_HEIGHT     480
-#define RAY_CAST_DESITY 0.1
+#include "Utils.h"
+#include "TriangleBlock.h"
+#include "Packing.h"
+#include "AngleBins.h"
+#include "SphericalHarmonics.h"
+#include "Surface.h"
+#include "RayPacket.h"
 
-int main(){
-    Vec3f x = Vec3f(1, 0, 0);
-    Vec3f y = Vec3f(0, 1, 0);
-    Vec3f z = Vec3f(0, 0, 1);
-    float low = 0., high = 1., value = 0.65;
-    float deg = 90.;
+static float randf(float lo, float hi)
+{
+    return lo + (hi - lo) * rand() / RAND_MAX;
+}
+
+int testRayTriangle(void)
+{
     Vec3f v0 = Vec3f(1,0,0), v1 = Vec3f(0, 1, 0), v2 = Vec3f(0, 0, 1);
     Vec3f orig = Vec3f(0, 0, 0);
     Vec3f dir = Vec3f(2, 2, 2);
@@ -23,5 +47,279 @@ int main(){
     else
         std::cout<<"unhitted"<<std::endl;
     std::cout<<tnear<<std::endl;
+    return hitted ? 0 : 1;
+}
+
+// [comment]
+// The block kernels, scalar and SIMD, must return exactly what rayTriangleIntersect()
+// returns for the closest of the triangles of a block.
+// [/comment]
+int testTriangleBlock(void)
+{
+    uint32_t failed = 0, hits = 0;
+    srand(3);
+    for (uint32_t n = 0; n < 200000; n++) {
+        Vec3f p[TRI_BLOCK_WIDTH][3];
+        TriangleBlock block;
+        block.clear();
+        // leave some lanes empty
+        uint32_t lanes = 1 + n % TRI_BLOCK_WIDTH;
+        for (uint32_t lane = 0; lane < lanes; lane++) {
+            for (uint32_t i = 0; i < 3; i++)
+                p[lane][i] = Vec3f(randf(-1, 1), randf(-1, 1), randf(-5, -3));
+            block.set(lane, lane, p[lane][0], p[lane][1], p[lane][2]);
+        }
+        Vec3f orig(randf(-0.5, 0.5), randf(-0.5, 0.5), randf(-1, 1));
+        Vec3f dir = normalize(Vec3f(randf(-0.5, 0.5), randf(-0.5, 0.5), -1));
+
+        float tRef = kInfinity, uRef = 0, vRef = 0;
+        uint32_t idxRef = 0;
+        bool hitRef = false;
+        for (uint32_t lane = 0; lane < lanes; lane++) {
+            float tK, uK, vK;
+            if (rayTriangleIntersect(orig, dir, p[lane][0], p[lane][1], p[lane][2], tK, uK, vK) && tK < tRef) {
+                tRef = tK; uRef = uK; vRef = vK; idxRef = lane;
+                hitRef = true;
+            }
+        }
+        hits += hitRef;
+
+        float tS = kInfinity, uS = 0, vS = 0, tV = kInfinity, uV = 0, vV = 0;
+        uint32_t idxS = 0, idxV = 0;
+        bool hitS = intersectTriangleBlockScalar(block, orig, dir, tS, idxS, uS, vS);
+        bool hitV = intersectTriangleBlock(block, orig, dir, tV, idxV, uV, vV);
+        if (hitS != hitRef || hitV != hitRef ||
+            (hitRef && (tS != tRef || uS != uRef || vS != vRef || idxS != idxRef ||
+                        tV != tRef || uV != uRef || vV != vRef || idxV != idxRef))) {
+            if (failed++ < 10)
+                std::printf("mismatch #%u: ref(%d,%u,%.9g,%.9g,%.9g) scalar(%d,%u,%.9g,%.9g,%.9g) block(%d,%u,%.9g,%.9g,%.9g)\n",
+                            n, hitRef, idxRef, tRef, uRef, vRef, hitS, idxS, tS, uS, vS, hitV, idxV, tV, uV, vV);
+        }
+    }
+    std::printf("triangle block (width %d): %u hits, %u mismatches\n", TRI_BLOCK_WIDTH, hits, failed);
+    return failed == 0 ? 0 : 1;
+}
+
+// [comment]
+// Round trip of the compact encodings must stay within their documented error.
+// [/comment]
+int testPacking(void)
+{
+    uint32_t failed = 0;
+    float maxAngle = 0, maxColorError = 0;
+    srand(5);
+    for (uint32_t n = 0; n < 100000; n++) {
+        Vec3f dir = normalize(Vec3f(randf(-1, 1), randf(-1, 1), randf(-1, 1)));
+        // the axes and the folded edges of the octahedron
+        if (n < 6) {
+            dir = 0;
+            dir[n / 2] = (n % 2) ? -1 : 1;
+        }
+        Vec3f back = unpackOctahedral(packOctahedral(dir));
+        float angle = atan2f(crossProduct(dir, back).length(), dotProduct(dir, back));
+        maxAngle = std::max(maxAngle, angle);
+
+        Vec3f color(randf(0, 1), randf(0, 1), randf(0, 1));
+        color *= powf(2, randf(-10, 10));
+        Vec3f unpacked = unpackRGB9E5(packRGB9E5(color));
+        float maxc = std::max(color.x, std::max(color.y, color.z));
+        for (uint32_t i = 0; i < 3; i++)
+            maxColorError = std::max(maxColorError, std::fabs(unpacked[i] - color[i]) / maxc);
+    }
+    if (maxAngle > 1e-4) failed++;
+    if (maxColorError > 1.f / 512) failed++;
+    if (unpackRGB9E5(packRGB9E5(Vec3f(0))) != Vec3f(0)) failed++;
+    std::printf("packing: octahedral max error %g rad, RGB9E5 max relative error %g, %u failures\n",
+                maxAngle, maxColorError, failed);
+    return failed == 0 ? 0 : 1;
 }
 
+// [comment]
+// The fast direction to bin mapping must agree with acos/atan2 on at least 99.9% of the
+// directions, for the angle grids of the shade points and the shade point grid of a sphere.
+// [/comment]
+int testAngleBins(void)
+{
+    uint32_t failed = 0;
+    const float grids[][3] = {{90, 91 * 0.5, 360 * 0.5}, {90, 91, 360}, {90, 91 * 4, 360 * 4}, {181, 181 * 2, 360 * 2}};
+    srand(11);
+    for (uint32_t g = 0; g < sizeof(grids) / sizeof(grids[0]); g++) {
+        AngleBins bins(grids[g][0], grids[g][1], grids[g][2]);
+        uint32_t num = 200000, agree = 0;
+        for (uint32_t n = 0; n < num; n++) {
+            Vec3f dir = normalize(Vec3f(randf(-1, 1), randf(-1, 1), randf(-1, 1)));
+            // the poles, x = -0 gives phi 180
+            if (n < 4) dir = Vec3f((n & 2) ? -0.f : 0.f, (n & 1) ? -1 : 1, 0);
+            uint32_t v, h, vExact, hExact;
+            bins.lookup(dir, v, h);
+            bins.lookupExact(dir, vExact, hExact);
+            if (v == vExact && h == hExact) agree++;
+        }
+        double ratio = (double)agree / num;
+        if (ratio < 0.999) failed++;
+        std::printf("angle bins: range %.0f, %ux%u bins, %.4f%% agree with acos/atan2\n",
+                    grids[g][0], bins.vRes, bins.hRes, ratio * 100);
+    }
+
+    // concentric bins of the hemisphere and octahedral bins of the sphere: the center of every
+    // bin maps back to it, and every bin gets the same share of uniform directions
+    const AngleMapping mappings[] = {ANGLE_MAPPING_CONCENTRIC, ANGLE_MAPPING_OCTAHEDRAL};
+    for (uint32_t m = 0; m < 2; m++) {
+        uint32_t n = 16, samples = 1000000, misplaced = 0;
+        AngleBins equalArea(90, n, n, mappings[m]);
+        for (uint32_t v = 0; v < n; v++) {
+            for (uint32_t h = 0; h < n; h++) {
+                uint32_t vBin, hBin;
+                equalArea.lookup(equalArea.direction(v, h), vBin, hBin);
+                if (vBin != v || hBin != h) misplaced++;
+            }
+        }
+        std::vector<uint32_t> counts(n * n, 0);
+        for (uint32_t k = 0; k < samples; k++) {
+            // y uniform in [0,1] ([-1,1]) is uniform in solid angle on the hemisphere (sphere)
+            float y = randf(m == 0 ? 0 : -1, 1), phi = randf(0, 2 * M_PI), r = sqrtf(1 - y * y);
+            uint32_t v, h;
+            equalArea.lookup(Vec3f(r * cosf(phi), y, r * sinf(phi)), v, h);
+            counts[v * n + h]++;
+        }
+        float expected = (float)samples / (n * n), maxDeviation = 0;
+        for (uint32_t b = 0; b < n * n; b++)
+            maxDeviation = std::max(maxDeviation, std::fabs(counts[b] - expected) / expected);
+        // 6 sigma of the count of a bin
+        if (misplaced > 0 || maxDeviation > 6 / sqrtf(expected)) failed++;
+        std::printf("angle bins: %s %ux%u bins, %u centers misplaced, solid angle within %.2f%%\n",
+                    m == 0 ? "concentric" : "octahedral", n, n, misplaced, maxDeviation * 100);
+    }
+    return failed == 0 ? 0 : 1;
+}
+
+int testSphericalHarmonics(void)
+{
+    uint32_t failed = 0;
+    // the basis is orthonormal: integrated over the equal area bins of the sphere
+    uint32_t n = 256, num = shCoeffsNum(SH_ORDER_MAX);
+    AngleBins sphere(181, n, n, ANGLE_MAPPING_OCTAHEDRAL);
+    std::vector<double> gram(num * num, 0);
+    float basis[SH_COEFFS_MAX];
+    for (uint32_t v = 0; v < n; v++) {
+        for (uint32_t h = 0; h < n; h++) {
+            evalSH(SH_ORDER_MAX, sphere.direction(v, h), basis);
+            for (uint32_t i = 0; i < num; i++)
+                for (uint32_t j = 0; j < num; j++)
+                    gram[i * num + j] += basis[i] * basis[j] * sphere.solidAngle(v, h);
+        }
+    }
+    double maxGramError = 0;
+    for (uint32_t i = 0; i < num; i++)
+        for (uint32_t j = 0; j < num; j++)
+            maxGramError = std::max(maxGramError, std::fabs(gram[i * num + j] - (i == j)));
+    if (maxGramError > 5e-3) failed++;
+    std::printf("spherical harmonics: %u bands, orthonormal within %.5f\n", SH_ORDER_MAX + 1, maxGramError);
+
+    // colors of the hemisphere whose mirror below it is within band 2 are rebuilt from the
+    // projection of their angle grid, up to the sampling of the bins
+    const AngleMapping mappings[] = {ANGLE_MAPPING_POLAR, ANGLE_MAPPING_CONCENTRIC};
+    srand(13);
+    for (uint32_t m = 0; m < 2; m++) {
+        Surface surface;
+        uint32_t vRes, hRes;
+        Surface::angleRes(1, mappings[m], vRes, hRes);
+        AngleBins bins(90, vRes, hRes, mappings[m]);
+        std::vector<SurfaceAngle> slab(vRes * hRes);
+        surface.init(1, mappings[m], slab.data(), &bins);
+        Vec3f coeffs[SH_COEFFS_MAX];
+        surface.sh = coeffs;
+        surface.shOrder = SH_ORDER_MAX;
+        for (uint32_t k = 0; k < num; k++)
+            coeffs[k] = 0;
+        auto color = [](const Vec3f &d) {
+            return Vec3f(0.5 + 0.3 * d.x, 0.2 + 0.4 * d.y * d.y, 0.3 + 0.2 * d.x * d.z - 0.1 * d.z);
+        };
+        for (uint32_t v = 0; v < vRes; v++)
+            for (uint32_t h = 0; h < hRes; h++)
+                surface.projectSH(coeffs, v, h, color(bins.direction(v, h)));
+        float maxError = 0;
+        for (uint32_t k = 0; k < 100000; k++) {
+            float y = randf(0, 1), phi = randf(0, 2 * M_PI), r = sqrtf(1 - y * y);
+            Vec3f dir(r * cosf(phi), y, r * sinf(phi));
+            Vec3f error = surface.getColorBySHLocal(dir) - color(dir);
+            maxError = std::max(maxError, std::max(std::fabs(error.x), std::max(std::fabs(error.y), std::fabs(error.z))));
+        }
+        if (maxError > 1e-3) failed++;
+        std::printf("spherical harmonics: %s %ux%u bins projected, rebuilt within %.5f\n",
+                    m == 0 ? "polar" : "concentric", vRes, hRes, maxError);
+    }
+    return failed == 0 ? 0 : 1;
+}
+
+int testTangentFrame(void)
+{
+    // the frame built from N is orthonormal, with N as local y, and local to world and back
+    // gives the direction again, for random normals and the axes
+    srand(17);
+    float maxError = 0;
+    for (uint32_t n = 0; n < 100000; n++) {
+        Surface surface;
+        Vec3f normal = normalize(Vec3f(randf(-1, 1), randf(-1, 1), randf(-1, 1)));
+        if (n < 6) normal = Vec3f(n / 2 == 0, n / 2 == 1, n / 2 == 2) * ((n & 1) ? -1.f : 1.f);
+        surface.reset(0, normal);
+        Vec3f t, b;
+        surface.tangents(t, b);
+        Vec3f dir = normalize(Vec3f(randf(-1, 1), randf(-1, 1), randf(-1, 1)));
+        Vec3f back = surface.worldToLocal(surface.localToWorld(dir)) - dir;
+        Vec3f y = surface.localToWorld(Vec3f(0, 1, 0)) - normal;
+        float errors[] = {dotProduct(t, t) - 1, dotProduct(b, b) - 1, dotProduct(t, b), dotProduct(t, normal),
+                          dotProduct(b, normal), back.length(), y.length()};
+        for (uint32_t e = 0; e < sizeof(errors) / sizeof(errors[0]); e++)
+            maxError = std::max(maxError, std::fabs(errors[e]));
+    }
+    std::printf("tangent frame: orthonormal within %.7f\n", maxError);
+    return maxError > 1e-5 ? 1 : 0;
+}
+
+int testRayPacket(void)
+{
+    // mayHit() never rejects a box that the slab test of one ray of the packet accepts,
+    // for packets of close directions, of spread directions and with axis aligned rays
+    srand(19);
+    uint32_t accepted = 0, culled = 0, wrong = 0;
+    for (uint32_t n = 0; n < 20000; n++) {
+        RayPacket packet;
+        packet.reset(Vec3f(randf(-5, 5), randf(-5, 5), randf(-5, 5)));
+        Vec3f center = normalize(Vec3f(randf(-1, 1), randf(-1, 1), randf(-1, 1)));
+        float spread = (n % 2) ? 0.05f : 0.5f;
+        for (uint32_t r = 0; r < RAY_PACKET_SIZE; r++) {
+            Vec3f dir = normalize(center + Vec3f(randf(-spread, spread), randf(-spread, spread), randf(-spread, spread)));
+            if (n % 7 == 0 && r == 0) dir = Vec3f(0, 0, -1);
+            packet.add(dir);
+            packet.tNear[r] = (n % 3) ? kInfinity : randf(1, 20);
+        }
+        packet.bound();
+        Vec3f corner(randf(-10, 10), randf(-10, 10), randf(-10, 10));
+        BBox box(corner, corner + Vec3f(randf(0, 4), randf(0, 4), randf(0, 4)));
+        bool rayHit = false;
+        for (uint32_t r = 0; r < packet.size; r++) {
+            float tEnter;
+            rayHit |= box.intersect(packet.orig, packet.inverseDirection(r), packet.tNear[r], tEnter);
+        }
+        bool packetHit = packet.mayHit(box);
+        if (rayHit && !packetHit) wrong++;
+        if (packetHit) accepted++;
+        if (!rayHit && !packetHit) culled++;
+    }
+    std::printf("ray packet: %u boxes kept, %u culled, %u wrongly culled\n", accepted, culled, wrong);
+    return wrong > 0 ? 1 : 0;
+}
+
+int main(){
+    int failed = 0;
+    failed += testRayTriangle();
+    failed += testTriangleBlock();
+    failed += testPacking();
+    failed += testAngleBins();
+    failed += testSphericalHarmonics();
+    failed += testTangentFrame();
+    failed += testRayPacket();
+    std::printf("%s\n", failed == 0 ? "PASS" : "FAIL");
+    return failed;
+}